@@ -1,13 +1,32 @@
-var nfc = require('../src/build/Release/nfc.node')
-  , Q = require('q');
+var loadStart = process.hrtime()
+  , nfc = require('../src/build/Release/nfc.node')
+  , loadTime = process.hrtime(loadStart)
+  , Q = require('q')
+  , net = require('net')
+  , EventEmitter = require('events')
+  , Readable = require('stream').Readable;
 
 
-var context = new nfc.Context();
+// Created on first use, so that requiring the module does not set up libnfc.
+var context = null;
+
+function getContext() {
+    if (!context) {
+        context = new nfc.Context();
+    }
+    return context;
+}
 
 
 class Target {
-    constructor(target) {
+    // cardType if it is known from elsewhere, e.g. a reader daemon which probed the card
+    constructor(target, cardType) {
         this.target = target;
+        this.knownCardType = cardType;
+    }
+
+    static deserialize(buffer) {
+        return new Target(nfc.Target.deserialize(buffer));
     }
 
     get modulationType() {
@@ -18,10 +37,27 @@ class Target {
         return this.target.baudRate;
     }
 
+    get supportedBaudRates() {
+        return this.target.supportedBaudRates;
+    }
+
     get info() {
         return this.target.info;
     }
 
+    get cardType() {
+        return this.knownCardType || this.target.cardType;
+    }
+
+    get results() {
+        return this.target.results;
+    }
+
+    // Small binary form of the activation data, for logs and IPC.
+    serialize() {
+        return this.target.serialize();
+    }
+
     toString() {
         return '[Device: ' + this.target.modulationTypeString + ' ' + this.target.baudRateString + ']';
     }
@@ -41,6 +77,10 @@ class Device {
         return this.device.connstring;
     }
 
+    get capabilities() {
+        return this.device.capabilities;
+    }
+
     close() {
         return this.device.close();
     }
@@ -49,10 +89,50 @@ class Device {
         return this.device.setIdle();
     }
 
-    pollTarget(timeout, period=100) {
-        var promise;
+    abort(job) {
+        return this.device.abort(job);
+    }
+
+    get preset() {
+        return this.device.preset;
+    }
+
+    get properties() {
+        return this.device.properties;
+    }
+
+    getProperty(name) {
+        return this.device.getProperty(name);
+    }
+
+    setProperty(name, value, options) {
+        return Q(this.device.setProperty(name, value, options));
+    }
+
+    applyPreset(name, options) {
+        return Q(this.device.applyPreset(name, options));
+    }
+
+    restoreProperties(options) {
+        return Q(this.device.restoreProperties(options));
+    }
+
+    pollTarget(timeout, period=100, options={}) {
+        var promise, job;
+        if (timeout && !options.deadline) {
+            // Native polls which would only finish after the timeout are not started at all.
+            options = Object.assign({}, options, {deadline: Date.now() + timeout});
+        }
         var pollTarget = device => {
-            return Q.ninvoke(device, 'pollTarget').then(target => {
+            var poll = device.pollTarget(options);
+            job = poll.job;
+            return Q(poll).fail(reason => {
+                // Cards at the edge of the field garble their answers, keep polling until the timeout.
+                if (timeout && reason.errorClass === 'rf') {
+                    return null;
+                }
+                throw reason;
+            }).then(target => {
                 if (target) {
                     return new Target(target);
                 }
@@ -68,17 +148,145 @@ class Device {
         };
         promise = pollTarget(this.device);
         if (timeout) {
-            promise = promise.timeout(timeout);
+            // Free the worker thread right away instead of waiting out the RF operation.
+            promise = promise.timeout(timeout).fail(reason => {
+                // Only our own poll, other jobs on the device go on.
+                this.device.abort(job);
+                throw reason;
+            });
         }
         return promise;
     }
 
-    isPresent(target) {
-        return Q.ninvoke(this.device, 'isPresent', target.target);
+    startPolling(options, listener) {
+        return this.device.startPolling(options || {}, events => {
+            events.forEach(event => {
+                listener(event.type, event.type === 'error' ? event.error : new Target(event.target), event.results,
+                         event.provisioning);
+            });
+        });
     }
 
-    transceive(transmit, receiveCapacity=4096) {
-        return Q.ninvoke(this.device, 'transceive', transmit, receiveCapacity);
+    createTagStream(options={}) {
+        var highWaterMark = options.highWaterMark || 16;
+        var stream = new Readable({
+            objectMode: true,
+            highWaterMark: highWaterMark,
+            read: () => this.device.resumeEvents(),
+            destroy: (error, callback) => {
+                this.device.stopPolling();
+                callback(error);
+            }
+        });
+        var started = this.device.startPolling(Object.assign({}, options, {highWaterMark: highWaterMark}), events => {
+            var more = true;
+            events.forEach(event => {
+                if (event.type !== 'error') {
+                    event.target = new Target(event.target);
+                }
+                more = stream.push(event);
+            });
+            if (!more) {
+                // Native events queue up to highWaterMark, then polling slows down.
+                this.device.pauseEvents();
+            }
+        });
+        if (!started) {
+            process.nextTick(() => stream.destroy(new Error('unable to start polling')));
+        }
+        return stream;
+    }
+
+    stopPolling() {
+        return this.device.stopPolling();
+    }
+
+    get pollingStats() {
+        return this.device.pollingStats;
+    }
+
+    get deadlineMisses() {
+        return this.device.deadlineMisses;
+    }
+
+    isPresent(target, options) {
+        return Q(this.device.isPresent(target.target, options));
+    }
+
+    reselect(target, options) {
+        return Q(this.device.reselect(target.target, options)).then(target => target && new Target(target));
+    }
+
+    transceive(transmit, receiveCapacity=4096, options) {
+        return Q(this.device.transceive(transmit, receiveCapacity, options));
+    }
+
+    transceiveBits(transmit, receiveCapacity=264, options) {
+        return Q(this.device.transceiveBits(transmit, receiveCapacity, options));
+    }
+
+    felicaRead(target, serviceCodes, blocks, options) {
+        return Q(this.device.felicaRead(target.target, serviceCodes, blocks, options));
+    }
+
+    configureCache(options) {
+        return this.device.configureCache(options);
+    }
+
+    clearCache() {
+        return this.device.clearCache();
+    }
+
+    get cacheStats() {
+        return this.device.cacheStats;
+    }
+
+    configureRetry(options) {
+        return this.device.configureRetry(options);
+    }
+
+    get retryStats() {
+        return this.device.retryStats;
+    }
+
+    get provisioningStats() {
+        return this.device.provisioningStats;
+    }
+
+    configureErrorStats(options) {
+        return this.device.configureErrorStats(options);
+    }
+
+    get errorStats() {
+        return this.device.errorStats;
+    }
+
+    desfire() {
+        return new Desfire(this.device);
+    }
+
+    depConnect(options) {
+        return Q(this.device.depConnect(options)).then(target => new Target(target));
+    }
+
+    depSend(data, options) {
+        return Q(this.device.depSend(data, options));
+    }
+
+    depReceive(options) {
+        return Q(this.device.depReceive(options));
+    }
+
+    depClose(options) {
+        return Q(this.device.depClose(options));
+    }
+
+    depServe(options) {
+        return Q(this.device.depServe(options));
+    }
+
+    serve(path, options={}) {
+        return new Daemon(this.device.serve(path, options));
     }
 
     toString() {
@@ -87,17 +295,198 @@ class Device {
 }
 
 
+class Desfire {
+    constructor(device) {
+        this.device = device;
+    }
+
+    authenticate(keyNo, key, type='aes', options) {
+        return Q(this.device.desfireAuthenticate(keyNo, key, type, options));
+    }
+
+    selectApplication(aid, options) {
+        return Q(this.device.desfireSelectApplication(aid, options));
+    }
+
+    getFileIds(options) {
+        return Q(this.device.desfireGetFileIds(options));
+    }
+
+    readData(fileNo, options={}) {
+        return Q(this.device.desfireReadData(fileNo, options));
+    }
+}
+
+
+class Daemon {
+    constructor(daemon) {
+        this.daemon = daemon;
+    }
+
+    get path() {
+        return this.daemon.path;
+    }
+
+    get stats() {
+        return this.daemon.stats;
+    }
+
+    close() {
+        return this.daemon.close();
+    }
+}
+
+
+// Frame types of the reader daemon, see src/nfc/daemon.hh.
+var frames = {
+    subscribe: 0x01, unsubscribe: 0x02, claim: 0x03, release: 0x04, transceive: 0x05,
+    ok: 0x80, error: 0x81, target: 0x90, removed: 0x91
+};
+
+
+// Client of a reader daemon.  Emits 'target' and 'removed' with the Target while subscribed, and 'close'
+// when the connection ends.
+class RemoteDevice extends EventEmitter {
+    constructor(socket) {
+        super();
+        this.socket = socket;
+        this.nextId = 1;
+        this.pending = {};
+        this.input = Buffer.alloc(0);
+        socket.on('data', data => this.receive(data));
+        socket.on('error', () => {});
+        socket.on('close', () => {
+            Object.keys(this.pending).forEach(id => this.pending[id].reject(new Error('connection closed')));
+            this.pending = {};
+            this.emit('close');
+        });
+    }
+
+    subscribe() {
+        return this.request(frames.subscribe).then(() => true);
+    }
+
+    unsubscribe() {
+        return this.request(frames.unsubscribe).then(() => true);
+    }
+
+    // Resolves once no other client can use the reader, until release() or claimTimeout ms after
+    // the last command.
+    claim(timeout=5000) {
+        var payload = Buffer.alloc(4);
+        payload.writeUInt32BE(timeout, 0);
+        return this.request(frames.claim, payload).then(() => true);
+    }
+
+    release() {
+        return this.request(frames.release).then(() => true);
+    }
+
+    transceive(transmit, receiveCapacity=4096) {
+        var capacity = Buffer.alloc(2);
+        capacity.writeUInt16BE(Math.min(receiveCapacity, 0xffff), 0);
+        return this.request(frames.transceive, Buffer.concat([capacity, Buffer.from(transmit)]));
+    }
+
+    close() {
+        this.socket.end();
+    }
+
+    request(type, payload=Buffer.alloc(0)) {
+        var id = this.nextId;
+        this.nextId = this.nextId % 0xffffffff + 1;
+        var header = Buffer.alloc(9);
+        header.writeUInt32BE(5 + payload.length, 0);
+        header.writeUInt8(type, 4);
+        header.writeUInt32BE(id, 5);
+        var deferred = Q.defer();
+        this.pending[id] = deferred;
+        this.socket.write(Buffer.concat([header, payload]));
+        return deferred.promise;
+    }
+
+    receive(data) {
+        this.input = Buffer.concat([this.input, data]);
+        while (this.input.length >= 4 && this.input.length >= 4 + this.input.readUInt32BE(0)) {
+            var length = this.input.readUInt32BE(0);
+            var type = this.input[4], id = this.input.readUInt32BE(5);
+            var payload = this.input.slice(9, 4 + length);
+            this.input = this.input.slice(4 + length);
+            if (type === frames.target || type === frames.removed) {
+                this.emit(type === frames.target ? 'target' : 'removed', parseTarget(payload));
+                continue;
+            }
+            var deferred = this.pending[id];
+            delete this.pending[id];
+            if (!deferred) {
+                continue;
+            }
+            if (type === frames.ok) {
+                deferred.resolve(payload);
+            }
+            else {
+                var error = new Error(payload.slice(4).toString());
+                error.code = payload.readInt32BE(0);
+                deferred.reject(error);
+            }
+        }
+    }
+}
+
+
+function parseTarget(payload) {
+    var length = payload[0];
+    return new Target(nfc.Target.deserialize(payload.slice(1 + length)), payload.toString('utf8', 1, 1 + length));
+}
+
+
 class NFC {
     static get version() {
-        return context.version;
+        return getContext().version;
+    }
+
+    static getDevices(options) {
+        return Q(getContext().getDevices(options));
+    }
+
+    static get pool() {
+        return getContext().pool;
+    }
+
+    static configurePool(options) {
+        return getContext().configurePool(options);
+    }
+
+    static open(connstring, options) {
+        return Q(getContext().open(connstring, options)).then(device => new Device(device));
+    }
+
+    // Opens the device and shares it on a Unix socket, see Device.serve.
+    static serve(path, options={}) {
+        return NFC.open(options.connstring, options).then(device => {
+            var daemon = device.serve(path, options);
+            // The daemon has a handle of its own.
+            device.close();
+            return daemon;
+        });
+    }
+
+    static connect(path) {
+        var deferred = Q.defer();
+        var socket = net.connect(path);
+        socket.once('connect', () => deferred.resolve(new RemoteDevice(socket)));
+        socket.once('error', error => deferred.reject(error));
+        return deferred.promise;
     }
 
-    static getDevices() {
-        return Q.ninvoke(context, 'getDevices');
+    static get Target() {
+        return Target;
     }
 
-    static open(connstring) {
-        return Q.ninvoke(context, 'open', connstring).then(device => new Device(device));
+    static get startupTimings() {
+        var timings = context ? context.timings : {init: 0, scan: 0, open: 0, scans: 0};
+        timings.load = loadTime[0] * 1e3 + loadTime[1] / 1e6;
+        return timings;
     }
 }
 
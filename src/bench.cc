@@ -0,0 +1,229 @@
+// Microbenchmarks for the glue layer, run by test/bench.js.
+#include "nfc/util.hh"
+#include <node_api.h>
+
+
+namespace bench {
+
+  using nfc::Arguments;
+  using nfc::fromJS;
+  using nfc::toJS;
+
+
+  static volatile size_t sink;
+
+
+  class RawCounter:
+    public nfc::RawObject<RawCounter, size_t>
+  {
+  public:
+    RawCounter(size_t *value = NULL)
+      : RawObject(value)
+    {
+    }
+
+    static void destroy(size_t *value) {
+      delete value;
+    }
+  };
+
+
+  // Minimal wrapped class to measure ObjectWrap and AsyncRunner on their own.
+  class Payload:
+    public nfc::ObjectWrap<Payload>
+  {
+  public:
+    uint32_t value;
+
+    Payload(uint32_t value_)
+      : value(value_)
+    {
+    }
+
+    static napi_value Make(napi_env env, uint32_t value) {
+      return Construct(env, value);
+    }
+
+  public:
+    static const napi_type_tag type_tag;
+
+    static Payload *Create(const Arguments &args) {
+      return ObjectWrap::Create<uint32_t>(args);
+    }
+
+    static void Initialize(napi_env env, napi_value exports) {
+      nfc::Properties properties;
+      Install(env, "Payload", exports, properties);
+    }
+  };
+
+  const napi_type_tag Payload::type_tag = {0x4b1d0c3e95a27f68ULL, 0xd0e6a1f7243b985cULL};
+
+
+  static napi_value
+  Result(napi_env env, size_t iterations, uint64_t elapsed) {
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "iterations", toJS(env, uint32_t(iterations)));
+    napi_set_named_property(env, result, "ns", toJS(env, double(elapsed)));
+    napi_set_named_property(env, result, "nsPerOp", toJS(env, double(elapsed) / iterations));
+    return result;
+  }
+
+
+  // RawObject copy and get on one thread.
+  static napi_value
+  RawObjectCopy(const Arguments &args) {
+    size_t iterations = fromJS<uint32_t>(args.Env(), args[0]);
+    RawCounter shared(new size_t(1));
+    uint64_t start = uv_hrtime();
+    for (size_t i = 0; i < iterations; ++i) {
+      RawCounter copy(shared);
+      sink += *copy.get();
+    }
+    return Result(args.Env(), iterations, uv_hrtime() - start);
+  }
+
+
+  struct ContentionJob {
+    RawCounter *shared;
+    size_t iterations;
+  };
+
+
+  static void
+  RunContention(void *arg) {
+    ContentionJob &job = *static_cast<ContentionJob *>(arg);
+    for (size_t i = 0; i < job.iterations; ++i) {
+      RawCounter copy(*job.shared);
+      sink += *copy.get();
+    }
+  }
+
+
+  // RawObject copy and get from several threads sharing one object.
+  static napi_value
+  RawObjectContention(const Arguments &args) {
+    size_t threads = fromJS<uint32_t>(args.Env(), args[0]);
+    size_t iterations = fromJS<uint32_t>(args.Env(), args[1]);
+    RawCounter shared(new size_t(1));
+    ContentionJob job = {&shared, iterations};
+    std::vector<uv_thread_t> handles(threads);
+    uint64_t start = uv_hrtime();
+    for (size_t i = 0; i < threads; ++i) {
+      uv_thread_create(&handles[i], RunContention, &job);
+    }
+    for (size_t i = 0; i < threads; ++i) {
+      uv_thread_join(&handles[i]);
+    }
+    return Result(args.Env(), threads * iterations, uv_hrtime() - start);
+  }
+
+
+  static napi_value
+  BufferToJS(const Arguments &args) {
+    napi_env env = args.Env();
+    std::vector<uint8_t> data(fromJS<uint32_t>(env, args[0]));
+    size_t iterations = fromJS<uint32_t>(env, args[1]);
+    uint64_t start = uv_hrtime();
+    for (size_t i = 0; i < iterations; ++i) {
+      napi_handle_scope scope;
+      napi_open_handle_scope(env, &scope);
+      toJS(env, data);
+      napi_close_handle_scope(env, scope);
+    }
+    return Result(env, iterations, uv_hrtime() - start);
+  }
+
+
+  static napi_value
+  BufferFromJS(const Arguments &args) {
+    napi_env env = args.Env();
+    size_t iterations = fromJS<uint32_t>(env, args[1]);
+    uint64_t start = uv_hrtime();
+    for (size_t i = 0; i < iterations; ++i) {
+      sink += fromJS<std::vector<uint8_t> >(env, args[0]).size();
+    }
+    return Result(env, iterations, uv_hrtime() - start);
+  }
+
+
+  // ObjectWrap::Construct, including the toExternal/fromExternal round trip.
+  static napi_value
+  Construct(const Arguments &args) {
+    napi_env env = args.Env();
+    size_t iterations = fromJS<uint32_t>(env, args[0]);
+    uint64_t start = uv_hrtime();
+    for (size_t i = 0; i < iterations; ++i) {
+      napi_handle_scope scope;
+      napi_open_handle_scope(env, &scope);
+      sink += Payload::Unwrap(env, Payload::Make(env, uint32_t(i))).value;
+      napi_close_handle_scope(env, scope);
+    }
+    return Result(env, iterations, uv_hrtime() - start);
+  }
+
+
+  struct DispatchData {
+    uint64_t scheduled;
+    uint64_t started;
+    uint64_t finished;
+
+    DispatchData()
+      : scheduled(uv_hrtime()), started(0), finished(0) {}
+  };
+
+
+  static void
+  RunDispatch(Payload &instance, DispatchData &data) {
+    data.started = uv_hrtime();
+    data.finished = data.started;
+  }
+
+
+  static napi_value
+  AfterDispatch(napi_env env, napi_value instance, DispatchData &data) {
+    uint64_t now = uv_hrtime();
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "queue", toJS(env, double(data.started - data.scheduled)));
+    napi_set_named_property(env, result, "complete", toJS(env, double(now - data.finished)));
+    return result;
+  }
+
+
+  // AsyncRunner from Schedule to the "after" handler, split into queueing and completion.
+  static napi_value
+  Dispatch(const Arguments &args) {
+    napi_env env = args.Env();
+    return nfc::AsyncRunner<Payload, DispatchData>::Schedule(RunDispatch, AfterDispatch, env, args[0]);
+  }
+
+
+  static napi_value
+  MakePayload(const Arguments &args) {
+    return Payload::Make(args.Env(), 0);
+  }
+
+}
+
+
+napi_value
+Initialize(napi_env env, napi_value exports) {
+  nfc::Environment::Initialize(env);
+  bench::Payload::Initialize(env, exports);
+
+  nfc::Properties properties;
+  properties.method<bench::RawObjectCopy>("rawObjectCopy");
+  properties.method<bench::RawObjectContention>("rawObjectContention");
+  properties.method<bench::BufferToJS>("bufferToJS");
+  properties.method<bench::BufferFromJS>("bufferFromJS");
+  properties.method<bench::Construct>("construct");
+  properties.method<bench::MakePayload>("makePayload");
+  properties.method<bench::Dispatch>("dispatch");
+  napi_define_properties(env, exports, properties.size(), properties.data());
+  return exports;
+}
+
+
+NAPI_MODULE(bench, Initialize)
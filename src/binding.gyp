@@ -1,11 +1,45 @@
 {
+    'variables': {
+        'build_bench%': 'false',
+        'build_tests%': 'false',
+        'nfc_sources': ['nfc.cc', 'nfc/cache.cc', 'nfc/capabilities.cc', 'nfc/classifier.cc', 'nfc/context.cc', 'nfc/daemon.cc', 'nfc/dep.cc', 'nfc/desfire.cc', 'nfc/device.cc', 'nfc/errors.cc', 'nfc/felica.cc', 'nfc/framing.cc', 'nfc/pool.cc', 'nfc/property.cc', 'nfc/provision.cc', 'nfc/queue.cc', 'nfc/retry.cc', 'nfc/scheduler.cc', 'nfc/script.cc', 'nfc/target.cc', 'nfc/util.cc']
+    },
     'targets': [
         {
             'target_name': 'nfc',
-            'sources': ['nfc.cc', 'nfc/context.cc', 'nfc/device.cc', 'nfc/target.cc', 'nfc/util.cc'],
+            'sources': ['<@(nfc_sources)'],
+            'defines': ['NAPI_VERSION=8'],
             'link_settings': {
                 'libraries': ['-l nfc']
             }
         }
+    ],
+    'conditions': [
+        ['build_bench=="true"', {
+            'targets': [
+                {
+                    # Microbenchmarks of the glue layer, see test/bench.js.
+                    'target_name': 'bench',
+                    'sources': ['bench.cc', 'nfc/util.cc'],
+                    'defines': ['NAPI_VERSION=8']
+                }
+            ]
+        }],
+        ['build_tests=="true"', {
+            'targets': [
+                {
+                    # Known-answer checks of the host framing, needs no libnfc.
+                    'target_name': 'framing_test',
+                    'type': 'executable',
+                    'sources': ['framing_test.cc', 'nfc/framing.cc']
+                },
+                {
+                    # The addon on a simulated libnfc, for test/daemon_test.js.
+                    'target_name': 'nfc_stub',
+                    'sources': ['<@(nfc_sources)', 'nfc_stub.cc'],
+                    'defines': ['NAPI_VERSION=8']
+                }
+            ]
+        }]
     ]
 }
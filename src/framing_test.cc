@@ -0,0 +1,88 @@
+// Known-answer checks of the host framing against the examples of ISO/IEC 14443-3 Annex B
+// and the CRC catalogue check values (the CRCs of "123456789").  Needs neither libnfc nor a
+// reader; exits with the number of failed checks.
+#include "nfc/framing.hh"
+#include <cstdio>
+
+
+namespace framing_test {
+
+  using nfc::Framing;
+
+
+  static unsigned failures = 0;
+
+
+  static void
+  Check(bool passed, const char what[]) {
+    if (!passed) {
+      std::printf("FAILED: %s\n", what);
+      ++failures;
+    }
+  }
+
+
+  // The CRC as transmitted, low byte first.
+  static void
+  CheckCrc(Framing::Crc kind, const char data[], size_t size, uint8_t low, uint8_t high, const char what[]) {
+    const uint16_t crc = Framing::crc(kind, reinterpret_cast<const uint8_t *>(data), size);
+    Check(uint8_t(crc) == low && uint8_t(crc >> 8) == high, what);
+  }
+
+
+  static void
+  CheckFrame(Framing::Crc kind, const char what[]) {
+    const uint8_t data[] = {0x93, 0x70, 0x88, 0x04, 0x51, 0x7a, 0x41};
+    std::vector<uint8_t> frame(data, data + sizeof(data));
+    Framing::append_crc(kind, frame);
+    Check(frame.size() == sizeof(data) + 2, what);
+    std::vector<uint8_t> corrupted(frame);
+    corrupted[3] ^= 0x10;
+    Check(!Framing::check_crc(kind, corrupted), what);
+    Check(Framing::check_crc(kind, frame) && frame == std::vector<uint8_t>(data, data + sizeof(data)), what);
+  }
+
+
+  static void
+  Run() {
+    CheckCrc(Framing::crc_a, "\x00\x00", 2, 0xa0, 0x1e, "CRC_A of 00 00");
+    CheckCrc(Framing::crc_a, "\x12\x34", 2, 0x26, 0xcf, "CRC_A of 12 34");
+    CheckCrc(Framing::crc_a, "123456789", 9, 0x05, 0xbf, "CRC_A check value");
+    CheckCrc(Framing::crc_b, "\x00\x00\x00", 3, 0xcc, 0xc6, "CRC_B of 00 00 00");
+    CheckCrc(Framing::crc_b, "\x0f\xaa\xff", 3, 0xfc, 0xd1, "CRC_B of 0F AA FF");
+    CheckCrc(Framing::crc_b, "\x0a\x12\x34\x56", 4, 0x2c, 0xf6, "CRC_B of 0A 12 34 56");
+    CheckCrc(Framing::crc_b, "123456789", 9, 0x6e, 0x90, "CRC_B check value");
+
+    CheckFrame(Framing::crc_a, "CRC_A appended and checked");
+    CheckFrame(Framing::crc_b, "CRC_B appended and checked");
+    std::vector<uint8_t> short_frame(1, 0x26);
+    Check(!Framing::check_crc(Framing::crc_a, short_frame), "CRC_A of a frame shorter than the CRC");
+    Check(Framing::check_crc(Framing::no_crc, short_frame) && short_frame.size() == 1, "no CRC");
+
+    // Odd parity: the parity bit makes the number of ones odd.
+    Check(Framing::parity(0x00) == 1, "parity of 00");
+    Check(Framing::parity(0x01) == 0, "parity of 01");
+    Check(Framing::parity(0x26) == 0, "parity of 26");
+    Check(Framing::parity(0x93) == 1, "parity of 93");
+    Check(Framing::parity(0x7f) == 0, "parity of 7F");
+    Check(Framing::parity(0xff) == 1, "parity of FF");
+
+    const uint8_t anticollision[] = {0x93, 0x20};
+    const std::vector<uint8_t> frame(anticollision, anticollision + sizeof(anticollision));
+    std::vector<uint8_t> parity = Framing::parity(frame);
+    Check(parity.size() == 2 && parity[0] == 1 && parity[1] == 0, "parity of 93 20");
+    Check(Framing::check_parity(frame, parity, frame.size()), "parity of 93 20 checked");
+    parity[1] ^= 1;
+    Check(!Framing::check_parity(frame, parity, frame.size()), "wrong parity of 93 20 found");
+    Check(Framing::check_parity(frame, parity, 1), "parity of the first byte of 93 20 only");
+  }
+
+}
+
+
+int
+main() {
+  framing_test::Run();
+  std::printf("%u framing checks failed\n", framing_test::failures);
+  return int(framing_test::failures);
+}
@@ -1,15 +1,19 @@
 #include "nfc/context.hh"
+#include "nfc/daemon.hh"
 #include "nfc/device.hh"
 #include "nfc/target.hh"
-#include <node.h>
+#include <node_api.h>
 
 
-void
-Initialize(v8::Handle<v8::Object> exports) {
-  nfc::Context::Initialize(exports);
-  nfc::Device::Initialize(exports);
-  nfc::Target::Initialize(exports);
+napi_value
+Initialize(napi_env env, napi_value exports) {
+  nfc::Environment::Initialize(env);
+  nfc::Context::Initialize(env, exports);
+  nfc::Device::Initialize(env, exports);
+  nfc::Daemon::Initialize(env, exports);
+  nfc::Target::Initialize(env, exports);
+  return exports;
 }
 
 
-NODE_MODULE(nfc, Initialize)
+NAPI_MODULE(nfc, Initialize)
@@ -0,0 +1,157 @@
+#include "cache.hh"
+
+
+namespace nfc {
+
+  static uint64_t
+  Now() {
+    return uv_hrtime() / 1000000;
+  }
+
+
+  ContentCache::Options::Options()
+    : max_size(0), ttl(60000)
+  {
+  }
+
+
+  ContentCache::Stats::Stats()
+    : hits(0), misses(0), invalidations(0), evictions(0), size(0)
+  {
+  }
+
+
+  ContentCache::ContentCache()
+  {
+  }
+
+
+  void
+  ContentCache::configure(const Options &options_) {
+    WrLock lk(lock);
+    options = options_;
+    evict();
+  }
+
+
+  ContentCache::Options
+  ContentCache::settings() const {
+    RdLock lk(lock);
+    return options;
+  }
+
+
+  ContentCache::Stats
+  ContentCache::stats() const {
+    RdLock lk(lock);
+    return current;
+  }
+
+
+  bool
+  ContentCache::enabled() const {
+    RdLock lk(lock);
+    return options.max_size > 0;
+  }
+
+
+  bool
+  ContentCache::get(const Uid &uid, uint32_t address, std::vector<uint8_t> &data) {
+    WrLock lk(lock);
+    std::map<Uid, Cards::iterator>::iterator found = index.find(uid);
+    if (found == index.end()) {
+      ++current.misses;
+      return false;
+    }
+    Cards::iterator card = found->second;
+    std::map<uint32_t, Region>::iterator region = card->regions.find(address);
+    if (region == card->regions.end()) {
+      ++current.misses;
+      return false;
+    }
+    if (region->second.expires <= Now()) {
+      // Expired regions no longer count towards the size.
+      card->size -= region->second.data.size();
+      current.size -= region->second.data.size();
+      card->regions.erase(region);
+      if (card->regions.empty()) {
+        erase(card);
+      }
+      ++current.misses;
+      return false;
+    }
+    cards.splice(cards.begin(), cards, card);
+    data = region->second.data;
+    ++current.hits;
+    return true;
+  }
+
+
+  void
+  ContentCache::put(const Uid &uid, uint32_t address, const std::vector<uint8_t> &data) {
+    WrLock lk(lock);
+    if (!options.max_size) {
+      return;
+    }
+    std::map<Uid, Cards::iterator>::iterator found = index.find(uid);
+    Cards::iterator card;
+    if (found == index.end()) {
+      Card empty;
+      empty.uid = uid;
+      empty.size = uid.size();
+      card = cards.insert(cards.begin(), empty);
+      index[uid] = card;
+      current.size += card->size;
+    }
+    else {
+      card = found->second;
+      cards.splice(cards.begin(), cards, card);
+    }
+    Region &region = card->regions[address];
+    card->size -= region.data.size();
+    current.size -= region.data.size();
+    region.data = data;
+    card->size += data.size();
+    current.size += data.size();
+    region.expires = Now() + options.ttl;
+    evict();
+  }
+
+
+  void
+  ContentCache::invalidate(const Uid &uid) {
+    WrLock lk(lock);
+    std::map<Uid, Cards::iterator>::iterator found = index.find(uid);
+    if (found != index.end()) {
+      erase(found->second);
+      ++current.invalidations;
+    }
+  }
+
+
+  void
+  ContentCache::clear() {
+    WrLock lk(lock);
+    cards.clear();
+    index.clear();
+    current.size = 0;
+  }
+
+
+  void
+  ContentCache::erase(Cards::iterator card) {
+    current.size -= card->size;
+    index.erase(card->uid);
+    cards.erase(card);
+  }
+
+
+  void
+  ContentCache::evict() {
+    while (current.size > options.max_size && !cards.empty()) {
+      erase(--cards.end());
+      ++current.evictions;
+    }
+  }
+
+}
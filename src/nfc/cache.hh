@@ -0,0 +1,81 @@
+#ifndef NFC_CACHE_HH
+#define NFC_CACHE_HH
+
+#include "util.hh"
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // Memory images of cards by UID, so that areas read on an earlier tap are served without
+  // RF traffic.  Regions are addressed by the caller (e.g. FeliCa service and block number).
+  // Cards are evicted least recently used first once max_size bytes are cached, regions
+  // expire ttl ms after they were read.
+  class ContentCache {
+  public:
+    typedef std::vector<uint8_t> Uid;
+
+    struct Options {
+      size_t max_size;  // 0 disables the cache
+      unsigned ttl;
+
+      Options();
+    };
+
+    struct Stats {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t invalidations;
+      uint64_t evictions;
+      size_t size;
+
+      Stats();
+    };
+
+  protected:
+    struct Region {
+      std::vector<uint8_t> data;
+      uint64_t expires;
+    };
+
+    struct Card {
+      Uid uid;
+      size_t size;
+      std::map<uint32_t, Region> regions;
+    };
+
+    typedef std::list<Card> Cards;  // most recently used first
+
+    Lock lock;
+    Options options;
+    Stats current;
+    Cards cards;
+    std::map<Uid, Cards::iterator> index;
+
+  public:
+    ContentCache();
+
+    void configure(const Options &options);
+    Options settings() const;
+    Stats stats() const;
+    bool enabled() const;
+
+    // Copies a cached region, returns false if it is not cached or has expired.
+    bool get(const Uid &uid, uint32_t address, std::vector<uint8_t> &data);
+    void put(const Uid &uid, uint32_t address, const std::vector<uint8_t> &data);
+
+    // Drops all regions of a card, e.g. after it was written to.
+    void invalidate(const Uid &uid);
+    void clear();
+
+  protected:
+    void erase(Cards::iterator card);
+    void evict();
+  };
+
+}
+
+#endif
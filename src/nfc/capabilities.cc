@@ -0,0 +1,69 @@
+#include "capabilities.hh"
+#include <algorithm>
+
+
+namespace nfc {
+
+  Capabilities::Capabilities()
+    : known(false)
+  {
+  }
+
+
+  Capabilities::Capabilities(nfc_device *device)
+    : known(false)
+  {
+    const nfc_modulation_type *types;
+    if (nfc_device_get_supported_modulation(device, N_INITIATOR, &types) < 0) {
+      return;
+    }
+    // Both lists end with 0.
+    for (; *types; ++types) {
+      std::vector<nfc_baud_rate> &supported = rates[*types];
+      const nfc_baud_rate *baud_rates;
+      if (nfc_device_get_supported_baud_rate(device, *types, &baud_rates) < 0) {
+        continue;
+      }
+      for (; *baud_rates; ++baud_rates) {
+        supported.push_back(*baud_rates);
+      }
+    }
+    known = true;
+  }
+
+
+  bool
+  Capabilities::is_known() const {
+    return known;
+  }
+
+
+  const Capabilities::Rates &
+  Capabilities::baud_rates() const {
+    return rates;
+  }
+
+
+  bool
+  Capabilities::supports(const nfc_modulation &modulation) const {
+    if (!known) {
+      return true;
+    }
+    Rates::const_iterator it = rates.find(modulation.nmt);
+    return it != rates.end() &&
+           (it->second.empty() || std::find(it->second.begin(), it->second.end(), modulation.nbr) != it->second.end());
+  }
+
+
+  std::vector<nfc_modulation>
+  Capabilities::filter(const nfc_modulation modulations[], size_t count) const {
+    std::vector<nfc_modulation> result;
+    for (size_t i = 0; i < count; ++i) {
+      if (supports(modulations[i])) {
+        result.push_back(modulations[i]);
+      }
+    }
+    return result;
+  }
+
+}
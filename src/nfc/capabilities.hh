@@ -0,0 +1,37 @@
+#ifndef NFC_CAPABILITIES_HH
+#define NFC_CAPABILITIES_HH
+
+#include <map>
+#include <nfc/nfc.h>
+#include <stddef.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // Modulations and baud rates a reader takes as initiator, asked from the driver once per
+  // handle.  When the driver cannot tell, they stay unknown and everything is tried.
+  class Capabilities {
+  public:
+    // An empty list of rates means any.
+    typedef std::map<nfc_modulation_type, std::vector<nfc_baud_rate> > Rates;
+
+  protected:
+    bool known;
+    Rates rates;
+
+  public:
+    Capabilities();
+    explicit Capabilities(nfc_device *device);
+
+    bool is_known() const;
+    const Rates &baud_rates() const;
+
+    bool supports(const nfc_modulation &modulation) const;
+    // Keeps the modulations the reader supports, in order.
+    std::vector<nfc_modulation> filter(const nfc_modulation modulations[], size_t count) const;
+  };
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include "classifier.hh"
+#include <algorithm>
+
+
+namespace nfc {
+
+  struct Iso14443aType {
+    uint16_t atqa;
+    uint16_t atqa_mask;
+    uint8_t sak;
+    uint8_t sak_mask;
+    uint8_t historical[2];     // prefix of the historical bytes in the ATS
+    size_t historical_length;
+    const char *type;
+    bool probe;
+  };
+
+
+  // Following NXP AN10833, the first matching entry wins.
+  static const Iso14443aType iso14443a_types[] = {
+    // Ultralight, Ultralight C, Ultralight EV1 and NTAG all answer with the same data.
+    {0x0044, 0xffff, 0x00, 0xff, {0}, 0, "mifare-ultralight", true},
+    {0x0004, 0xffff, 0x09, 0xff, {0}, 0, "mifare-mini", false},
+    {0x0004, 0xffbf, 0x08, 0xff, {0}, 0, "mifare-classic-1k", false},  // 4 or 7 byte UID
+    {0x0002, 0xffbf, 0x18, 0xff, {0}, 0, "mifare-classic-4k", false},
+    {0x0000, 0x0000, 0x88, 0xff, {0}, 0, "mifare-classic-1k", false},  // Infineon
+    {0x0000, 0x0000, 0x10, 0xff, {0}, 0, "mifare-plus", false},        // security level 2
+    {0x0000, 0x0000, 0x11, 0xff, {0}, 0, "mifare-plus", false},
+    {0x0000, 0x0000, 0x28, 0xff, {0}, 0, "smartmx", false},            // with Classic 1K emulation
+    {0x0000, 0x0000, 0x38, 0xff, {0}, 0, "smartmx", false},            // with Classic 4K emulation
+    // DESFire D40, EV1, EV2 and EV3 share the ATS.
+    {0x0344, 0xffff, 0x20, 0xff, {0x80}, 1, "mifare-desfire", true},
+    {0x0000, 0x0000, 0x20, 0xff, {0xc1, 0x05}, 2, "mifare-plus", false},  // security level 3
+    // Any other ISO 14443-4 card may still be an NXP one with a custom ATS.
+    {0x0000, 0x0000, 0x20, 0x20, {0}, 0, "iso14443-4", true},
+    {0x0000, 0x0000, 0x00, 0x00, {0}, 0, "iso14443a", false}
+  };
+
+  static const size_t iso14443a_types_count = sizeof(iso14443a_types) / sizeof(iso14443a_types[0]);
+
+
+  CardClassifier::Result
+  CardClassifier::classify(const nfc_target &target) {
+    Result result = {"unknown", false};
+    switch (target.nm.nmt) {
+    case NMT_ISO14443A: {
+      const nfc_iso14443a_info &info = target.nti.nai;
+      const uint16_t atqa = info.abtAtqa[0] << 8 | info.abtAtqa[1];
+      const uint8_t *historical = NULL;
+      size_t historical_length = 0;
+      historical_bytes(info, historical, historical_length);
+      for (size_t i = 0; i < iso14443a_types_count; ++i) {
+        const Iso14443aType &entry = iso14443a_types[i];
+        if ((atqa & entry.atqa_mask) == entry.atqa && (info.btSak & entry.sak_mask) == entry.sak &&
+            entry.historical_length <= historical_length &&
+            std::equal(entry.historical, entry.historical + entry.historical_length, historical)) {
+          result.type = entry.type;
+          result.probe = entry.probe;
+          break;
+        }
+      }
+      break;
+    }
+    case NMT_JEWEL:
+      result.type = "topaz";
+      break;
+    case NMT_FELICA:
+      // IC type in PMm
+      result.type = target.nti.nfi.abtPad[1] == 0xf0 ? "felica-lite" :
+                    target.nti.nfi.abtPad[1] == 0xf1 ? "felica-lite-s" : "felica";
+      break;
+    case NMT_ISO14443B:
+      result.type = "iso14443b";
+      break;
+    case NMT_ISO14443BI:
+      result.type = "iso14443bi";
+      break;
+    case NMT_ISO14443B2SR:
+      result.type = "st-sri";
+      break;
+    case NMT_ISO14443B2CT:
+      result.type = "ask-cts";
+      break;
+    case NMT_DEP:
+      result.type = "nfc-dep";
+      break;
+    }
+    return result;
+  }
+
+
+  const char *
+  CardClassifier::identify(const std::vector<uint8_t> &version) {
+    // Status (0x00 for Type 2, 0xaf for DESFire), vendor, type, subtype, major and minor
+    // version, storage size, protocol.
+    const uint8_t nxp = 0x04;
+    if (version.size() != 8 || (version[0] != 0x00 && version[0] != 0xaf) || version[1] != nxp) {
+      return NULL;
+    }
+    const uint8_t major = version[4];
+    const uint8_t storage = version[6];
+    switch (version[2]) {
+    case 0x01:
+      return major == 0x00 ? "mifare-desfire" : major == 0x01 ? "mifare-desfire-ev1" :
+             major == 0x12 ? "mifare-desfire-ev2" : major == 0x33 ? "mifare-desfire-ev3" : "mifare-desfire";
+    case 0x02:
+      return "mifare-plus";
+    case 0x03:
+      return "mifare-ultralight-ev1";
+    case 0x04:
+      return storage == 0x0b ? "ntag210" : storage == 0x0e ? "ntag212" : storage == 0x0f ? "ntag213" :
+             storage == 0x11 ? "ntag215" : storage == 0x13 ? "ntag216" : "ntag";
+    case 0x08:
+      return "mifare-desfire-light";
+    }
+    return NULL;
+  }
+
+
+  std::vector<nfc_baud_rate>
+  CardClassifier::baud_rates(const nfc_target &target) {
+    std::vector<nfc_baud_rate> rates(1, target.nm.nbr);
+    if (target.nm.nmt != NMT_ISO14443A || !(target.nti.nai.btSak & 0x20)) {
+      return rates;
+    }
+    rates.assign(1, NBR_106);
+    const nfc_iso14443a_info &info = target.nti.nai;
+    if (info.szAtsLen < 2 || !(info.abtAts[0] & 0x10)) {
+      // no TA(1), 106 kbps only
+      return rates;
+    }
+    // DS in bits 5 to 7 (card to reader), DR in bits 1 to 3 (reader to card), bit 4 is RFU.
+    const uint8_t ta = info.abtAts[1];
+    if (ta & 0x08) {
+      return rates;
+    }
+    static const nfc_baud_rate faster[] = {NBR_212, NBR_424, NBR_847};
+    for (size_t i = 0; i < sizeof(faster) / sizeof(faster[0]); ++i) {
+      const uint8_t both = uint8_t(0x11 << i);
+      if ((ta & both) == both) {
+        rates.push_back(faster[i]);
+      }
+    }
+    return rates;
+  }
+
+
+  bool
+  CardClassifier::historical_bytes(const nfc_iso14443a_info &info, const uint8_t *&bytes, size_t &length) {
+    // The ATS starts with T0 (libnfc drops TL), which tells which of TA, TB and TC follow.
+    if (!info.szAtsLen) {
+      return false;
+    }
+    const uint8_t t0 = info.abtAts[0];
+    size_t offset = 1 + ((t0 & 0x10) ? 1 : 0) + ((t0 & 0x20) ? 1 : 0) + ((t0 & 0x40) ? 1 : 0);
+    if (offset > info.szAtsLen) {
+      return false;
+    }
+    bytes = info.abtAts + offset;
+    length = info.szAtsLen - offset;
+    return true;
+  }
+
+}
@@ -0,0 +1,39 @@
+#ifndef NFC_CLASSIFIER_HH
+#define NFC_CLASSIFIER_HH
+
+#include <nfc/nfc.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // Tells the card family from the activation data (ATQA, SAK and the historical bytes of the
+  // ATS for ISO 14443-A, PMm for FeliCa), without talking to the card.  Where families share
+  // this data, the result asks for a GET_VERSION probe to tell them apart.
+  class CardClassifier {
+  public:
+    struct Result {
+      const char *type;
+      bool probe;  // ambiguous, GET_VERSION narrows it down
+    };
+
+    // Type 2 GET_VERSION and DESFire native GetVersion share the command code.
+    static const uint8_t get_version = 0x60;
+
+    static Result classify(const nfc_target &target);
+
+    // Returns the family named by a GET_VERSION response, or NULL if it is not understood.
+    static const char *identify(const std::vector<uint8_t> &version);
+
+    // Returns the bit rates an ISO 14443-4 card takes in both directions according to TA(1)
+    // of its ATS, in ascending order.  Other cards only get their current rate.
+    static std::vector<nfc_baud_rate> baud_rates(const nfc_target &target);
+
+  protected:
+    static bool historical_bytes(const nfc_iso14443a_info &info, const uint8_t *&bytes, size_t &length);
+  };
+
+}
+
+#endif
@@ -1,11 +1,18 @@
 #include "context.hh"
 #include "device.hh"
+#include "pool.hh"
 
 
 namespace nfc {
 
-  RawContext
+  // libnfc keeps process-wide state (log setup, configuration) in nfc_init and nfc_exit,
+  // so contexts created from several worker threads must not race there.
+  static Lock init_lock;
+
+
+  nfc_context *
   RawContext::initialize() {
+    WrLock lk(init_lock);
     nfc_context *context;
     nfc_init(&context);
     return context;
@@ -20,16 +27,44 @@ namespace nfc {
 
   void
   RawContext::destroy(nfc_context *context) {
+    WrLock lk(init_lock);
     nfc_exit(context);
   }
 
 
+  Context::Timings::Timings()
+    : init(0), scan(0), open(0), scans(0)
+  {
+  }
+
+
   Context::Context()
-    : context(RawContext::initialize())
+    : pool(new DevicePool(context)), initialized(false)
   {
   }
 
 
+  bool
+  Context::initialize() {
+    WrLock lk(lock);
+    if (!initialized) {
+      uint64_t start = uv_hrtime();
+      // The pool shares the handle, so it sees the context too.
+      context.reset(RawContext::initialize());
+      current.init = uv_hrtime() - start;
+      initialized = true;
+    }
+    return context.get() != NULL;
+  }
+
+
+  Context::Timings
+  Context::timings() const {
+    RdLock lk(lock);
+    return current;
+  }
+
+
   std::string
   Context::version() {
     return nfc_version();
@@ -38,64 +73,138 @@ namespace nfc {
 
   std::vector<std::string>
   Context::devices() {
-    nfc_context *context = this->context.get();
-    if (!context) {
+    if (!initialize()) {
       return std::vector<std::string>();
     }
+    nfc_context *context = this->context.get();
+    uint64_t start = uv_hrtime();
+    std::vector<std::string> result;
     for (size_t alloc = 1;;) {
       nfc_connstring devices[alloc];
       size_t count = nfc_list_devices(context, devices, alloc);
       if (count <= alloc) {
         // We were able to get all devices.
-        return std::vector<std::string>(devices, devices + count);
+        result.assign(devices, devices + count);
+        break;
       }
       alloc = count;
     }
+    WrLock lk(lock);
+    current.scan = uv_hrtime() - start;
+    ++current.scans;
+    known_devices = result;
+    return result;
   }
 
 
-  RawDevice
+  RawSlot
   Context::open(const std::string &connstring) {
-    nfc_context *context = this->context.get();
-    if (!context) {
-      return RawDevice();
+    if (!initialize()) {
+      return RawSlot();
     }
-    return RawDevice(nfc_open(context, connstring.length() ? connstring.c_str() : NULL));
+    uint64_t start = uv_hrtime();
+    RawSlot slot;
+    if (connstring.empty()) {
+      // Without connstring libnfc scans all drivers, try the devices we already know first.
+      std::vector<std::string> candidates;
+      {
+        RdLock lk(lock);
+        candidates = known_devices;
+      }
+      for (size_t i = 0; i < candidates.size() && !slot.get(); ++i) {
+        slot = pool.get()->acquire(candidates[i]);
+      }
+    }
+    if (!slot.get()) {
+      slot = pool.get()->acquire(connstring);
+    }
+    WrLock lk(lock);
+    current.open = uv_hrtime() - start;
+    return slot;
   }
 
 
-  v8::Persistent<v8::Function> Context::constructor;
+  const napi_type_tag Context::type_tag = {0x6c0b7e9a4f3d2c15ULL, 0x9e21d8a3b5c47f60ULL};
 
 
   void
-  Context::Initialize(v8::Handle<v8::Object> exports) {
-    v8::HandleScope scope;
-    v8::Local<v8::ObjectTemplate> proto;
-    v8::Local<v8::FunctionTemplate> tpl;
-    Prepare(tpl, proto);
+  Context::Initialize(napi_env env, napi_value exports) {
+    Properties properties;
 
-    proto->SetAccessor(v8::String::NewSymbol("version"), GetVersion);
+    properties.accessor<GetVersion>("version");
+    properties.accessor<GetPool>("pool");
+    properties.accessor<GetTimings>("timings");
+    properties.accessor<GetDeadlineMisses>("deadlineMisses");
+
+    properties.method<ConfigurePool>("configurePool");
+
+    properties.method<GetDevices>("getDevices");
+    properties.method<Open>("open");
+
+    Install(env, "Context", exports, properties);
+  }
 
-    proto->Set(v8::String::NewSymbol("getDevices"), v8::FunctionTemplate::New(GetDevices)->GetFunction());
-    proto->Set(v8::String::NewSymbol("open"), v8::FunctionTemplate::New(Open)->GetFunction());
 
-    Install("Context", exports, tpl);
+  napi_value
+  Context::GetVersion(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).version());
   }
 
 
-  v8::Handle<v8::Value>
-  Context::CheckNew(v8::Handle<v8::Value> instance) {
-    if (!*Unwrap(instance).context) {
-      return v8::ThrowException(v8::Exception::Error(v8::String::New("unable to initialize libnfc")));
+  napi_value
+  Context::GetPool(const Arguments &args) {
+    napi_env env = args.Env();
+    std::vector<DevicePool::Status> status = Unwrap(env, args.This()).pool.get()->status();
+    napi_value result;
+    napi_create_array_with_length(env, status.size(), &result);
+    for (size_t i = 0; i < status.size(); ++i) {
+      napi_value entry;
+      napi_create_object(env, &entry);
+      napi_set_named_property(env, entry, "connstring", toJS(env, status[i].connstring));
+      napi_set_named_property(env, entry, "state", toJS(env, status[i].state));
+      napi_set_named_property(env, entry, "users", toJS(env, status[i].users));
+      napi_set_named_property(env, entry, "failures", toJS(env, status[i].failures));
+      napi_set_named_property(env, entry, "reconnects", toJS(env, status[i].reconnects));
+      napi_set_named_property(env, entry, "lastError", toJS(env, status[i].last_error));
+      napi_set_element(env, result, i, entry);
     }
-    return instance;
+    return result;
   }
 
 
-  v8::Handle<v8::Value>
-  Context::GetVersion(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(info.This()).version()));
+  napi_value
+  Context::GetTimings(const Arguments &args) {
+    napi_env env = args.Env();
+    const double ms = 1e6;
+    Timings timings = Unwrap(env, args.This()).timings();
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "init", toJS(env, timings.init / ms));
+    napi_set_named_property(env, result, "scan", toJS(env, timings.scan / ms));
+    napi_set_named_property(env, result, "open", toJS(env, timings.open / ms));
+    napi_set_named_property(env, result, "scans", toJS(env, timings.scans));
+    return result;
+  }
+
+
+  napi_value
+  Context::GetDeadlineMisses(const Arguments &args) {
+    napi_env env = args.Env();
+    return toJS(env, Unwrap(env, args.This()).jobs.misses());
+  }
+
+
+  napi_value
+  Context::ConfigurePool(const Arguments &args) {
+    napi_env env = args.Env();
+    DevicePool &pool = *Unwrap(env, args.This()).pool.get();
+    DevicePool::Options current = pool.settings();
+    DevicePool::Options options;
+    options.min_backoff = GetOption(env, args[0], "minBackoff", current.min_backoff);
+    options.max_backoff = GetOption(env, args[0], "maxBackoff", current.max_backoff);
+    options.keep_alive = GetOption(env, args[0], "keepAlive", current.keep_alive);
+    pool.configure(options);
+    return toJS(env, true);
   }
 
 
@@ -104,9 +213,11 @@ namespace nfc {
   };
 
 
-  v8::Handle<v8::Value>
-  Context::GetDevices(const v8::Arguments &args) {
-    return AsyncRunner<Context, GetDevicesData>::Schedule(RunGetDevices, AfterGetDevices, args.This(), args[0]);
+  napi_value
+  Context::GetDevices(const Arguments &args) {
+    return AsyncRunner<Context, GetDevicesData>::Schedule
+      ("getDevices", Deadline::FromOptions(args.Env(), args[0]), RunGetDevices, AfterGetDevices, args.Env(),
+       args.This());
   }
 
 
@@ -116,39 +227,45 @@ namespace nfc {
   }
 
 
-  v8::Handle<v8::Value>
-  Context::AfterGetDevices(v8::Handle<v8::Object> instance, GetDevicesData &data) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(data.devices));
+  napi_value
+  Context::AfterGetDevices(napi_env env, napi_value instance, GetDevicesData &data) {
+    if (!*Unwrap(env, instance).context) {
+      return ThrowError(env, "unable to initialize libnfc");
+    }
+    return toJS(env, data.devices);
   }
 
 
   struct Context::OpenData {
     std::string connstring;
-    RawDevice device;
+    RawSlot slot;
 
-    OpenData(v8::Handle<v8::Value> connstring_)
-      : connstring(fromV8<bool>(connstring_) ? fromV8<std::string>(connstring_) : "") {}
+    OpenData(napi_env env, napi_value connstring_)
+      : connstring(fromJS<bool>(env, connstring_) ? fromJS<std::string>(env, connstring_) : "") {}
   };
 
 
-  v8::Handle<v8::Value>
-  Context::Open(const v8::Arguments &args) {
-    return AsyncRunner<Context, OpenData>::Schedule(RunOpen, AfterOpen, args.This(), args[1], args[0]);
+  napi_value
+  Context::Open(const Arguments &args) {
+    return AsyncRunner<Context, OpenData>::Schedule
+      ("open", Deadline::FromOptions(args.Env(), args[1]), RunOpen, AfterOpen, args.Env(), args.This(),
+       OpenData(args.Env(), args[0]));
   }
 
 
   void
   Context::RunOpen(Context &instance, OpenData &data) {
-    data.device = instance.open(data.connstring);
+    data.slot = instance.open(data.connstring);
   }
 
 
-  v8::Handle<v8::Value>
-  Context::AfterOpen(v8::Handle<v8::Object> instance, OpenData &data) {
-    v8::HandleScope scope;
+  napi_value
+  Context::AfterOpen(napi_env env, napi_value instance, OpenData &data) {
+    if (!*Unwrap(env, instance).context) {
+      return ThrowError(env, "unable to initialize libnfc");
+    }
     // In case open fails, Device::Construct will throw the exception.
-    return scope.Close(Device::Construct(Unwrap(instance).context, data.device));
+    return Device::Construct(env, Unwrap(env, instance).pool, data.slot);
   }
 
 }
@@ -13,7 +13,7 @@ namespace nfc {
     public RawObject<RawContext, nfc_context>
   {
   public:
-    static RawContext initialize();
+    static nfc_context *initialize();
 
     RawContext(nfc_context *context = NULL);
 
@@ -21,41 +21,78 @@ namespace nfc {
   };
 
 
-  class RawDevice;
+  class DevicePool;
+
+  class RawPool:
+    public RawObject<RawPool, DevicePool>
+  {
+  public:
+    RawPool(DevicePool *pool = NULL);
+
+    static void destroy(DevicePool *pool);
+  };
+
+
+  class RawSlot;
 
   class Context:
     public nfc::ObjectWrap<Context>
   {
+  public:
+    // Startup costs in nanoseconds: libnfc initialization, the last scan and the last open.
+    struct Timings {
+      uint64_t init;
+      uint64_t scan;
+      uint64_t open;
+      unsigned scans;
+
+      Timings();
+    };
+
   protected:
     RawContext context;
+    RawPool pool;
+
+    // libnfc is initialized on first use, off the loop thread.
+    Lock lock;
+    bool initialized;
+    std::vector<std::string> known_devices;  // found by the last scan
+    Timings current;
 
   public:
     Context();
 
+    bool initialize();
+    Timings timings() const;
+
     static std::string version();
     std::vector<std::string> devices();
 
-    RawDevice open(const std::string &connstring = "");
+    RawSlot open(const std::string &connstring = "");
 
   public:
-    static v8::Persistent<v8::Function> constructor;
+    static const napi_type_tag type_tag;
+
+    static void Initialize(napi_env env, napi_value exports);
 
-    static void Initialize(v8::Handle<v8::Object> exports);
-    static v8::Handle<v8::Value> CheckNew(v8::Handle<v8::Value> instance);
+    static napi_value GetVersion(const Arguments &args);
+    static napi_value GetPool(const Arguments &args);
+    static napi_value GetTimings(const Arguments &args);
+    static napi_value GetDeadlineMisses(const Arguments &args);
 
-    static v8::Handle<v8::Value> GetVersion(v8::Local<v8::String> property, const v8::AccessorInfo &info);
+    static napi_value ConfigurePool(const Arguments &args);
 
-    static v8::Handle<v8::Value> GetDevices(const v8::Arguments &args);
-    static v8::Handle<v8::Value> Open(const v8::Arguments &args);
+    static napi_value GetDevices(const Arguments &args);
+    static napi_value Open(const Arguments &args);
 
   protected:
     struct GetDevicesData;
     static void RunGetDevices(Context &instance, GetDevicesData &data);
-    static v8::Handle<v8::Value> AfterGetDevices(v8::Handle<v8::Object> instance, GetDevicesData &data);
+    static napi_value AfterGetDevices(napi_env env, napi_value instance, GetDevicesData &data);
 
     struct OpenData;
     static void RunOpen(Context &instance, OpenData &data);
-    static v8::Handle<v8::Value> AfterOpen(v8::Handle<v8::Object> instance, OpenData &data);
+    static napi_value AfterOpen(napi_env env, napi_value instance, OpenData &data);
   };
 
 }
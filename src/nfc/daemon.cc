@@ -0,0 +1,727 @@
+#include "daemon.hh"
+#include "target.hh"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace nfc {
+
+  static const size_t header_size = 5;            // type and request id, after the length
+  static const size_t max_frame_size = 0x10000;   // from the type on
+  static const size_t max_output = 1 << 20;       // queued for a client that does not read
+  static const int preempt_interval = 5;          // ms between aborts of a poll a command waits for
+
+
+  static void
+  PutUint32(std::vector<uint8_t> &out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out.push_back(uint8_t(value >> shift));
+    }
+  }
+
+
+  static uint32_t
+  GetUint32(const uint8_t *in) {
+    return uint32_t(in[0]) << 24 | uint32_t(in[1]) << 16 | uint32_t(in[2]) << 8 | in[3];
+  }
+
+
+  static void
+  PutString(std::vector<uint8_t> &out, const std::string &value) {
+    const size_t length = std::min(value.size(), size_t(0xff));
+    out.push_back(uint8_t(length));
+    out.insert(out.end(), value.begin(), value.begin() + length);
+  }
+
+
+  static bool
+  SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0 && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+  }
+
+
+  // Whether a daemon still answers on the socket, or the file was left behind.
+  static bool
+  IsListening(const sockaddr_un &address) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return false;
+    }
+    bool listening = connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+    close(fd);
+    return listening;
+  }
+
+
+  Daemon::Options::Options()
+    : poll_interval(100), claim_timeout(5000), max_clients(32), max_requests(16), mode(0660)
+  {
+  }
+
+
+  Daemon::Stats::Stats()
+    : clients(0), subscribers(0), requests(0), events(0), claims(0), contended(0)
+  {
+  }
+
+
+  Daemon::Client::Client(int fd_)
+    : fd(fd_), subscribed(false)
+  {
+  }
+
+
+  Daemon::Daemon(RawPool pool, RawSlot slot)
+    : reader(pool, slot), listener(-1), next_client(1), claimant(0), claim_expires(0), running(false)
+    , polling_now(false), preempting(false), started(false), self(NULL), keep_alive(NULL)
+  {
+    wakeup[0] = wakeup[1] = -1;
+  }
+
+
+  Daemon::~Daemon() {
+    stop();
+  }
+
+
+  int
+  Daemon::start(const std::string &path_, const Options &options_) {
+    if (started) {
+      return -EALREADY;
+    }
+    if (!reader.is_open()) {
+      return -ENODEV;
+    }
+    path = path_;
+    options = options_;
+    if (pipe(wakeup) < 0) {
+      return -errno;
+    }
+    int result = SetNonBlocking(wakeup[0]) && SetNonBlocking(wakeup[1]) ? listen() : -errno;
+    if (result < 0) {
+      close(wakeup[0]);
+      close(wakeup[1]);
+      wakeup[0] = wakeup[1] = -1;
+      return result;
+    }
+    running = true;
+    if (uv_thread_create(&socket_thread, RunSocket, this)) {
+      running = false;
+    }
+    else if (uv_thread_create(&reader_thread, RunReader, this)) {
+      {
+        WrLock lk(lock);
+        running = false;
+      }
+      wake();
+      uv_thread_join(&socket_thread);
+    }
+    started = true;
+    if (!running) {
+      stop();
+      return -EAGAIN;
+    }
+    return 0;
+  }
+
+
+  bool
+  Daemon::stop() {
+    if (!started) {
+      return false;
+    }
+    bool was_running;
+    {
+      WrLock lk(lock);
+      was_running = running;
+      running = false;
+    }
+    if (was_running) {
+      work.set();
+      wake();
+      // Don't wait for a poll in progress.
+      reader.abort_command();
+      uv_thread_join(&reader_thread);
+      uv_thread_join(&socket_thread);
+    }
+    for (std::map<unsigned, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+      close(it->second.fd);
+    }
+    clients.clear();
+    jobs.clear();
+    claimant = 0;
+    close(listener);
+    close(wakeup[0]);
+    close(wakeup[1]);
+    listener = wakeup[0] = wakeup[1] = -1;
+    unlink(path.c_str());
+    reader.close();
+    started = false;
+    return true;
+  }
+
+
+  Daemon::Stats
+  Daemon::stats() const {
+    RdLock lk(lock);
+    Stats result = current;
+    result.clients = unsigned(clients.size());
+    result.subscribers = subscribers();
+    return result;
+  }
+
+
+  int
+  Daemon::listen() {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+      return -ENAMETOOLONG;
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -errno;
+    }
+    const sockaddr *name = reinterpret_cast<const sockaddr *>(&address);
+    int result = bind(fd, name, sizeof(address));
+    if (result < 0 && errno == EADDRINUSE && !IsListening(address)) {
+      // Left behind by a daemon which did not shut down.
+      unlink(path.c_str());
+      result = bind(fd, name, sizeof(address));
+    }
+    if (result < 0) {
+      result = -errno;
+      close(fd);
+      return result;
+    }
+    if (chmod(path.c_str(), options.mode) < 0 || ::listen(fd, SOMAXCONN) < 0 || !SetNonBlocking(fd)) {
+      result = -errno;
+      close(fd);
+      unlink(path.c_str());
+      return result;
+    }
+    listener = fd;
+    return 0;
+  }
+
+
+  void
+  Daemon::RunSocket(void *arg) {
+    static_cast<Daemon *>(arg)->run_socket();
+  }
+
+
+  void
+  Daemon::run_socket() {
+    std::vector<pollfd> fds;
+    std::vector<unsigned> ids;
+    for (;;) {
+      fds.clear();
+      ids.clear();
+      int timeout = -1;
+      {
+        RdLock lk(lock);
+        if (!running) {
+          break;
+        }
+        const pollfd listening = {listener, POLLIN, 0};
+        const pollfd woken = {wakeup[0], POLLIN, 0};
+        fds.push_back(listening);
+        fds.push_back(woken);
+        for (std::map<unsigned, Client>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+          const pollfd client = {it->second.fd, short(POLLIN | (it->second.output.empty() ? 0 : POLLOUT)), 0};
+          fds.push_back(client);
+          ids.push_back(it->first);
+        }
+        if (preempting) {
+          timeout = preempt_interval;
+        }
+      }
+      if (poll(fds.data(), fds.size(), timeout) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      uint8_t drain[64];
+      while (read(wakeup[0], drain, sizeof(drain)) > 0) {
+      }
+
+      WrLock lk(lock);
+      if (preempting && polling_now) {
+        reader.abort_command();
+      }
+      if (fds[0].revents & POLLIN) {
+        accept_clients();
+      }
+      for (size_t i = 0; i < ids.size(); ++i) {
+        std::map<unsigned, Client>::iterator it = clients.find(ids[i]);
+        const short events = fds[i + 2].revents;
+        if (it == clients.end() || !events) {
+          continue;
+        }
+        Client &client = it->second;
+        if ((events & (POLLIN | POLLHUP | POLLERR)) && !read_client(ids[i], client)) {
+          drop_client(ids[i]);
+          continue;
+        }
+        if (events & POLLOUT) {
+          // Node ignores SIGPIPE, a closed socket just fails.
+          ssize_t written = write(client.fd, client.output.data(), client.output.size());
+          if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            drop_client(ids[i]);
+            continue;
+          }
+          client.output.erase(client.output.begin(), client.output.begin() + std::max(written, ssize_t(0)));
+        }
+        if (client.output.size() > max_output) {
+          // Too slow for the events, rather than holding them all.
+          drop_client(ids[i]);
+        }
+      }
+    }
+  }
+
+
+  void
+  Daemon::accept_clients() {
+    for (;;) {
+      int fd = accept(listener, NULL, NULL);
+      if (fd < 0) {
+        break;
+      }
+      if (clients.size() >= options.max_clients || !SetNonBlocking(fd)) {
+        close(fd);
+        continue;
+      }
+      clients[next_client++] = Client(fd);
+    }
+  }
+
+
+  bool
+  Daemon::read_client(unsigned id, Client &client) {
+    uint8_t buffer[4096];
+    for (;;) {
+      ssize_t count = read(client.fd, buffer, sizeof(buffer));
+      if (count > 0) {
+        client.input.insert(client.input.end(), buffer, buffer + count);
+        continue;
+      }
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      // closed by the client
+      return false;
+    }
+    size_t offset = 0;
+    while (client.input.size() - offset >= 4) {
+      const uint32_t length = GetUint32(&client.input[offset]);
+      if (length < header_size || length > max_frame_size) {
+        return false;
+      }
+      if (client.input.size() - offset - 4 < length) {
+        break;
+      }
+      const uint8_t *frame = &client.input[offset + 4];
+      handle(id, frame[0], GetUint32(frame + 1), frame + header_size, length - header_size);
+      offset += 4 + length;
+    }
+    client.input.erase(client.input.begin(), client.input.begin() + offset);
+    return true;
+  }
+
+
+  void
+  Daemon::handle(unsigned id, uint8_t type, uint32_t request, const uint8_t *payload, size_t length) {
+    ++current.requests;
+    Job job;
+    job.client = id;
+    job.type = type;
+    job.id = request;
+    job.expires = 0;
+    job.waited = false;
+    switch (type) {
+    case subscribe_request:
+    case unsubscribe_request:
+      clients[id].subscribed = type == subscribe_request;
+      answer(id, ok_answer, request, std::vector<uint8_t>());
+      // Start or stop polling.
+      work.set();
+      return;
+    case release_request:
+      if (claimant == id) {
+        claimant = 0;
+        work.set();
+      }
+      answer(id, ok_answer, request, std::vector<uint8_t>());
+      return;
+    case claim_request:
+      if (length != 4) {
+        break;
+      }
+      if (queued(id) >= options.max_requests) {
+        fail(id, request, NFC_EOVFLOW, "too many queued requests");
+        return;
+      }
+      job.expires = now() + GetUint32(payload);
+      jobs.push_back(job);
+      work.set();
+      return;
+    case transceive_request:
+      if (length < 2) {
+        break;
+      }
+      if (queued(id) >= options.max_requests) {
+        fail(id, request, NFC_EOVFLOW, "too many queued requests");
+        return;
+      }
+      job.payload.assign(payload, payload + length);
+      jobs.push_back(job);
+      if (polling_now) {
+        // Looking for a card can take a while, the command goes first.  The poll may not have
+        // reached the reader yet, so the socket thread keeps aborting until it is over.
+        preempting = true;
+        reader.abort_command();
+      }
+      work.set();
+      return;
+    }
+    fail(id, request, NFC_EINVARG, "invalid request");
+  }
+
+
+  size_t
+  Daemon::queued(unsigned id) const {
+    size_t count = 0;
+    for (std::deque<Job>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+      count += it->client == id ? 1 : 0;
+    }
+    return count;
+  }
+
+
+  void
+  Daemon::drop_client(unsigned id) {
+    std::map<unsigned, Client>::iterator it = clients.find(id);
+    if (it == clients.end()) {
+      return;
+    }
+    close(it->second.fd);
+    clients.erase(it);
+    for (std::deque<Job>::iterator job = jobs.begin(); job != jobs.end();) {
+      job = job->client == id ? jobs.erase(job) : job + 1;
+    }
+    if (claimant == id) {
+      claimant = 0;
+    }
+    work.set();
+  }
+
+
+  void
+  Daemon::RunReader(void *arg) {
+    static_cast<Daemon *>(arg)->run_reader();
+  }
+
+
+  void
+  Daemon::run_reader() {
+    nfc_target target;
+    const char *card_type = NULL;
+    bool present = false;
+    uint64_t next_poll = 0;
+    for (;;) {
+      // Reset before looking at the queue, so that no request is missed.
+      work.reset();
+      Job job;
+      bool have_job = false;
+      bool poll = false;
+      uint64_t wait = options.poll_interval;
+      {
+        WrLock lk(lock);
+        if (!running) {
+          break;
+        }
+        const uint64_t time = now();
+        have_job = next_job(job, time, wait);
+        if (!have_job && !claimant && subscribers()) {
+          // Polling would disturb the session of a client holding the reader.
+          poll = time >= next_poll;
+          polling_now = poll && !present;
+          preempting = preempting && polling_now;
+          wait = std::min(wait, next_poll > time ? next_poll - time : 0);
+        }
+      }
+
+      if (have_job) {
+        run_job(job);
+      }
+      else if (poll && !present) {
+        Script::Results results;
+        card_type = NULL;
+        present = reader.poll_target(target, options.targets, results, card_type) > 0;
+        WrLock lk(lock);
+        polling_now = false;
+        preempting = false;
+        if (present) {
+          broadcast(target_event, target, card_type);
+        }
+        next_poll = now() + options.poll_interval;
+      }
+      else if (poll) {
+        if (reader.is_present(target) < 0) {
+          present = false;
+          WrLock lk(lock);
+          broadcast(removed_event, target, card_type);
+        }
+        next_poll = now() + options.poll_interval;
+      }
+      else {
+        work.wait(wait);
+      }
+    }
+  }
+
+
+  bool
+  Daemon::next_job(Job &job, uint64_t time, uint64_t &wait) {
+    if (claimant && time >= claim_expires) {
+      claimant = 0;
+    }
+    for (std::deque<Job>::iterator it = jobs.begin(); it != jobs.end();) {
+      if (claimant && it->client != claimant) {
+        // Waits for the claim to end.
+        if (it->type == claim_request && time >= it->expires) {
+          fail(it->client, it->id, NFC_ETIMEOUT, "reader claimed by another client");
+          it = jobs.erase(it);
+          continue;
+        }
+        if (!it->waited) {
+          it->waited = true;
+          ++current.contended;
+        }
+        if (it->type == claim_request) {
+          wait = std::min(wait, it->expires - time);
+        }
+        ++it;
+        continue;
+      }
+      if (it->type == claim_request) {
+        claimant = it->client;
+        claim_expires = time + options.claim_timeout;
+        ++current.claims;
+        answer(it->client, ok_answer, it->id, std::vector<uint8_t>());
+        it = jobs.erase(it);
+        continue;
+      }
+      job = *it;
+      jobs.erase(it);
+      return true;
+    }
+    if (claimant) {
+      wait = std::min(wait, claim_expires - time);
+    }
+    return false;
+  }
+
+
+  void
+  Daemon::run_job(const Job &job) {
+    // Only commands get here, claims are granted in the queue.
+    std::vector<uint8_t> transmit(job.payload.begin() + 2, job.payload.end());
+    std::vector<uint8_t> receive(job.payload[0] << 8 | job.payload[1]);
+    unsigned retries;
+    int result = reader.transceive(transmit, receive, retries);
+    WrLock lk(lock);
+    if (claimant == job.client) {
+      claim_expires = now() + options.claim_timeout;
+    }
+    if (result < 0) {
+      fail(job.client, job.id, result, "unable to transceive data");
+    }
+    else {
+      answer(job.client, ok_answer, job.id, receive);
+    }
+  }
+
+
+  void
+  Daemon::broadcast(uint8_t type, const nfc_target &target, const char *card_type) {
+    const Target info(target);
+    std::vector<uint8_t> payload;
+    PutString(payload, card_type ? std::string(card_type) : info.card_type());
+    const std::vector<uint8_t> serialized = info.serialize();
+    payload.insert(payload.end(), serialized.begin(), serialized.end());
+    for (std::map<unsigned, Client>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+      if (it->second.subscribed) {
+        answer(it->first, type, 0, payload);
+      }
+    }
+    ++current.events;
+  }
+
+
+  unsigned
+  Daemon::subscribers() const {
+    unsigned count = 0;
+    for (std::map<unsigned, Client>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+      count += it->second.subscribed ? 1 : 0;
+    }
+    return count;
+  }
+
+
+  void
+  Daemon::answer(unsigned client, uint8_t type, uint32_t id, const std::vector<uint8_t> &payload) {
+    std::map<unsigned, Client>::iterator it = clients.find(client);
+    if (it == clients.end()) {
+      // gone meanwhile
+      return;
+    }
+    std::vector<uint8_t> &output = it->second.output;
+    PutUint32(output, uint32_t(header_size + payload.size()));
+    output.push_back(type);
+    PutUint32(output, id);
+    output.insert(output.end(), payload.begin(), payload.end());
+    wake();
+  }
+
+
+  void
+  Daemon::fail(unsigned client, uint32_t id, int error, const char message[]) {
+    std::vector<uint8_t> payload;
+    PutUint32(payload, uint32_t(error));
+    payload.insert(payload.end(), message, message + strlen(message));
+    answer(client, error_answer, id, payload);
+  }
+
+
+  void
+  Daemon::wake() {
+    const uint8_t byte = 0;
+    // A full pipe already wakes the socket thread.
+    if (write(wakeup[1], &byte, 1) < 0) {
+      return;
+    }
+  }
+
+
+  uint64_t
+  Daemon::now() {
+    return uv_hrtime() / 1000000;
+  }
+
+
+  void
+  Daemon::hold(napi_env env, napi_value instance) {
+    napi_value resource_name;
+    napi_create_string_utf8(env, "nfc:daemon", NAPI_AUTO_LENGTH, &resource_name);
+    napi_create_reference(env, instance, 1, &self);
+    napi_create_threadsafe_function(env, NULL, NULL, resource_name, 0, 1, NULL, NULL, NULL, KeepAlive, &keep_alive);
+  }
+
+
+  void
+  Daemon::release(napi_env env) {
+    if (self) {
+      napi_delete_reference(env, self);
+      self = NULL;
+    }
+    if (keep_alive) {
+      napi_release_threadsafe_function(keep_alive, napi_tsfn_release);
+      keep_alive = NULL;
+    }
+  }
+
+
+  void
+  Daemon::KeepAlive(napi_env env, napi_value callback, void *context, void *data) {
+    // never called
+  }
+
+
+  napi_value
+  Daemon::Serve(napi_env env, RawPool pool, RawSlot slot, const std::string &path, const Options &options) {
+    napi_value instance = ObjectWrap::Construct(env, pool, slot);
+    if (!IsObject(env, instance)) {
+      return instance;
+    }
+    Daemon &daemon = Unwrap(env, instance);
+    int result = daemon.start(path, options);
+    if (result < 0) {
+      daemon.reader.close();
+      std::string message = "unable to serve on " + path + ": " + strerror(-result);
+      return ThrowError(env, message.c_str());
+    }
+    daemon.hold(env, instance);
+    return instance;
+  }
+
+
+  Daemon *
+  Daemon::Create(const Arguments &args) {
+    return ObjectWrap::Create<RawPool, RawSlot>(args);
+  }
+
+
+  const napi_type_tag Daemon::type_tag = {0x5d3e8b21c7f04a69ULL, 0xa1c62f9e0b7d4358ULL};
+
+
+  void
+  Daemon::Initialize(napi_env env, napi_value exports) {
+    Properties properties;
+
+    properties.accessor<GetPath>("path");
+    properties.accessor<GetStats>("stats");
+
+    properties.method<Close>("close");
+
+    Install(env, "Daemon", exports, properties);
+  }
+
+
+  napi_value
+  Daemon::GetPath(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).path);
+  }
+
+
+  napi_value
+  Daemon::GetStats(const Arguments &args) {
+    napi_env env = args.Env();
+    Stats stats = Unwrap(env, args.This()).stats();
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "clients", toJS(env, stats.clients));
+    napi_set_named_property(env, result, "subscribers", toJS(env, stats.subscribers));
+    napi_set_named_property(env, result, "requests", toJS(env, stats.requests));
+    napi_set_named_property(env, result, "events", toJS(env, stats.events));
+    napi_set_named_property(env, result, "claims", toJS(env, stats.claims));
+    napi_set_named_property(env, result, "contended", toJS(env, stats.contended));
+    return result;
+  }
+
+
+  napi_value
+  Daemon::Close(const Arguments &args) {
+    napi_env env = args.Env();
+    Daemon &instance = Unwrap(env, args.This());
+    bool result = instance.stop();
+    instance.release(env);
+    return toJS(env, result);
+  }
+
+}
@@ -0,0 +1,171 @@
+#ifndef NFC_DAEMON_HH
+#define NFC_DAEMON_HH
+
+#include "device.hh"
+#include "util.hh"
+#include <deque>
+#include <map>
+#include <nfc/nfc.h>
+#include <string>
+#include <vector>
+
+
+namespace nfc {
+
+  // Shares a reader with other local processes over a Unix socket.  The daemon keeps its
+  // own handle on the device, polls for targets while clients listen for them, and runs
+  // their commands one at a time; a client holding a claim has the reader to itself.
+  //
+  // Frames: length of the rest (4 bytes), type (1), request id (4), payload.  Integers are
+  // big endian.  Every request is answered with OK or ERROR carrying its id.
+  //   SUBSCRIBE   0x01                        tag events are sent from now on
+  //   UNSUBSCRIBE 0x02
+  //   CLAIM       0x03  timeout (4)           OK once the reader is ours, ERROR after timeout ms
+  //   RELEASE     0x04
+  //   TRANSCEIVE  0x05  capacity (2), data    OK with the response
+  //   OK          0x80  data
+  //   ERROR       0x81  libnfc error (4), message; NFC_EOVFLOW when too many requests are queued
+  //   TARGET      0x90  card type (1 byte length), target as Target::serialize() writes it
+  //   REMOVED     0x91  as TARGET
+  // Events carry request id 0.
+  class Daemon:
+    public nfc::ObjectWrap<Daemon>
+  {
+  public:
+    enum {
+      subscribe_request = 0x01,
+      unsubscribe_request = 0x02,
+      claim_request = 0x03,
+      release_request = 0x04,
+      transceive_request = 0x05,
+      ok_answer = 0x80,
+      error_answer = 0x81,
+      target_event = 0x90,
+      removed_event = 0x91
+    };
+
+    struct Options {
+      Device::PollOptions targets;
+      unsigned poll_interval;  // ms between polls and presence checks
+      unsigned claim_timeout;  // ms a claim lasts after the last command of its client
+      unsigned max_clients;
+      unsigned max_requests;   // queued per client, further requests are refused
+      unsigned mode;           // permissions of the socket
+
+      Options();
+    };
+
+    struct Stats {
+      unsigned clients;
+      unsigned subscribers;
+      uint64_t requests;
+      uint64_t events;
+      uint64_t claims;
+      uint64_t contended;  // commands and claims which had to wait for another client's claim
+
+      Stats();
+    };
+
+  protected:
+    struct Client {
+      int fd;
+      std::vector<uint8_t> input;
+      std::vector<uint8_t> output;
+      bool subscribed;
+
+      Client(int fd = -1);
+    };
+
+    struct Job {
+      unsigned client;
+      uint8_t type;
+      uint32_t id;
+      std::vector<uint8_t> payload;
+      uint64_t expires;  // ms, for claims
+      bool waited;
+    };
+
+    Device reader;
+    Options options;
+    std::string path;
+    int listener;
+    int wakeup[2];  // self-pipe, wakes the socket thread when answers are queued
+
+    // Guards the fields below.
+    Lock lock;
+    std::map<unsigned, Client> clients;
+    unsigned next_client;
+    std::deque<Job> jobs;
+    unsigned claimant;       // client holding the reader, 0 if none
+    uint64_t claim_expires;  // ms
+    bool running;
+    bool polling_now;        // the reader thread is looking for a new target
+    bool preempting;         // a command waits for that poll to be aborted
+    Stats current;
+
+    Event work;
+    uv_thread_t socket_thread;
+    uv_thread_t reader_thread;
+    bool started;
+
+    // A serving daemon is neither collected nor lets the process exit.
+    napi_ref self;
+    napi_threadsafe_function keep_alive;
+
+  public:
+    Daemon(RawPool pool, RawSlot slot);
+    ~Daemon();
+
+    // Returns 0 or a negative errno.
+    int start(const std::string &path, const Options &options);
+    bool stop();
+    Stats stats() const;
+
+  public:
+    // Serves the device of pool and slot on path, or throws.
+    static napi_value Serve(napi_env env, RawPool pool, RawSlot slot, const std::string &path,
+                            const Options &options);
+
+  public:
+    static const napi_type_tag type_tag;
+
+    static Daemon *Create(const Arguments &args);
+    static void Initialize(napi_env env, napi_value exports);
+
+    static napi_value GetPath(const Arguments &args);
+    static napi_value GetStats(const Arguments &args);
+    static napi_value Close(const Arguments &args);
+
+  protected:
+    void hold(napi_env env, napi_value instance);
+    void release(napi_env env);
+    static void KeepAlive(napi_env env, napi_value callback, void *context, void *data);
+
+    int listen();
+
+    static void RunSocket(void *arg);
+    void run_socket();
+    void accept_clients();
+    bool read_client(unsigned id, Client &client);
+    void handle(unsigned id, uint8_t type, uint32_t request, const uint8_t *payload, size_t length);
+    size_t queued(unsigned id) const;
+    void drop_client(unsigned id);
+
+    static void RunReader(void *arg);
+    void run_reader();
+    bool next_job(Job &job, uint64_t now, uint64_t &wait);
+    void run_job(const Job &job);
+    void broadcast(uint8_t type, const nfc_target &target, const char *card_type);
+    unsigned subscribers() const;
+
+    // Queue frames for the socket thread, with the lock held.
+    void answer(unsigned client, uint8_t type, uint32_t id, const std::vector<uint8_t> &payload);
+    void fail(unsigned client, uint32_t id, int error, const char message[]);
+    void wake();
+
+    static uint64_t now();
+  };
+
+}
+
+#endif
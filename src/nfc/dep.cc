@@ -0,0 +1,239 @@
+#include "dep.hh"
+#include <algorithm>
+#include <nfc/nfc.h>
+#include <uv.h>
+
+
+namespace nfc {
+
+  static const uint8_t push_frame = 0x01;
+  static const uint8_t ack_frame = 0x02;
+  static const uint8_t pull_frame = 0x03;
+  static const uint8_t data_frame = 0x04;
+  static const uint8_t close_frame = 0x05;
+
+
+  DepTransfer::Stats::Stats()
+    : bytes(0), frames(0), retries(0), time(0)
+  {
+  }
+
+
+  size_t
+  DepTransfer::frame_size(uint8_t pp) {
+    // LR gives 64, 128, 192 or 254 bytes, less the DEP_REQ header.
+    static const size_t lengths[] = {64, 128, 192, 254};
+    return lengths[(pp >> 4) & 3] - 3;
+  }
+
+
+  bool
+  DepTransfer::atr_req_pp(const std::vector<uint8_t> &atr_req, uint8_t &pp) {
+    // [LEN] D4 00, NFCID3 (10 bytes), DID, BS, BR, PP, general bytes.  Readers differ in whether
+    // they hand on the length byte.
+    const size_t start = atr_req.size() > 2 && atr_req[0] != 0xd4 ? 1 : 0;
+    if (atr_req.size() < start + 16 || atr_req[start] != 0xd4 || atr_req[start + 1] != 0x00) {
+      return false;
+    }
+    pp = atr_req[start + 15];
+    return true;
+  }
+
+
+  int
+  DepTransfer::push(Transport &transport, const std::vector<uint8_t> &payload, size_t frame_size, Stats &stats) {
+    uint64_t start = uv_hrtime();
+    uint32_t offset = 0;
+    unsigned retries = 0;
+    std::vector<uint8_t> frame, response;
+    do {
+      header(frame, push_frame, offset, payload.size());
+      size_t length = std::min(frame_size - std::min(frame_size, frame.size()), payload.size() - offset);
+      if (!length && payload.size()) {
+        return NFC_EINVARG;
+      }
+      frame.insert(frame.end(), payload.begin() + offset, payload.begin() + offset + length);
+      response.resize(max_frame_size);
+      int result = transport.transceive(frame, response);
+      if (result < 0) {
+        return result;
+      }
+      uint32_t acked, total;
+      size_t data;
+      if (!parse(response, ack_frame, acked, total, data) || acked > payload.size()) {
+        return NFC_ERFTRANS;
+      }
+      ++stats.frames;
+      if (acked < offset + length) {
+        // The target missed a frame, continue from where it is.
+        ++stats.retries;
+        if (++retries > max_retries) {
+          return NFC_ERFTRANS;
+        }
+      }
+      else {
+        retries = 0;
+      }
+      stats.bytes += acked > offset ? acked - offset : 0;
+      offset = acked;
+    } while (offset < payload.size());
+    stats.time += uv_hrtime() - start;
+    return 0;
+  }
+
+
+  int
+  DepTransfer::pull(Transport &transport, std::vector<uint8_t> &payload, size_t frame_size, Stats &stats) {
+    uint64_t start = uv_hrtime();
+    payload.clear();
+    uint32_t total = 0;
+    unsigned retries = 0;
+    std::vector<uint8_t> frame, response;
+    do {
+      header(frame, pull_frame, payload.size(), 0);
+      response.resize(std::max(frame_size, size_t(9)));
+      int result = transport.transceive(frame, response);
+      if (result < 0) {
+        return result;
+      }
+      uint32_t offset;
+      size_t data;
+      if (!parse(response, data_frame, offset, total, data)) {
+        return NFC_ERFTRANS;
+      }
+      ++stats.frames;
+      if (offset != payload.size() || (data == response.size() && payload.size() < total)) {
+        // Out of order or empty, ask again.
+        ++stats.retries;
+        if (++retries > max_retries) {
+          return NFC_ERFTRANS;
+        }
+        continue;
+      }
+      retries = 0;
+      if (payload.empty()) {
+        payload.reserve(total);
+      }
+      size_t length = std::min(response.size() - data, size_t(total) - payload.size());
+      payload.insert(payload.end(), response.begin() + data, response.begin() + data + length);
+      stats.bytes += length;
+    } while (payload.size() < total);
+    stats.time += uv_hrtime() - start;
+    return 0;
+  }
+
+
+  int
+  DepTransfer::close(Transport &transport) {
+    std::vector<uint8_t> frame, response(max_frame_size);
+    header(frame, close_frame, 0, 0);
+    int result = transport.transceive(frame, response);
+    uint32_t offset, total;
+    size_t data;
+    if (result >= 0 && !parse(response, ack_frame, offset, total, data)) {
+      return NFC_ERFTRANS;
+    }
+    return result < 0 ? result : 0;
+  }
+
+
+  int
+  DepTransfer::serve(Link &link, const std::vector<uint8_t> &outgoing, std::vector<uint8_t> &incoming,
+                     size_t frame_size, Stats &stats) {
+    uint64_t start = uv_hrtime();
+    uint32_t expected = 0;
+    std::vector<uint8_t> frame, response;
+    int result = link.receive(frame);
+    if (result == NFC_ETGRELEASED) {
+      return 0;
+    }
+    if (result < 0) {
+      return result;
+    }
+    for (;;) {
+      uint32_t offset, total;
+      size_t data;
+      if (parse(frame, push_frame, offset, total, data)) {
+        if (!offset) {
+          incoming.clear();
+          incoming.reserve(total);
+          expected = total;
+        }
+        // Frames out of order are dropped, the acknowledgement tells the initiator where to resume.
+        if (offset == incoming.size()) {
+          size_t length = std::min(frame.size() - data, size_t(expected) - incoming.size());
+          incoming.insert(incoming.end(), frame.begin() + data, frame.begin() + data + length);
+          stats.bytes += length;
+        }
+        else {
+          ++stats.retries;
+        }
+        header(response, ack_frame, incoming.size(), 0);
+      }
+      else if (parse(frame, pull_frame, offset, total, data)) {
+        offset = std::min(offset, uint32_t(outgoing.size()));
+        header(response, data_frame, offset, outgoing.size());
+        size_t length = std::min(frame_size - std::min(frame_size, response.size()), outgoing.size() - offset);
+        response.insert(response.end(), outgoing.begin() + offset, outgoing.begin() + offset + length);
+        stats.bytes += length;
+      }
+      else if (parse(frame, close_frame, offset, total, data)) {
+        header(response, ack_frame, incoming.size(), 0);
+        link.send(response);
+        break;
+      }
+      else {
+        return NFC_ERFTRANS;
+      }
+      ++stats.frames;
+      result = link.send(response);
+      if (result >= 0) {
+        result = link.receive(frame);
+      }
+      if (result == NFC_ETGRELEASED) {
+        // The initiator went away without closing.
+        break;
+      }
+      if (result < 0) {
+        return result;
+      }
+    }
+    stats.time += uv_hrtime() - start;
+    return 0;
+  }
+
+
+  void
+  DepTransfer::header(std::vector<uint8_t> &frame, uint8_t type, uint32_t offset, size_t total) {
+    frame.clear();
+    frame.push_back(type);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      frame.push_back(uint8_t(offset >> shift));
+    }
+    if (!offset && (type == push_frame || type == data_frame)) {
+      for (int shift = 24; shift >= 0; shift -= 8) {
+        frame.push_back(uint8_t(total >> shift));
+      }
+    }
+  }
+
+
+  bool
+  DepTransfer::parse(const std::vector<uint8_t> &frame, uint8_t type, uint32_t &offset, uint32_t &total,
+                     size_t &data) {
+    if (frame.size() < 5 || frame[0] != type) {
+      return false;
+    }
+    offset = uint32_t(frame[1]) << 24 | uint32_t(frame[2]) << 16 | uint32_t(frame[3]) << 8 | frame[4];
+    data = 5;
+    if (!offset && (type == push_frame || type == data_frame)) {
+      if (frame.size() < 9) {
+        return false;
+      }
+      total = uint32_t(frame[5]) << 24 | uint32_t(frame[6]) << 16 | uint32_t(frame[7]) << 8 | frame[8];
+      data = 9;
+    }
+    return true;
+  }
+
+}
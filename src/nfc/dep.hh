@@ -0,0 +1,69 @@
+#ifndef NFC_DEP_HH
+#define NFC_DEP_HH
+
+#include "transport.hh"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // Bulk transfers over an NFC-DEP link, split into frames of the negotiated size.
+  //
+  // The initiator pushes data to the target or pulls data from it, one DEP exchange per
+  // frame: a push is acknowledged in the response to the same frame, a pull acknowledges
+  // the previous frame by asking for the next offset.  Every frame carries its offset, so
+  // lost frames are sent again instead of failing the transfer.
+  //
+  // Frames: type, offset (4 bytes), total length (4 bytes, first frame only), data.
+  //   PUSH  -> ACK with the number of bytes received so far
+  //   PULL  -> DATA from the requested offset
+  //   CLOSE -> ACK, ends serve() on the target
+  //
+  // Operations return a negative libnfc error (NFC_ERFTRANS for protocol errors) or 0.
+  class DepTransfer {
+  public:
+    // Target side of the link.
+    class Link {
+    public:
+      virtual ~Link() {}
+      virtual int receive(std::vector<uint8_t> &frame) = 0;
+      virtual int send(const std::vector<uint8_t> &frame) = 0;
+    };
+
+    struct Stats {
+      uint64_t bytes;    // payload moved
+      uint64_t frames;
+      uint64_t retries;  // frames sent again
+      uint64_t time;     // ns
+
+      Stats();
+    };
+
+    static const size_t max_frame_size = 254 - 3;
+    static const unsigned max_retries = 3;
+
+    // Returns the largest frame for the length reduction in the PP byte of the ATR.
+    static size_t frame_size(uint8_t pp);
+    // Finds the initiator's PP byte in the ATR_REQ received on activation as a target.
+    static bool atr_req_pp(const std::vector<uint8_t> &atr_req, uint8_t &pp);
+
+    static int push(Transport &transport, const std::vector<uint8_t> &payload, size_t frame_size, Stats &stats);
+    static int pull(Transport &transport, std::vector<uint8_t> &payload, size_t frame_size, Stats &stats);
+    static int close(Transport &transport);
+
+    // Answers the initiator once the target is activated, until it closes the transfer or
+    // releases the target.
+    static int serve(Link &link, const std::vector<uint8_t> &outgoing, std::vector<uint8_t> &incoming,
+                     size_t frame_size, Stats &stats);
+
+  protected:
+    static void header(std::vector<uint8_t> &frame, uint8_t type, uint32_t offset, size_t total);
+    static bool parse(const std::vector<uint8_t> &frame, uint8_t type, uint32_t &offset, uint32_t &total,
+                      size_t &data);
+  };
+
+}
+
+#endif
@@ -0,0 +1,426 @@
+#include "desfire.hh"
+#include <algorithm>
+#include <nfc/nfc.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+
+namespace nfc {
+
+  static const size_t max_frame_size = 256;
+
+
+  static const EVP_CIPHER *
+  get_cipher(Desfire::KeyType type, size_t key_size) {
+    if (type == Desfire::AES) {
+      return key_size == 16 ? EVP_aes_128_cbc() : NULL;
+    }
+    if (type == Desfire::TDES) {
+      return key_size == 16 ? EVP_des_ede_cbc() : key_size == 24 ? EVP_des_ede3_cbc() : NULL;
+    }
+    return NULL;
+  }
+
+
+  // CBC without padding, leaves the last ciphertext block in iv as DESFire chains it.
+  static bool
+  crypt(Desfire::KeyType type, const std::vector<uint8_t> &key, std::vector<uint8_t> &iv,
+        std::vector<uint8_t> &data, bool encrypt) {
+    const EVP_CIPHER *cipher = get_cipher(type, key.size());
+    if (!cipher || data.empty() || data.size() % iv.size()) {
+      return false;
+    }
+    std::vector<uint8_t> last(data.end() - iv.size(), data.end());
+    std::vector<uint8_t> result(data.size() + iv.size());
+    int size = 0, final_size = 0;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    bool ok = ctx
+      && EVP_CipherInit_ex(ctx, cipher, NULL, key.data(), iv.data(), encrypt ? 1 : 0)
+      && EVP_CIPHER_CTX_set_padding(ctx, 0)
+      && EVP_CipherUpdate(ctx, result.data(), &size, data.data(), int(data.size()))
+      && EVP_CipherFinal_ex(ctx, result.data() + size, &final_size);
+    EVP_CIPHER_CTX_free(ctx);
+    if (!ok) {
+      return false;
+    }
+    result.resize(size + final_size);
+    if (encrypt) {
+      last.assign(result.end() - iv.size(), result.end());
+    }
+    iv.swap(last);
+    data.swap(result);
+    return true;
+  }
+
+
+  static std::vector<uint8_t>
+  rotate_left(const std::vector<uint8_t> &data) {
+    std::vector<uint8_t> result(data.begin() + 1, data.end());
+    result.push_back(data.front());
+    return result;
+  }
+
+
+  static void
+  append(std::vector<uint8_t> &to, const std::vector<uint8_t> &from, size_t begin, size_t end) {
+    to.insert(to.end(), from.begin() + begin, from.begin() + end);
+  }
+
+
+  static std::vector<uint8_t>
+  derive_subkey(const std::vector<uint8_t> &key) {
+    std::vector<uint8_t> result(key.size());
+    for (size_t i = 0; i < key.size(); ++i) {
+      result[i] = uint8_t(key[i] << 1 | (i + 1 < key.size() ? key[i + 1] >> 7 : 0));
+    }
+    if (key[0] & 0x80) {
+      result.back() ^= key.size() == 16 ? 0x87 : 0x1b;
+    }
+    return result;
+  }
+
+
+  // CRC32 as used by DESFire EV1: reflected, no final XOR.
+  static uint32_t
+  crc32(const uint8_t *data, size_t size, uint8_t status) {
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i <= size; ++i) {
+      crc ^= i < size ? data[i] : status;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+      }
+    }
+    return crc;
+  }
+
+
+  static bool
+  check_crc32(const std::vector<uint8_t> &data, size_t size, uint8_t status) {
+    if (size + 4 > data.size()) {
+      return false;
+    }
+    for (size_t i = size + 4; i < data.size(); ++i) {
+      if (data[i]) {
+        return false;
+      }
+    }
+    uint32_t crc = crc32(data.data(), size, status);
+    return data[size] == uint8_t(crc) && data[size + 1] == uint8_t(crc >> 8)
+      && data[size + 2] == uint8_t(crc >> 16) && data[size + 3] == uint8_t(crc >> 24);
+  }
+
+
+  Desfire::Desfire()
+    : key_type(NONE)
+  {
+  }
+
+
+  void
+  Desfire::reset() {
+    key_type = NONE;
+    session_key.clear();
+    iv.clear();
+    subkey1.clear();
+    subkey2.clear();
+  }
+
+
+  bool
+  Desfire::is_authenticated() const {
+    return key_type != NONE;
+  }
+
+
+  int
+  Desfire::authenticate(Transport &transport, uint8_t key_no, KeyType type, const std::vector<uint8_t> &key_) {
+    reset();
+    std::vector<uint8_t> key(key_);
+    if (type == TDES && key.size() == 8) {
+      // Single DES is 2K3DES with equal halves.
+      key.insert(key.end(), key_.begin(), key_.end());
+    }
+    if (!get_cipher(type, key.size())) {
+      return NFC_EINVARG;
+    }
+    const size_t random_size = type == TDES && key.size() == 16 ? 8 : 16;
+    std::vector<uint8_t> auth_iv(block_size(type), 0);
+
+    std::vector<uint8_t> frame(2);
+    frame[0] = type == AES ? 0xaa : 0x1a;
+    frame[1] = key_no;
+    std::vector<uint8_t> rnd_b;
+    int status = transmit(transport, frame, rnd_b);
+    if (status != ADDITIONAL_FRAME) {
+      return status == OPERATION_OK ? AUTHENTICATION_ERROR : status;
+    }
+    if (rnd_b.size() != random_size || !crypt(type, key, auth_iv, rnd_b, false)) {
+      return LENGTH_ERROR;
+    }
+
+    std::vector<uint8_t> rnd_a(random_size);
+    if (RAND_bytes(rnd_a.data(), int(rnd_a.size())) != 1) {
+      return NFC_ESOFT;
+    }
+    std::vector<uint8_t> token(rnd_a);
+    std::vector<uint8_t> rotated_b = rotate_left(rnd_b);
+    token.insert(token.end(), rotated_b.begin(), rotated_b.end());
+    crypt(type, key, auth_iv, token, true);
+    frame.assign(1, ADDITIONAL_FRAME);
+    frame.insert(frame.end(), token.begin(), token.end());
+    std::vector<uint8_t> response;
+    status = transmit(transport, frame, response);
+    if (status != OPERATION_OK) {
+      return status;
+    }
+    if (response.size() != random_size || !crypt(type, key, auth_iv, response, false)
+        || response != rotate_left(rnd_a)) {
+      return AUTHENTICATION_ERROR;
+    }
+
+    session_key.clear();
+    append(session_key, rnd_a, 0, 4);
+    append(session_key, rnd_b, 0, 4);
+    if (type == AES) {
+      append(session_key, rnd_a, 12, 16);
+      append(session_key, rnd_b, 12, 16);
+    }
+    else if (key.size() == 24) {
+      append(session_key, rnd_a, 6, 10);
+      append(session_key, rnd_b, 6, 10);
+      append(session_key, rnd_a, 12, 16);
+      append(session_key, rnd_b, 12, 16);
+    }
+    else if (std::equal(key.begin(), key.begin() + 8, key.begin() + 8)) {
+      append(session_key, rnd_a, 0, 4);
+      append(session_key, rnd_b, 0, 4);
+    }
+    else {
+      append(session_key, rnd_a, 4, 8);
+      append(session_key, rnd_b, 4, 8);
+    }
+    key_type = type;
+
+    std::vector<uint8_t> zero_iv(block_size(type), 0);
+    std::vector<uint8_t> l(block_size(type), 0);
+    crypt(key_type, session_key, zero_iv, l, true);
+    subkey1 = derive_subkey(l);
+    subkey2 = derive_subkey(subkey1);
+    iv.assign(block_size(type), 0);
+    return OPERATION_OK;
+  }
+
+
+  int
+  Desfire::select_application(Transport &transport, uint32_t aid) {
+    // Selecting an application ends the authentication.
+    reset();
+    std::vector<uint8_t> frame(4);
+    frame[0] = 0x5a;
+    frame[1] = uint8_t(aid);
+    frame[2] = uint8_t(aid >> 8);
+    frame[3] = uint8_t(aid >> 16);
+    std::vector<uint8_t> data;
+    return command(transport, frame, PLAIN, data);
+  }
+
+
+  int
+  Desfire::get_file_ids(Transport &transport, std::vector<uint8_t> &ids) {
+    return command(transport, std::vector<uint8_t>(1, 0x6f), PLAIN, ids);
+  }
+
+
+  int
+  Desfire::get_file_settings(Transport &transport, uint8_t file_no, std::vector<uint8_t> &settings) {
+    std::vector<uint8_t> frame(2);
+    frame[0] = 0xf5;
+    frame[1] = file_no;
+    return command(transport, frame, PLAIN, settings);
+  }
+
+
+  int
+  Desfire::read_data(Transport &transport, uint8_t file_no, uint32_t offset, uint32_t length, Mode mode,
+                     std::vector<uint8_t> &data) {
+    if (mode == AUTO) {
+      std::vector<uint8_t> settings;
+      int status = get_file_settings(transport, file_no, settings);
+      if (status != OPERATION_OK) {
+        return status;
+      }
+      if (settings.size() < 4) {
+        return LENGTH_ERROR;
+      }
+      mode = (settings[1] & 3) == 3 ? ENCIPHERED : (settings[1] & 3) == 1 ? MACED : PLAIN;
+      // Free read access is always plain.
+      if (settings[3] >> 4 == 0xe || settings[2] >> 4 == 0xe) {
+        mode = PLAIN;
+      }
+    }
+    std::vector<uint8_t> frame(8);
+    frame[0] = 0xbd;
+    frame[1] = file_no;
+    frame[2] = uint8_t(offset);
+    frame[3] = uint8_t(offset >> 8);
+    frame[4] = uint8_t(offset >> 16);
+    frame[5] = uint8_t(length);
+    frame[6] = uint8_t(length >> 8);
+    frame[7] = uint8_t(length >> 16);
+    return command(transport, frame, mode, data, length);
+  }
+
+
+  bool
+  Desfire::parse_key_type(const std::string &name, KeyType &type) {
+    if (name == "aes") {
+      type = AES;
+    }
+    else if (name == "3des" || name == "2k3des" || name == "3k3des" || name == "des") {
+      type = TDES;
+    }
+    else {
+      return false;
+    }
+    return true;
+  }
+
+
+  bool
+  Desfire::parse_mode(const std::string &name, Mode &mode) {
+    if (name == "auto") {
+      mode = AUTO;
+    }
+    else if (name == "plain") {
+      mode = PLAIN;
+    }
+    else if (name == "mac") {
+      mode = MACED;
+    }
+    else if (name == "full") {
+      mode = ENCIPHERED;
+    }
+    else {
+      return false;
+    }
+    return true;
+  }
+
+
+  int
+  Desfire::transmit(Transport &transport, const std::vector<uint8_t> &frame, std::vector<uint8_t> &data) {
+    std::vector<uint8_t> receive(max_frame_size);
+    int result = transport.transceive(frame, receive);
+    if (result < 0) {
+      return result;
+    }
+    if (receive.empty()) {
+      return LENGTH_ERROR;
+    }
+    data.assign(receive.begin() + 1, receive.end());
+    return receive[0];
+  }
+
+
+  int
+  Desfire::exchange(Transport &transport, const std::vector<uint8_t> &command, std::vector<uint8_t> &data) {
+    data.clear();
+    std::vector<uint8_t> frame(command);
+    std::vector<uint8_t> chunk;
+    for (;;) {
+      int status = transmit(transport, frame, chunk);
+      if (status < 0) {
+        return status;
+      }
+      data.insert(data.end(), chunk.begin(), chunk.end());
+      if (status != ADDITIONAL_FRAME) {
+        return status;
+      }
+      frame.assign(1, ADDITIONAL_FRAME);
+    }
+  }
+
+
+  int
+  Desfire::command(Transport &transport, const std::vector<uint8_t> &command, Mode mode, std::vector<uint8_t> &data,
+                   size_t length) {
+    if (is_authenticated()) {
+      // Commands are sent plain, but still advance the CMAC chain.
+      cmac(command);
+    }
+    int status = exchange(transport, command, data);
+    if (status != OPERATION_OK) {
+      // The card drops the authentication on errors, and the chain is lost on transmission errors.
+      reset();
+      return status;
+    }
+    if (!is_authenticated()) {
+      return OPERATION_OK;
+    }
+
+    if (mode == ENCIPHERED) {
+      // data || CRC32(data || status) || zero padding
+      if (data.empty() || data.size() % block_size(key_type) || !crypt(key_type, session_key, iv, data, false)) {
+        reset();
+        return LENGTH_ERROR;
+      }
+      size_t size = data.size() < 4 ? 0 : data.size() - 4;
+      if (length) {
+        size = std::min(size, length);
+      }
+      else {
+        while (size && !check_crc32(data, size, OPERATION_OK) && !data[size + 3]) {
+          --size;
+        }
+      }
+      if (!check_crc32(data, size, OPERATION_OK)) {
+        reset();
+        return INTEGRITY_ERROR;
+      }
+      data.resize(size);
+      return OPERATION_OK;
+    }
+
+    // data || CMAC(data || status), also for plain responses
+    const size_t mac_size = 8;
+    if (data.size() < mac_size) {
+      reset();
+      return LENGTH_ERROR;
+    }
+    std::vector<uint8_t> mac(data.end() - mac_size, data.end());
+    data.resize(data.size() - mac_size);
+    std::vector<uint8_t> message(data);
+    message.push_back(OPERATION_OK);
+    if (!std::equal(mac.begin(), mac.end(), cmac(message).begin())) {
+      reset();
+      return INTEGRITY_ERROR;
+    }
+    return OPERATION_OK;
+  }
+
+
+  size_t
+  Desfire::block_size(KeyType type) {
+    return type == AES ? 16 : 8;
+  }
+
+
+  const std::vector<uint8_t> &
+  Desfire::cmac(const std::vector<uint8_t> &message) {
+    const size_t size = block_size(key_type);
+    std::vector<uint8_t> data(message);
+    const std::vector<uint8_t> *subkey = &subkey1;
+    if (data.empty() || data.size() % size) {
+      data.push_back(0x80);
+      data.resize((data.size() + size - 1) / size * size, 0);
+      subkey = &subkey2;
+    }
+    for (size_t i = 0; i < size; ++i) {
+      data[data.size() - size + i] ^= (*subkey)[i];
+    }
+    // The full MAC becomes the IV of the next operation, 8 bytes of it are transmitted.
+    crypt(key_type, session_key, iv, data, true);
+    return iv;
+  }
+
+}
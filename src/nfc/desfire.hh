@@ -0,0 +1,76 @@
+#ifndef NFC_DESFIRE_HH
+#define NFC_DESFIRE_HH
+
+#include "transport.hh"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+namespace nfc {
+
+  // MIFARE DESFire EV1 session: native commands with ISO (3DES) or AES authentication
+  // and the matching secure messaging (CMAC and encryption of responses).
+  //
+  // Operations return a negative libnfc error, a positive DESFire status code, or 0.
+  class Desfire {
+  public:
+    enum KeyType {
+      NONE,
+      TDES,  // 2K3DES or 3K3DES, by key length
+      AES
+    };
+
+    enum Mode {
+      AUTO = -1,
+      PLAIN = 0,
+      MACED = 1,
+      ENCIPHERED = 3
+    };
+
+    // Status codes, the local checks report the card's own codes.
+    static const int OPERATION_OK = 0x00;
+    static const int INTEGRITY_ERROR = 0x1e;
+    static const int LENGTH_ERROR = 0x7e;
+    static const int AUTHENTICATION_ERROR = 0xae;
+    static const int ADDITIONAL_FRAME = 0xaf;
+
+  protected:
+    KeyType key_type;
+    std::vector<uint8_t> session_key;
+    std::vector<uint8_t> iv;  // chained through all commands of the session
+    std::vector<uint8_t> subkey1, subkey2;  // CMAC subkeys
+
+  public:
+    Desfire();
+
+    void reset();
+    bool is_authenticated() const;
+
+    int authenticate(Transport &transport, uint8_t key_no, KeyType type, const std::vector<uint8_t> &key);
+    int select_application(Transport &transport, uint32_t aid);
+    int get_file_ids(Transport &transport, std::vector<uint8_t> &ids);
+    int get_file_settings(Transport &transport, uint8_t file_no, std::vector<uint8_t> &settings);
+    int read_data(Transport &transport, uint8_t file_no, uint32_t offset, uint32_t length, Mode mode,
+                  std::vector<uint8_t> &data);
+
+    static bool parse_key_type(const std::string &name, KeyType &type);
+    static bool parse_mode(const std::string &name, Mode &mode);
+
+  protected:
+    // Sends one frame, returns the status byte and the data of the response.
+    static int transmit(Transport &transport, const std::vector<uint8_t> &frame, std::vector<uint8_t> &data);
+    // Sends a command and collects the additional frames of the response.
+    static int exchange(Transport &transport, const std::vector<uint8_t> &command, std::vector<uint8_t> &data);
+
+    // Runs a command with secure messaging according to the state of the session.
+    int command(Transport &transport, const std::vector<uint8_t> &command, Mode mode, std::vector<uint8_t> &data,
+                size_t length = 0);
+
+    static size_t block_size(KeyType type);
+    const std::vector<uint8_t> &cmac(const std::vector<uint8_t> &message);
+  };
+
+}
+
+#endif
@@ -1,264 +1,1540 @@
 #include "device.hh"
+#include "classifier.hh"
+#include "daemon.hh"
 #include "target.hh"
+#include <cstdio>
+#include <cstring>
+#include <openssl/rand.h>
 
 
 namespace nfc {
 
-  RawDevice::RawDevice(nfc_device *device)
-    : RawObject(device)
+  // Serializes commands on a device and marks it busy while a command is in progress.
+  class Device::Command {
+    Device &instance;
+    RawSlot slot;  // keeps the slot alive while the command runs
+    Slot &raw;
+    WrLock lk;
+
+  public:
+    Command(Device &instance_)
+      : instance(instance_), slot(instance_.slot), raw(*slot.get()), lk(raw.io_lock)
+    {
+      unsigned generation, configured;
+      {
+        WrLock lk_state(raw.state_lock);
+        raw.busy = true;
+        raw.owner = instance.id;
+        generation = raw.generation;
+        configured = raw.configured;
+        instance.command_job = Jobs::current();
+      }
+      nfc_device *device = this->device();
+      if (device && (configured != instance.id || generation != instance.generation)) {
+        // The pool has reopened the device, or another Device on the same handle has configured
+        // it: apply our configuration again, on top of the defaults in the latter case.
+        instance.write_properties(device, configured && configured != instance.id);
+        WrLock lk_state(raw.state_lock);
+        raw.configured = instance.id;
+        instance.generation = generation;
+      }
+    }
+
+    ~Command() {
+      WrLock lk_state(raw.state_lock);
+      raw.busy = false;
+      raw.owner = 0;
+    }
+
+    // Returns the device handle, or NULL if it is closed or has failed.
+    nfc_device *device() {
+      {
+        RdLock lk_state(raw.state_lock);
+        if (raw.failed) {
+          return NULL;
+        }
+      }
+      return raw.device.get();
+    }
+
+    // Reports failures of the device to the pool.
+    int check(int result) {
+      return check(result, result);
+    }
+
+    // Polls of an empty field time out, which is recorded as a success.
+    int check_poll(int result) {
+      return check(result, result == NFC_ETIMEOUT ? NFC_SUCCESS : result);
+    }
+
+    // As check, recording outcome rather than result unless the device failed.
+    int check(int result, int outcome) {
+      nfc_device *device = raw.device.get();
+      int error = result < 0 ? result : NFC_SUCCESS;
+      if (!DevicePool::is_failure(error) && device && result < 0) {
+        error = nfc_device_get_last_error(device);
+      }
+      if (DevicePool::is_failure(error)) {
+        instance.pool.get()->fail(slot, error);
+      }
+      raw.errors.record(DevicePool::is_failure(error) ? error : outcome, uv_hrtime() / 1000000);
+      return result;
+    }
+
+    Device &owner() {
+      return instance;
+    }
+
+    // Probed when the handle was opened, it is not replaced while the command runs.
+    const Capabilities &capabilities() const {
+      return raw.capabilities;
+    }
+
+    // FeliCa blocks read from earlier taps, shared by all Devices on the handle.
+    ContentCache &cache() {
+      return raw.cache;
+    }
+
+  private:
+    // non-copyable
+    Command(const Command &);
+    Command &operator=(const Command &);
+  };
+
+
+  class Device::Exchange:
+    public Transport
+  {
+    Command &command;
+
+  public:
+    Exchange(Command &command_)
+      : command(command_)
+    {
+    }
+
+    int transceive(const std::vector<uint8_t> &transmit, std::vector<uint8_t> &receive) {
+      return Device::transceive(command, transmit, receive);
+    }
+  };
+
+
+  class Device::TargetLink:
+    public DepTransfer::Link
   {
+    Command &command;
+    int timeout;
+
+  public:
+    TargetLink(Command &command_, int timeout_)
+      : command(command_), timeout(timeout_)
+    {
+    }
+
+    int receive(std::vector<uint8_t> &frame) {
+      nfc_device *device = command.device();
+      if (!device) {
+        return NFC_EIO;
+      }
+      frame.resize(DepTransfer::max_frame_size);
+      int result = command.check(nfc_target_receive_bytes(device, frame.data(), frame.size(), timeout));
+      frame.resize(result < 0 ? 0 : size_t(result));
+      return result;
+    }
+
+    int send(const std::vector<uint8_t> &frame) {
+      nfc_device *device = command.device();
+      if (!device) {
+        return NFC_EIO;
+      }
+      return command.check(nfc_target_send_bytes(device, frame.data(), frame.size(), timeout));
+    }
+  };
+
+
+  class Device::RawFraming {
+    Command &command;
+    std::vector<nfc_property> changed;
+
+  public:
+    RawFraming(Command &command_)
+      : command(command_)
+    {
+    }
+
+    int disable(nfc_property property) {
+      nfc_device *device = command.device();
+      if (!device) {
+        return NFC_EIO;
+      }
+      int result = command.check(write_property(device, property, false));
+      if (result >= 0) {
+        changed.push_back(property);
+      }
+      return result;
+    }
+
+    ~RawFraming() {
+      nfc_device *device = command.device();
+      for (std::vector<nfc_property>::const_iterator it = changed.begin(); device && it != changed.end(); ++it) {
+        // The tracked value, or the default of nfc_initiator_init.
+        int value = true;
+        command.owner().properties.get(*it, value);
+        write_property(device, *it, value);
+      }
+    }
+
+  private:
+    // non-copyable
+    RawFraming(const RawFraming &);
+    RawFraming &operator=(const RawFraming &);
+  };
+
+
+  class Device::FiniteSelect {
+    Command &command;
+    bool changed;
+
+  public:
+    FiniteSelect(Command &command_)
+      : command(command_), changed(false)
+    {
+      // With the default of nfc_initiator_init, a select without a card in the field never returns.
+      int value = true;
+      command.owner().properties.get(NP_INFINITE_SELECT, value);
+      nfc_device *device = command.device();
+      if (device && value) {
+        changed = command.check(write_property(device, NP_INFINITE_SELECT, false)) >= 0;
+      }
+    }
+
+    ~FiniteSelect() {
+      nfc_device *device = command.device();
+      if (device && changed) {
+        write_property(device, NP_INFINITE_SELECT, true);
+      }
+    }
+
+  private:
+    // non-copyable
+    FiniteSelect(const FiniteSelect &);
+    FiniteSelect &operator=(const FiniteSelect &);
+  };
+
+
+  static unsigned
+  NextId() {
+    static Lock lock;
+    static unsigned last_id = 0;
+    WrLock lk(lock);
+    return ++last_id;
   }
 
 
-  void
-  RawDevice::destroy(nfc_device *device) {
-    nfc_close(device);
+  Device::PollOptions::PollOptions()
+    : iso14443(true), felica(false), system_code(0xffff), request_code(0x01), felica_baud_rate(NBR_212)
+    , identify(false), provision(false)
+  {
   }
 
 
-  Device::Device(RawContext context_, RawDevice device_)
-    : context(context_), device(device_)
+  Device::Device(RawPool pool_, RawSlot slot_)
+    : pool(pool_), slot(slot_.get() ? slot_ : RawSlot(new Slot())), generation(0), id(NextId()), command_job(0)
+    , dep_frame_size(DepTransfer::frame_size(0)), has_target(false), polling(false)
   {
-    // Consider all devices initiator.
-    if (!set_as_initiator()) {
-      close();
-    }
+    generation = slot.get()->generation;
+  }
+
+
+  Device::~Device() {
+    close();
   }
 
 
   bool
   Device::close() {
-    if (!device.dismiss()) {
+    stop_polling();
+    if (!slot.get()->device.get()) {
       return false;
     }
-    context = NULL;
+    // Do not leave a running job waiting on a device that is going away.
+    abort_command();
+    pool.get()->release(slot);
+    slot = RawSlot(new Slot());
     return true;
   }
 
 
   bool
   Device::set_idle() {
-    nfc_device *device = this->device.get();
-    return device && !nfc_idle(device);
+    Command command(*this);
+    nfc_device *device = command.device();
+    if (!device) {
+      return false;
+    }
+    return !command.check(nfc_idle(device));
+  }
+
+
+  bool
+  Device::abort(napi_env env) {
+    bool canceled = jobs.cancel(env) > 0;
+    return abort_command() || canceled;
+  }
+
+
+  bool
+  Device::abort(napi_env env, uint32_t job) {
+    return jobs.cancel(env, job) || abort_command(job);
+  }
+
+
+  bool
+  Device::abort_command(uint32_t job) {
+    RawSlot slot(this->slot);
+    Slot &raw = *slot.get();
+    // Only abort when a command is actually in progress as some drivers would abort
+    // the next command otherwise.  The command can't finish while we hold state_lock.
+    RdLock lk(raw.state_lock);
+    nfc_device *device = raw.device.get();
+    // Other Devices may share the handle, leave their commands alone.
+    return device && raw.busy && raw.owner == id && (!job || job == command_job) && !nfc_abort_command(device);
+  }
+
+
+  bool
+  Device::is_open() const {
+    return slot.get()->device.get();
   }
 
 
   std::string
   Device::name() {
-    nfc_device *device = this->device.get();
-    return device ? nfc_device_get_name(device) : "";
+    Slot &raw = *slot.get();
+    RdLock lk(raw.state_lock);
+    return raw.name;
   }
 
 
   std::string
   Device::connstring() {
-    nfc_device *device = this->device.get();
-    return device ? nfc_device_get_connstring(device) : "";
+    return slot.get()->connstring;
+  }
+
+
+  Capabilities
+  Device::capabilities() {
+    RawSlot slot(this->slot);
+    Slot &raw = *slot.get();
+    // Reopening the reader probes it again.
+    RdLock lk(raw.state_lock);
+    return raw.capabilities;
   }
 
 
   bool
   Device::set_as_initiator() {
-    nfc_device *device = this->device.get();
-    return device && !nfc_initiator_init(device);
+    Command command(*this);
+    nfc_device *device = command.device();
+    if (!device) {
+      return false;
+    }
+    return !command.check(nfc_initiator_init(device));
+  }
+
+
+  int
+  Device::set_property(nfc_property property, int value) {
+    Command command(*this);
+    nfc_device *device = command.device();
+    if (!device) {
+      return NFC_EIO;
+    }
+    int result = command.check(write_property(device, property, value));
+    if (result >= 0) {
+      properties.set(property, value);
+    }
+    return result;
+  }
+
+
+  bool
+  Device::get_property(nfc_property property, int &value) const {
+    return properties.get(property, value);
+  }
+
+
+  int
+  Device::apply_preset(const PropertySet::Preset &preset) {
+    Command command(*this);
+    nfc_device *device = command.device();
+    if (!device) {
+      return NFC_EIO;
+    }
+    PropertySet::values_t previous = properties.values();
+    std::string previous_preset = properties.preset();
+    PropertySet::values_t values = previous;
+    for (size_t i = 0; i < preset.count; ++i) {
+      const PropertySet::Setting &setting = preset.settings[i];
+      int result = command.check(write_property(device, setting.property, setting.value));
+      if (result < 0) {
+        // Roll back, so the device stays in its last known configuration.  Properties which were
+        // not tracked before go back to their defaults.
+        for (PropertySet::values_t::const_iterator it = previous.begin(); it != previous.end(); ++it) {
+          write_property(device, it->first, it->second);
+        }
+        const PropertySet::values_t defaults = PropertySet::defaults();
+        for (size_t k = 0; k <= i; ++k) {
+          const nfc_property property = preset.settings[k].property;
+          if (!previous.count(property) && defaults.count(property)) {
+            write_property(device, property, defaults.find(property)->second);
+          }
+        }
+        properties.assign(previous, previous_preset);
+        return result;
+      }
+      values[setting.property] = setting.value;
+    }
+    properties.assign(values, preset.name);
+    return NFC_SUCCESS;
+  }
+
+
+  int
+  Device::restore_properties() {
+    Command command(*this);
+    nfc_device *device = command.device();
+    if (!device) {
+      return NFC_EIO;
+    }
+    return command.check(write_properties(device));
+  }
+
+
+  int
+  Device::write_properties(nfc_device *device, bool reset) {
+    PropertySet::values_t values = properties.values();
+    if (reset) {
+      // Properties we don't track go back to the defaults.
+      PropertySet::values_t defaults = PropertySet::defaults();
+      values.insert(defaults.begin(), defaults.end());
+    }
+    int result = NFC_SUCCESS;
+    for (PropertySet::values_t::const_iterator it = values.begin(); it != values.end(); ++it) {
+      int status = write_property(device, it->first, it->second);
+      if (status < 0 && result >= 0) {
+        // Keep going, but report the first failure.
+        result = status;
+      }
+    }
+    return result;
+  }
+
+
+  bool
+  Device::start_polling(napi_env env, const PollOptions &targets, const PollScheduler::Options &options,
+                        size_t high_water_mark, napi_value listener, const Provisioner::Template *tpl) {
+    if (polling || !is_open()) {
+      return false;
+    }
+    poll_options = targets;
+    if (!events.open(env, listener, high_water_mark)) {
+      return false;
+    }
+    scheduler.configure(options);
+    if (tpl) {
+      // Only now, a start which fails leaves the serials of the running template alone.
+      provisioner.configure(*tpl);
+    }
+    poll_stop.reset();
+    if (uv_thread_create(&poll_thread, RunPolling, this)) {
+      events.close();
+      return false;
+    }
+    polling = true;
+    return true;
+  }
+
+
+  bool
+  Device::stop_polling() {
+    if (!polling) {
+      return false;
+    }
+    poll_stop.set();
+    // Don't wait for the RF operation in progress, nor for the consumer to catch up, but leave
+    // commands of other jobs alone.
+    abort_command(Jobs::polling_loop);
+    events.interrupt();
+    uv_thread_join(&poll_thread);
+    events.close();
+    polling = false;
+    return true;
+  }
+
+
+  void
+  Device::pause_events() {
+    events.pause();
+  }
+
+
+  void
+  Device::resume_events() {
+    events.resume();
+  }
+
+
+  void
+  Device::RunPolling(void *arg) {
+    Jobs::enter(Jobs::polling_loop);
+    static_cast<Device *>(arg)->run_polling();
+  }
+
+
+  void
+  Device::run_polling() {
+    const uint64_t ms = 1000000;
+    unsigned gap = 0;
+    bool idle = false;
+    while (wait_for_consumer()) {
+      if (idle) {
+        // Wake up from idle mode, which may have reset the device configuration.
+        set_as_initiator();
+        restore_properties();
+        idle = false;
+      }
+
+      nfc_target target;
+      Script::Results results;
+      const char *card_type = NULL;
+      Provisioner::Result provisioning;
+      uint64_t start = uv_hrtime();
+      int result = poll_target(target, poll_options, results, card_type, &provisioning);
+      uint64_t end = uv_hrtime();
+      if (poll_stop.is_set()) {
+        break;
+      }
+      if (result < 0 && result != NFC_ETIMEOUT) {
+        emit("error", NULL, result);
+      }
+      unsigned interval = scheduler.record_poll(end / ms, gap, unsigned((end - start) / ms), result > 0);
+
+      if (result > 0) {
+        emit("target", &target, NFC_SUCCESS, results, card_type, provisioning);
+        // Keep the target selected until it leaves, polling would disturb its session.
+        interval = scheduler.settings().min_interval;
+        while (!poll_stop.wait(interval)) {
+          scheduler.record_sleep(interval);
+          start = uv_hrtime();
+          int present = is_present(target);
+          scheduler.record_busy(unsigned((uv_hrtime() - start) / ms));
+          if (present < 0) {
+            break;
+          }
+        }
+        if (poll_stop.is_set()) {
+          break;
+        }
+        emit("removed", &target, NFC_SUCCESS, Script::Results(), card_type);
+        interval = scheduler.record_removal(uv_hrtime() / ms);
+      }
+      else if (scheduler.should_idle(interval)) {
+        // The field stays empty, so switch it off until the next burst.
+        idle = set_idle();
+      }
+
+      gap = interval;
+      if (poll_stop.wait(interval)) {
+        break;
+      }
+      scheduler.record_sleep(interval);
+    }
+  }
+
+
+  bool
+  Device::wait_for_consumer() {
+    // Poll no faster than the events are consumed, rather than queueing them up.
+    const unsigned interval = scheduler.settings().max_interval;
+    while (events.full()) {
+      uint64_t start = uv_hrtime();
+      events.wait_for_space(interval);
+      scheduler.record_sleep(unsigned((uv_hrtime() - start) / 1000000));
+      if (poll_stop.is_set()) {
+        break;
+      }
+    }
+    return !poll_stop.is_set();
+  }
+
+
+  void
+  Device::emit(const char type[], const nfc_target *target, int error, const Script::Results &results,
+               const char *card_type, const Provisioner::Result &provisioning) {
+    TagEvent event;
+    event.type = type;
+    if (target) {
+      event.target = *target;
+    }
+    event.error = error;
+    event.results = results;
+    event.card_type = card_type;
+    event.provisioning = provisioning;
+    events.push(event);
+  }
+
+
+  int
+  Device::write_property(nfc_device *device, nfc_property property, int value) {
+    const PropertySet::Info *info = PropertySet::find(property);
+    if (info && info->is_bool) {
+      return nfc_device_set_property_bool(device, property, value != 0);
+    }
+    return nfc_device_set_property_int(device, property, value);
+  }
+
+
+  int
+  Device::poll_target(nfc_target &target, const PollOptions &options, Script::Results &results,
+                      const char *&card_type, Provisioner::Result *provisioning) {
+    Command command(*this);
+    nfc_device *device = command.device();
+    if (!device) {
+      return NFC_EIO;
+    }
+    // Modulations the reader does not support would fail the poll, or cost a timeout each.
+    const Capabilities &capabilities = command.capabilities();
+    bool supported = false;
+    int result = 0;
+    if (options.iso14443) {
+      const nfc_modulation modulations[] = {
+        {.nmt = NMT_ISO14443A, .nbr = NBR_106},
+        {.nmt = NMT_ISO14443B, .nbr = NBR_106}
+      };
+      const std::vector<nfc_modulation> polled =
+        capabilities.filter(modulations, sizeof(modulations) / sizeof(modulations[0]));
+      const uint8_t poll_period = 1;  // polling period (in units of 150 ms)
+      const uint8_t poll_count = 1;  // number of polling attempts
+      if (!polled.empty()) {
+        supported = true;
+        result = command.check_poll(nfc_initiator_poll_target(device, polled.data(), polled.size(),
+                                                              poll_count, poll_period, &target));
+      }
+    }
+    const nfc_modulation felica = {.nmt = NMT_FELICA, .nbr = options.felica_baud_rate};
+    if (options.felica && capabilities.supports(felica)) {
+      supported = true;
+      if ((!result || result == NFC_ETIMEOUT) && !Deadline::current().expired()) {
+        // nfc_initiator_poll_target uses the wildcard system code, so send our own polling request.
+        // libnfc's select takes no timeout, a single attempt keeps it within the poll's deadline.
+        const uint8_t polling[] = {
+          0x00, uint8_t(options.system_code >> 8), uint8_t(options.system_code), options.request_code,
+          0x00  // one time slot
+        };
+        FiniteSelect finite(command);
+        result = command.check_poll(nfc_initiator_select_passive_target(device, felica, polling, sizeof(polling),
+                                                                        &target));
+      }
+    }
+    if (!supported && (options.iso14443 || options.felica)) {
+      return NFC_EDEVNOTSUPP;
+    }
+    if (result > 0) {
+      // A new selection ends any DESFire session.
+      desfire.reset();
+      last_target = target;
+      has_target = true;
+      card_type = options.identify ? identify(command, target) : NULL;
+      for (std::vector<Script>::const_iterator it = options.scripts.begin(); it != options.scripts.end(); ++it) {
+        if (it->matches(target)) {
+          // Still holding the device, so the card is read before it can leave.
+          Exchange exchange(command);
+          it->run(exchange, results);
+          break;
+        }
+      }
+      if (options.provision && provisioning && Provisioner::is_type2(target)) {
+        Exchange exchange(command);
+        provisioner.run(exchange, target, *provisioning);
+      }
+    }
+    return result < 0 ? result : (result ? 1 : 0);
+  }
+
+
+  const char *
+  Device::identify(Command &command, const nfc_target &target) {
+    CardClassifier::Result type = CardClassifier::classify(target);
+    if (!type.probe) {
+      return type.type;
+    }
+    std::vector<uint8_t> transmit(1, CardClassifier::get_version);
+    std::vector<uint8_t> receive(16);
+    if (transceive(command, transmit, receive) >= 0) {
+      const char *version = CardClassifier::identify(receive);
+      // DESFire answers in three frames.  Fetch the other two, so the next command does not
+      // meet an open chain, or start over with a new selection if that fails.
+      std::vector<uint8_t> more(receive);
+      const std::vector<uint8_t> additional_frame(1, uint8_t(Desfire::ADDITIONAL_FRAME));
+      for (int i = 0; i < 2 && !more.empty() && more[0] == Desfire::ADDITIONAL_FRAME; ++i) {
+        more.resize(32);
+        if (transceive(command, additional_frame, more) < 0) {
+          more.clear();
+        }
+      }
+      nfc_device *device = command.device();
+      if (device && (more.empty() || more[0] != Desfire::OPERATION_OK)) {
+        nfc_target selected;
+        nfc_initiator_deselect_target(device);
+        reselect(command, target, selected);
+      }
+      return version ? version : type.type;
+    }
+    if (!(target.nti.nai.btSak & 0x20)) {
+      // Type 2 cards without GET_VERSION (Ultralight, Ultralight C) halt on unknown commands.
+      nfc_target selected;
+      reselect(command, target, selected);
+    }
+    return type.type;
+  }
+
+
+  // Whether two activations are of the same card.
+  static bool
+  SameTarget(const nfc_target &a, const nfc_target &b) {
+    if (a.nm.nmt != b.nm.nmt) {
+      return false;
+    }
+    switch (a.nm.nmt) {
+    case NMT_ISO14443A:
+      return a.nti.nai.szUidLen == b.nti.nai.szUidLen &&
+             std::equal(a.nti.nai.abtUid, a.nti.nai.abtUid + a.nti.nai.szUidLen, b.nti.nai.abtUid);
+    case NMT_FELICA:
+      return std::equal(a.nti.nfi.abtId, a.nti.nfi.abtId + 8, b.nti.nfi.abtId);
+    case NMT_ISO14443B:
+      return std::equal(a.nti.nbi.abtPupi, a.nti.nbi.abtPupi + 4, b.nti.nbi.abtPupi);
+    case NMT_ISO14443BI:
+      return std::equal(a.nti.nii.abtDIV, a.nti.nii.abtDIV + 4, b.nti.nii.abtDIV);
+    case NMT_ISO14443B2SR:
+      return std::equal(a.nti.nsi.abtUID, a.nti.nsi.abtUID + 8, b.nti.nsi.abtUID);
+    case NMT_ISO14443B2CT:
+      return std::equal(a.nti.nci.abtUID, a.nti.nci.abtUID + 4, b.nti.nci.abtUID);
+    case NMT_JEWEL:
+      return std::equal(a.nti.nji.btId, a.nti.nji.btId + 4, b.nti.nji.btId);
+    case NMT_DEP:
+      break;
+    }
+    return false;
   }
 
 
   int
-  Device::poll_target(nfc_target &target) {
-    nfc_device *device = this->device.get();
+  Device::reselect(Command &command, const nfc_target &target, nfc_target &selected) {
+    nfc_device *device = command.device();
     if (!device) {
       return NFC_EIO;
     }
-    const nfc_modulation modulations[] = {
-      {.nmt = NMT_ISO14443A, .nbr = NBR_106},
-      {.nmt = NMT_ISO14443B, .nbr = NBR_106}
-    };
-    const size_t modulations_count = sizeof(modulations) / sizeof(modulations[0]);
-    const uint8_t poll_period = 1;  // polling period (in units of 150 ms)
-    const uint8_t poll_count = 1;  // number of polling attempts
-    int result = nfc_initiator_poll_target(device, modulations, modulations_count,
-                                           poll_count, poll_period, &target);
+    std::vector<uint8_t> init;
+    nfc_modulation modulation = target.nm;
+    switch (target.nm.nmt) {
+    case NMT_ISO14443A:
+      // libnfc adds the cascade tags of double and triple size UIDs.
+      init.assign(target.nti.nai.abtUid, target.nti.nai.abtUid + target.nti.nai.szUidLen);
+      // Without PPS the card stays at 106 kbps, whatever rate the driver reports back.
+      modulation.nbr = NBR_106;
+      break;
+    case NMT_FELICA: {
+      // Poll for the system code the card reported, if it did, without asking for it again.
+      const nfc_felica_info &info = target.nti.nfi;
+      const uint16_t system_code = info.szLen >= 20 ? info.abtSysCode[0] << 8 | info.abtSysCode[1] : 0xffff;
+      const uint8_t polling[] = {0x00, uint8_t(system_code >> 8), uint8_t(system_code), 0x00, 0x00};
+      init.assign(polling, polling + sizeof(polling));
+      break;
+    }
+    case NMT_ISO14443B:
+      init.push_back(0x00);  // any application family
+      break;
+    case NMT_DEP:
+      return NFC_EINVARG;
+    default:
+      break;
+    }
+    // One attempt: a card which has left must not block the device.
+    FiniteSelect finite(command);
+    int result = command.check(nfc_initiator_select_passive_target(device, modulation, init.empty() ? NULL : init.data(),
+                                                                   init.size(), &selected));
+    if (result > 0 && !SameTarget(target, selected)) {
+      // Another card answered.
+      result = 0;
+    }
     return result < 0 ? result : (result ? 1 : 0);
   }
 
 
+  int
+  Device::reselect(const nfc_target &target, nfc_target &selected) {
+    Command command(*this);
+    // A new selection ends any DESFire session.
+    desfire.reset();
+    int result = reselect(command, target, selected);
+    if (result > 0) {
+      last_target = selected;
+      has_target = true;
+    }
+    return result;
+  }
+
+
+  int
+  Device::recover(Command &command, RetryPolicy::Recovery recovery) {
+    nfc_device *device = command.device();
+    if (!device) {
+      return NFC_EIO;
+    }
+    // Recovery costs a selection at least, which the caller has no time left for.
+    if (Deadline::current().expired()) {
+      return NFC_ETIMEOUT;
+    }
+    if (recovery == RetryPolicy::reset_field) {
+      command.check(nfc_device_set_property_bool(device, NP_ACTIVATE_FIELD, false));
+      command.check(nfc_device_set_property_bool(device, NP_ACTIVATE_FIELD, true));
+    }
+    else {
+      nfc_initiator_deselect_target(device);
+    }
+    desfire.reset();
+    if (Deadline::current().expired()) {
+      return NFC_ETIMEOUT;
+    }
+    // A single attempt, see reselect.
+    nfc_target selected;
+    int result = reselect(command, last_target, selected);
+    if (result > 0) {
+      last_target = selected;
+    }
+    return result;
+  }
+
+
   int
   Device::is_present(const nfc_target &target) {
-    nfc_device *device = this->device.get();
+    Command command(*this);
+    nfc_device *device = command.device();
     if (!device) {
       return NFC_EIO;
     }
-    return nfc_initiator_target_is_present(device, &target);
+    return command.check(nfc_initiator_target_is_present(device, &target));
+  }
+
+
+  int
+  Device::transceive(const std::vector<uint8_t> &transmit, std::vector<uint8_t> &receive, unsigned &retries) {
+    const RetryPolicy::Options policy = retry.settings();
+    const size_t capacity = receive.size();
+    const uint64_t start = uv_hrtime();
+    Command command(*this);
+    retries = 0;
+    int result;
+    for (;;) {
+      receive.resize(capacity);
+      result = transceive(command, transmit, receive);
+      const unsigned elapsed = unsigned((uv_hrtime() - start) / 1000000);
+      if (result >= 0 || !RetryPolicy::should_retry(policy, result, retries + 1, elapsed) ||
+          Deadline::current().expired()) {
+        break;
+      }
+      ++retries;
+      if (policy.recovery != RetryPolicy::no_recovery && has_target && recover(command, policy.recovery) <= 0) {
+        // The card has left or cannot be selected, another attempt would fail too.
+        break;
+      }
+    }
+    retry.record(retries, result);
+    return result;
   }
 
 
   int
-  Device::transceive(const std::vector<uint8_t> &transmit, std::vector<uint8_t> &receive) {
-    const int timeout = -1;  // timeout in ms (-1 is default)
-    nfc_device *device = this->device.get();
+  Device::transceive(Command &command, const std::vector<uint8_t> &transmit, std::vector<uint8_t> &receive) {
+    // The caller's remaining budget becomes the timeout, -1 is the libnfc default.
+    const Deadline deadline = Deadline::current();
+    if (deadline.expired()) {
+      return NFC_ETIMEOUT;
+    }
+    const int timeout = deadline.timeout(-1);
+    nfc_device *device = command.device();
     if (!device) {
       return NFC_EIO;
     }
-    int result = nfc_initiator_transceive_bytes(device, transmit.data(), transmit.size(),
-                                                receive.data(), receive.size(), timeout);
+    uint8_t idm[8];
+    if (Felica::is_write(transmit, idm)) {
+      // Whether or not the write succeeds, cached blocks of the card may be stale now.
+      command.cache().invalidate(ContentCache::Uid(idm, idm + 8));
+    }
+    int result = command.check(nfc_initiator_transceive_bytes(device, transmit.data(), transmit.size(),
+                                                              receive.data(), receive.size(), timeout));
     receive.resize(result < 0 ? 0 : size_t(result));
     return result;
   }
 
 
-  v8::Handle<v8::Value>
-  Device::Construct(RawContext context, RawDevice device) {
-    return ObjectWrap::Construct(context, device);
+  napi_value
+  Device::Construct(napi_env env, RawPool pool, RawSlot slot) {
+    return ObjectWrap::Construct(env, pool, slot);
   }
 
 
   Device *
-  Device::Create(const v8::Arguments &args) {
-    return ObjectWrap::Create<RawContext, RawDevice>(args);
+  Device::Create(const Arguments &args) {
+    return ObjectWrap::Create<RawPool, RawSlot>(args);
   }
 
 
-  v8::Persistent<v8::Function> Device::constructor;
+  const napi_type_tag Device::type_tag = {0x2f95c1e07a6b4d83ULL, 0xb3480de1c92a5f17ULL};
 
 
   void
-  Device::Initialize(v8::Handle<v8::Object> exports) {
-    v8::HandleScope scope;
-    v8::Local<v8::ObjectTemplate> proto;
-    v8::Local<v8::FunctionTemplate> tpl;
-    Prepare(tpl, proto);
+  Device::Initialize(napi_env env, napi_value exports) {
+    Properties properties;
+
+    properties.accessor<GetName>("name");
+    properties.accessor<GetConnstring>("connstring");
+    properties.accessor<GetCapabilities>("capabilities");
+    properties.accessor<GetPreset>("preset");
+    properties.accessor<GetProperties>("properties");
+
+    properties.method<Close>("close");
+    properties.method<SetIdle>("setIdle");
+    properties.method<Abort>("abort");
+
+    properties.method<GetProperty>("getProperty");
+    properties.method<SetProperty>("setProperty");
+    properties.method<ApplyPreset>("applyPreset");
+    properties.method<RestoreProperties>("restoreProperties");
+
+    properties.method<PollTarget>("pollTarget");
+    properties.method<Transceive>("transceive");
+    properties.method<TransceiveBits>("transceiveBits");
+    properties.method<IsPresent>("isPresent");
+    properties.method<Reselect>("reselect");
+
+    properties.method<DesfireAuthenticate>("desfireAuthenticate");
+    properties.method<DesfireSelectApplication>("desfireSelectApplication");
+    properties.method<DesfireGetFileIds>("desfireGetFileIds");
+    properties.method<DesfireReadData>("desfireReadData");
+
+    properties.method<FelicaRead>("felicaRead");
+    properties.method<DepConnect>("depConnect");
+    properties.method<DepSend>("depSend");
+    properties.method<DepReceive>("depReceive");
+    properties.method<DepClose>("depClose");
+    properties.method<DepServe>("depServe");
+    properties.method<ConfigureCache>("configureCache");
+    properties.method<ClearCache>("clearCache");
+    properties.accessor<GetCacheStats>("cacheStats");
+    properties.method<ConfigureRetry>("configureRetry");
+    properties.accessor<GetRetryStats>("retryStats");
+    properties.accessor<GetProvisioningStats>("provisioningStats");
+    properties.method<ConfigureErrorStats>("configureErrorStats");
+    properties.accessor<GetErrorStats>("errorStats");
+
+    properties.method<StartPolling>("startPolling");
+    properties.method<StopPolling>("stopPolling");
+    properties.method<PauseEvents>("pauseEvents");
+    properties.method<ResumeEvents>("resumeEvents");
+    properties.accessor<GetPollingStats>("pollingStats");
+    properties.accessor<GetDeadlineMisses>("deadlineMisses");
+    properties.method<Serve>("serve");
+
+    Install(env, "Device", exports, properties);
+  }
 
-    proto->SetAccessor(v8::String::NewSymbol("name"), GetName);
-    proto->SetAccessor(v8::String::NewSymbol("connstring"), GetConnstring);
 
-    proto->Set(v8::String::NewSymbol("close"), v8::FunctionTemplate::New(Close)->GetFunction());
-    proto->Set(v8::String::NewSymbol("setIdle"), v8::FunctionTemplate::New(SetIdle)->GetFunction());
+  napi_value
+  Device::CheckNew(napi_env env, napi_value instance) {
+    if (!Unwrap(env, instance).is_open()) {
+      return ThrowError(env, "unable to open device");
+    }
+    return instance;
+  }
 
-    proto->Set(v8::String::NewSymbol("pollTarget"), v8::FunctionTemplate::New(PollTarget)->GetFunction());
-    proto->Set(v8::String::NewSymbol("transceive"), v8::FunctionTemplate::New(Transceive)->GetFunction());
-    proto->Set(v8::String::NewSymbol("isPresent"), v8::FunctionTemplate::New(IsPresent)->GetFunction());
 
-    Install("Device", exports, tpl);
+  napi_value
+  Device::GetName(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).name());
   }
 
 
-  v8::Handle<v8::Value>
-  Device::CheckNew(v8::Handle<v8::Value> instance) {
-    if (!*Unwrap(instance).device) {
-      return v8::ThrowException(v8::Exception::Error(v8::String::New("unable to open device")));
-    }
-    return instance;
+  napi_value
+  Device::GetConnstring(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).connstring());
   }
 
 
-  v8::Handle<v8::Value>
-  Device::GetName(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(info.This()).name()));
+  napi_value
+  Device::GetCapabilities(const Arguments &args) {
+    napi_env env = args.Env();
+    Capabilities capabilities = Unwrap(env, args.This()).capabilities();
+    if (!capabilities.is_known()) {
+      return toJS(env, null);
+    }
+    // Modulation names and rates in kbps, like targets report them.
+    std::map<std::string, std::vector<uint32_t> > result;
+    const Capabilities::Rates &rates = capabilities.baud_rates();
+    for (Capabilities::Rates::const_iterator it = rates.begin(); it != rates.end(); ++it) {
+      std::vector<uint32_t> &kbps = result[Target::modulation_type(it->first)];
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        kbps.push_back(Target::baud_rate(it->second[i]));
+      }
+    }
+    return toJS(env, result);
   }
 
 
-  v8::Handle<v8::Value>
-  Device::GetConnstring(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(info.This()).connstring()));
+  napi_value
+  Device::Close(const Arguments &args) {
+    Device &instance = Unwrap(args.Env(), args.This());
+    // Queued jobs would only fail on the closed device.
+    instance.jobs.cancel(args.Env());
+    return toJS(args.Env(), instance.close());
   }
 
 
-  v8::Handle<v8::Value>
-  Device::Close(const v8::Arguments &args) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(args.This()).close()));
+  napi_value
+  Device::SetIdle(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).set_idle());
   }
 
 
-  v8::Handle<v8::Value>
-  Device::SetIdle(const v8::Arguments &args) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(args.This()).set_idle()));
+  napi_value
+  Device::Abort(const Arguments &args) {
+    Device &instance = Unwrap(args.Env(), args.This());
+    if (!IsNumber(args.Env(), args[0])) {
+      return toJS(args.Env(), instance.abort(args.Env()));
+    }
+    // Only the given job, as returned in the "job" property of the promise.
+    return toJS(args.Env(), instance.abort(args.Env(), fromJS<uint32_t>(args.Env(), args[0])));
   }
 
 
-  struct Device::PollTargetData {
-    bool error;
-    bool got_target;
-    nfc_target target;
-  };
+  napi_value
+  Device::GetPreset(const Arguments &args) {
+    std::string preset = Unwrap(args.Env(), args.This()).properties.preset();
+    return preset.empty() ? toJS(args.Env(), null) : toJS(args.Env(), preset);
+  }
 
 
-  v8::Handle<v8::Value>
-  Device::PollTarget(const v8::Arguments &args) {
-    return AsyncRunner<Device, PollTargetData>::Schedule
-      (RunPollTarget, AfterPollTarget, args.This(), args[0]);
+  napi_value
+  Device::GetProperties(const Arguments &args) {
+    napi_env env = args.Env();
+    PropertySet::values_t values = Unwrap(env, args.This()).properties.values();
+    napi_value result;
+    napi_create_object(env, &result);
+    for (PropertySet::values_t::const_iterator it = values.begin(); it != values.end(); ++it) {
+      const PropertySet::Info *info = PropertySet::find(it->first);
+      if (info) {
+        napi_set_named_property(env, result, info->name, PropertyToJS(env, *info, it->second));
+      }
+    }
+    return result;
   }
 
 
-  void
-  Device::RunPollTarget(Device &instance, PollTargetData &data) {
-    int result = instance.poll_target(data.target);
-    data.got_target = result > 0;
-    data.error = result < 0;
+  napi_value
+  Device::PropertyToJS(napi_env env, const PropertySet::Info &info, int value) {
+    return info.is_bool ? toJS(env, value != 0) : toJS(env, value);
   }
 
 
-  v8::Handle<v8::Value>
-  Device::AfterPollTarget(v8::Handle<v8::Object> instance, PollTargetData &data) {
-    v8::HandleScope scope;
-    if (!data.error) {
-      return scope.Close(data.got_target ? Target::Construct(data.target) : toV8(null));
+  napi_value
+  Device::GetProperty(const Arguments &args) {
+    napi_env env = args.Env();
+    const PropertySet::Info *info = PropertySet::find(fromJS<std::string>(env, args[0]));
+    if (!info) {
+      return ThrowTypeError(env, "unknown property");
     }
-    // no tags in field; 
-    return scope.Close(toV8(null)); //, v8::String::New("unable to poll for targets"));
+    int value;
+    if (!Unwrap(env, args.This()).get_property(info->property, value)) {
+      // Not set through this binding, so the value is unknown.
+      napi_value undefined;
+      napi_get_undefined(env, &undefined);
+      return undefined;
+    }
+    return PropertyToJS(env, *info, value);
   }
 
 
-  struct Device::TransceiveData {
-    std::vector<uint8_t> transmit;
-    std::vector<uint8_t> receive;
-    bool error;
+  struct Device::SetPropertyData {
+    nfc_property property;
+    int value;
+    int result;
 
-    TransceiveData(v8::Handle<v8::Value> transmit_, v8::Handle<v8::Value> receive_capacity_)
-      : transmit(fromV8<std::vector<uint8_t> >(transmit_)), receive(fromV8<size_t>(receive_capacity_)) {}
+    SetPropertyData(napi_env env, const PropertySet::Info &info, napi_value value_)
+      : property(info.property), value(info.is_bool ? fromJS<bool>(env, value_) : fromJS<int>(env, value_)) {}
   };
 
 
-  v8::Handle<v8::Value>
-  Device::Transceive(const v8::Arguments &args) {
-    return AsyncRunner<Device, TransceiveData>::Schedule
-      (RunTransceive, AfterTransceive, args.This(), args[2], TransceiveData(args[0], args[1]));
+  napi_value
+  Device::SetProperty(const Arguments &args) {
+    napi_env env = args.Env();
+    const PropertySet::Info *info = PropertySet::find(fromJS<std::string>(env, args[0]));
+    if (!info) {
+      return ThrowTypeError(env, "unknown property");
+    }
+    return AsyncRunner<Device, SetPropertyData>::Schedule
+      ("setProperty", Deadline::FromOptions(env, args[2]), RunSetProperty, AfterSetProperty, env, args.This(),
+       SetPropertyData(env, *info, args[1]));
   }
 
 
   void
-  Device::RunTransceive(Device &instance, TransceiveData &data) {
-    data.error = instance.transceive(data.transmit, data.receive) < 0;
+  Device::RunSetProperty(Device &instance, SetPropertyData &data) {
+    data.result = instance.set_property(data.property, data.value);
   }
 
 
-  v8::Handle<v8::Value>
-  Device::AfterTransceive(v8::Handle<v8::Object> instance, TransceiveData &data) {
-    v8::HandleScope scope;
-    if (!data.error) {
-      return scope.Close(toV8(data.receive));
+  napi_value
+  Device::AfterSetProperty(napi_env env, napi_value instance, SetPropertyData &data) {
+    if (data.result < 0) {
+      return ThrowNfcError(env, "setProperty", data.result, "unable to set property");
     }
-    return v8::ThrowException(v8::Exception::Error(v8::String::New("unable to transceive data")));
+    return toJS(env, true);
   }
 
 
-  struct Device::GetIsPresentData {
-    nfc_target target;
-    bool is_present;
+  struct Device::ApplyPresetData {
+    const PropertySet::Preset *preset;
+    int result;
 
-    GetIsPresentData(v8::Handle<v8::Value> target_)
-      : target(Target::Unwrap(target_).target) {}
+    ApplyPresetData(const PropertySet::Preset *preset_ = NULL)
+      : preset(preset_) {}
   };
 
 
-  v8::Handle<v8::Value>
-  Device::IsPresent(const v8::Arguments &args) {
-    return AsyncRunner<Device, GetIsPresentData>::Schedule
-      (RunGetIsPresent, AfterGetIsPresent, args.This(), args[1], args[0]);
+  napi_value
+  Device::ApplyPreset(const Arguments &args) {
+    napi_env env = args.Env();
+    const PropertySet::Preset *preset = PropertySet::find_preset(fromJS<std::string>(env, args[0]));
+    if (!preset) {
+      return ThrowTypeError(env, "unknown preset");
+    }
+    return AsyncRunner<Device, ApplyPresetData>::Schedule
+      ("applyPreset", Deadline::FromOptions(env, args[1]), RunApplyPreset, AfterApplyPreset, env, args.This(),
+       ApplyPresetData(preset));
+  }
+
+
+  void
+  Device::RunApplyPreset(Device &instance, ApplyPresetData &data) {
+    data.result = instance.apply_preset(*data.preset);
+  }
+
+
+  napi_value
+  Device::AfterApplyPreset(napi_env env, napi_value instance, ApplyPresetData &data) {
+    if (data.result < 0) {
+      return ThrowNfcError(env, "applyPreset", data.result, "unable to apply preset");
+    }
+    return toJS(env, true);
+  }
+
+
+  struct Device::RestorePropertiesData {
+    int result;
+  };
+
+
+  napi_value
+  Device::RestoreProperties(const Arguments &args) {
+    return AsyncRunner<Device, RestorePropertiesData>::Schedule
+      ("restoreProperties", Deadline::FromOptions(args.Env(), args[0]), RunRestoreProperties, AfterRestoreProperties,
+       args.Env(), args.This());
+  }
+
+
+  void
+  Device::RunRestoreProperties(Device &instance, RestorePropertiesData &data) {
+    data.result = instance.restore_properties();
+  }
+
+
+  napi_value
+  Device::AfterRestoreProperties(napi_env env, napi_value instance, RestorePropertiesData &data) {
+    if (data.result < 0) {
+      return ThrowNfcError(env, "restoreProperties", data.result, "unable to restore properties");
+    }
+    return toJS(env, true);
+  }
+
+
+  napi_value
+  Device::StartPolling(const Arguments &args) {
+    napi_env env = args.Env();
+    if (!IsFunction(env, args[1])) {
+      return ThrowTypeError(env, "expected listener function");
+    }
+    PollScheduler::Options defaults;
+    PollScheduler::Options options;
+    options.min_interval = GetOption(env, args[0], "minInterval", defaults.min_interval);
+    options.max_interval = GetOption(env, args[0], "maxInterval", defaults.max_interval);
+    options.backoff = GetOption(env, args[0], "backoff", defaults.backoff);
+    options.burst = GetOption(env, args[0], "burst", defaults.burst);
+    options.idle_after = GetOption(env, args[0], "idleAfter", defaults.idle_after);
+    size_t high_water_mark = GetOption<uint32_t>(env, args[0], "highWaterMark", 64);
+    Device &instance = Unwrap(env, args.This());
+    PollOptions targets = GetPollOptions(env, args[0]);
+    napi_value provision = GetOption(env, args[0], "provision");
+    Provisioner::Template tpl;
+    if (provision) {
+      tpl = fromJS<Provisioner::Template>(env, provision);
+      if (!tpl.valid()) {
+        return ThrowTypeError(env, "invalid provisioning template");
+      }
+      targets.provision = true;
+    }
+    return toJS(env, instance.start_polling(env, targets, options, high_water_mark, args[1],
+                                            provision ? &tpl : NULL));
+  }
+
+
+  napi_value
+  Device::StopPolling(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).stop_polling());
+  }
+
+
+  napi_value
+  Device::PauseEvents(const Arguments &args) {
+    Unwrap(args.Env(), args.This()).pause_events();
+    return toJS(args.Env(), null);
+  }
+
+
+  napi_value
+  Device::ResumeEvents(const Arguments &args) {
+    Unwrap(args.Env(), args.This()).resume_events();
+    return toJS(args.Env(), null);
+  }
+
+
+  napi_value
+  Device::Serve(const Arguments &args) {
+    napi_env env = args.Env();
+    Device &instance = Unwrap(env, args.This());
+    const std::string path = fromJS<std::string>(env, args[0]);
+    if (path.empty()) {
+      return ThrowTypeError(env, "expected socket path");
+    }
+    if (!instance.is_open()) {
+      return ThrowError(env, "device is closed");
+    }
+    Daemon::Options options;
+    options.targets = GetPollOptions(env, args[1]);
+    options.poll_interval = GetOption(env, args[1], "pollInterval", options.poll_interval);
+    options.claim_timeout = GetOption(env, args[1], "claimTimeout", options.claim_timeout);
+    options.max_clients = GetOption(env, args[1], "maxClients", options.max_clients);
+    options.max_requests = GetOption(env, args[1], "maxRequests", options.max_requests);
+    options.mode = GetOption(env, args[1], "mode", options.mode);
+    // The daemon has a handle of its own, so the device stays open when either is closed.
+    RawSlot slot = instance.pool.get()->acquire(instance.connstring());
+    return Daemon::Serve(env, instance.pool, slot, path, options);
+  }
+
+
+  napi_value
+  Device::GetPollingStats(const Arguments &args) {
+    napi_env env = args.Env();
+    Device &device = Unwrap(env, args.This());
+    PollScheduler::Stats stats = device.scheduler.stats();
+    TagQueue::Stats queue = device.events.stats();
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "polls", toJS(env, stats.polls));
+    napi_set_named_property(env, result, "detections", toJS(env, stats.detections));
+    napi_set_named_property(env, result, "interval", toJS(env, stats.interval));
+    napi_set_named_property(env, result, "dutyCycle", toJS(env, stats.duty_cycle()));
+    napi_set_named_property(env, result, "meanLatency", toJS(env, stats.mean_latency()));
+    napi_set_named_property(env, result, "maxLatency", toJS(env, stats.max_latency));
+    napi_set_named_property(env, result, "queued", toJS(env, uint32_t(queue.queued)));
+    napi_set_named_property(env, result, "events", toJS(env, queue.events));
+    napi_set_named_property(env, result, "batches", toJS(env, queue.batches));
+    napi_set_named_property(env, result, "maxBatch", toJS(env, uint32_t(queue.max_batch)));
+    return result;
+  }
+
+
+  napi_value
+  Device::GetDeadlineMisses(const Arguments &args) {
+    napi_env env = args.Env();
+    return toJS(env, Unwrap(env, args.This()).jobs.misses());
+  }
+
+
+  Device::PollOptions
+  Device::GetPollOptions(napi_env env, napi_value options) {
+    PollOptions result;
+    result.iso14443 = GetOption(env, options, "iso14443", result.iso14443);
+    napi_value felica = GetOption(env, options, "felica");
+    result.felica = felica && fromJS<bool>(env, felica);
+    if (result.felica && IsObject(env, felica)) {
+      result.system_code = GetOption(env, felica, "systemCode", result.system_code);
+      result.request_code = GetOption(env, felica, "requestCode", result.request_code);
+      unsigned baud_rate = GetOption(env, felica, "baudRate", 212u);
+      result.felica_baud_rate = baud_rate == 424 ? NBR_424 : NBR_212;
+    }
+    result.identify = GetOption(env, options, "identify", result.identify);
+    napi_value scripts = GetOption(env, options, "scripts");
+    if (scripts) {
+      result.scripts = fromJS<std::vector<Script> >(env, scripts);
+    }
+    return result;
+  }
+
+
+  struct Device::PollTargetData {
+    PollOptions options;
+    int result;
+    nfc_target target;
+    Script::Results results;
+    const char *card_type;
+
+    PollTargetData(const PollOptions &options_ = PollOptions())
+      : options(options_), card_type(NULL) {}
+  };
+
+
+  napi_value
+  Device::PollTarget(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, PollTargetData>::Schedule
+      ("pollTarget", Deadline::FromOptions(env, args[0]), RunPollTarget, AfterPollTarget, env, args.This(),
+       PollTargetData(GetPollOptions(env, args[0])));
+  }
+
+
+  void
+  Device::RunPollTarget(Device &instance, PollTargetData &data) {
+    data.result = instance.poll_target(data.target, data.options, data.results, data.card_type);
+  }
+
+
+  napi_value
+  Device::AfterPollTarget(napi_env env, napi_value instance, PollTargetData &data) {
+    if (data.result > 0) {
+      napi_value target = Target::Construct(env, data.target, data.card_type);
+      if (!data.results.empty()) {
+        napi_set_named_property(env, target, "results", toJS(env, data.results));
+      }
+      return target;
+    }
+    if (!data.result || data.result == NFC_ETIMEOUT) {
+      // no tags in field
+      return toJS(env, null);
+    }
+    if (data.result == NFC_EOPABORTED) {
+      return ThrowNfcError(env, "pollTarget", data.result, "operation was aborted");
+    }
+    if (data.result == NFC_EDEVNOTSUPP) {
+      return ThrowNfcError(env, "pollTarget", data.result, "reader supports none of the requested modulations");
+    }
+    if (DevicePool::is_failure(data.result)) {
+      // Tell a dead reader from an empty field, the pool is reopening it meanwhile.
+      return ThrowNfcError(env, "pollTarget", data.result, "device unavailable");
+    }
+    return ThrowNfcError(env, "pollTarget", data.result, "unable to poll");
+  }
+
+
+  struct Device::TransceiveData {
+    std::vector<uint8_t> transmit;
+    std::vector<uint8_t> receive;
+    int result;
+    unsigned retries;
+
+    TransceiveData(napi_env env, napi_value transmit_, napi_value receive_capacity_)
+      : transmit(fromJS<std::vector<uint8_t> >(env, transmit_)), receive(fromJS<size_t>(env, receive_capacity_)) {}
+  };
+
+
+  napi_value
+  Device::Transceive(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, TransceiveData>::Schedule
+      ("transceive", Deadline::FromOptions(env, args[2]), RunTransceive, AfterTransceive, env, args.This(),
+       TransceiveData(env, args[0], args[1]));
+  }
+
+
+  void
+  Device::RunTransceive(Device &instance, TransceiveData &data) {
+    data.result = instance.transceive(data.transmit, data.receive, data.retries);
+  }
+
+
+  napi_value
+  Device::AfterTransceive(napi_env env, napi_value instance, TransceiveData &data) {
+    if (data.result >= 0) {
+      return toJS(env, data.receive);
+    }
+    if (data.result == NFC_EOPABORTED) {
+      return ThrowNfcError(env, "transceive", data.result, "operation was aborted");
+    }
+    // How often it was retried, so that callers need not try again themselves.
+    napi_value error = MakeNfcError(env, "transceive", data.result, "unable to transceive data");
+    napi_set_named_property(env, error, "retries", toJS(env, data.retries));
+    napi_throw(env, error);
+    return NULL;
+  }
+
+
+  struct Device::TransceiveBitsData {
+    std::vector<uint8_t> transmit;
+    size_t bits;
+    Framing::Crc crc;
+    bool raw_crc;                    // the reader's CRC is off
+    bool host_parity;                // computed and checked here
+    std::vector<uint8_t> parity;     // sent as is, if given
+    std::vector<uint8_t> receive;
+    std::vector<uint8_t> receive_parity;
+    int result;  // bits received
+    const char *error;  // framing error of the response
+
+    TransceiveBitsData()
+      : bits(0), crc(Framing::no_crc), raw_crc(false), host_parity(false), result(0), error(NULL) {}
+  };
+
+
+  napi_value
+  Device::TransceiveBits(const Arguments &args) {
+    napi_env env = args.Env();
+    TransceiveBitsData data;
+    data.transmit = fromJS<std::vector<uint8_t> >(env, args[0]);
+    data.bits = GetOption<uint32_t>(env, args[2], "bits", uint32_t(data.transmit.size() * 8));
+    const std::string crc = GetOption<std::string>(env, args[2], "crc", "");
+    if (crc == "a" || crc == "b") {
+      data.crc = crc == "a" ? Framing::crc_a : Framing::crc_b;
+      data.raw_crc = true;
+    }
+    else if (crc == "none") {
+      data.raw_crc = true;
+    }
+    else if (!crc.empty()) {
+      return ThrowTypeError(env, "unknown CRC type");
+    }
+    napi_value parity = GetOption(env, args[2], "parity");
+    napi_valuetype type = napi_undefined;
+    if (parity) {
+      napi_typeof(env, parity, &type);
+    }
+    if (type == napi_boolean) {
+      data.host_parity = fromJS<bool>(env, parity);
+    }
+    else if (parity) {
+      data.parity = fromJS<std::vector<uint8_t> >(env, parity);
+    }
+    if (data.bits > data.transmit.size() * 8 || (data.crc != Framing::no_crc && data.bits % 8)) {
+      return ThrowTypeError(env, "invalid frame length");
+    }
+    if (!data.parity.empty() && data.parity.size() < (data.bits + 7) / 8) {
+      return ThrowTypeError(env, "missing parity bits");
+    }
+    data.receive.resize(fromJS<size_t>(env, args[1]));
+    return AsyncRunner<Device, TransceiveBitsData>::Schedule
+      ("transceiveBits", Deadline::FromOptions(env, args[2]), RunTransceiveBits, AfterTransceiveBits, env,
+       args.This(), data);
+  }
+
+
+  void
+  Device::RunTransceiveBits(Device &instance, TransceiveBitsData &data) {
+    Command command(instance);
+    nfc_device *device = command.device();
+    if (!device) {
+      data.result = NFC_EIO;
+      return;
+    }
+    const bool raw_parity = data.host_parity || !data.parity.empty();
+    RawFraming framing(command);
+    if ((data.raw_crc && (data.result = framing.disable(NP_HANDLE_CRC)) < 0) ||
+        (raw_parity && (data.result = framing.disable(NP_HANDLE_PARITY)) < 0)) {
+      return;
+    }
+    std::vector<uint8_t> transmit(data.transmit.begin(), data.transmit.begin() + (data.bits + 7) / 8);
+    size_t bits = data.bits;
+    if (data.crc != Framing::no_crc) {
+      Framing::append_crc(data.crc, transmit);
+      bits += 16;
+    }
+    std::vector<uint8_t> parity = data.host_parity ? Framing::parity(transmit) : data.parity;
+    // CRC bytes get their parity too.
+    for (size_t i = parity.size(); raw_parity && i < transmit.size(); ++i) {
+      parity.push_back(Framing::parity(transmit[i]));
+    }
+    // The response may carry a CRC on top of what the caller expects.
+    data.receive.resize(data.receive.size() + (data.crc != Framing::no_crc ? 2 : 0));
+    data.receive_parity.resize(raw_parity ? data.receive.size() : 0);
+    int result = command.check(nfc_initiator_transceive_bits(device, transmit.data(), bits,
+                                                             raw_parity ? parity.data() : NULL,
+                                                             data.receive.data(), data.receive.size(),
+                                                             raw_parity ? data.receive_parity.data() : NULL));
+    data.result = result;
+    if (result < 0) {
+      return;
+    }
+    const size_t bytes = (size_t(result) + 7) / 8;
+    data.receive.resize(bytes);
+    data.receive_parity.resize(raw_parity ? bytes : 0);
+    if (data.host_parity && !Framing::check_parity(data.receive, data.receive_parity, result / 8)) {
+      data.error = "parity error";
+    }
+    else if (data.crc != Framing::no_crc) {
+      if (result % 8 || !Framing::check_crc(data.crc, data.receive)) {
+        data.error = "CRC error";
+      }
+      else {
+        data.result -= 16;
+        data.receive_parity.resize(raw_parity ? data.receive.size() : 0);
+      }
+    }
+  }
+
+
+  napi_value
+  Device::AfterTransceiveBits(napi_env env, napi_value instance, TransceiveBitsData &data) {
+    if (data.result == NFC_EOPABORTED) {
+      return ThrowNfcError(env, "transceiveBits", data.result, "operation was aborted");
+    }
+    if (data.result < 0 || data.error) {
+      return ThrowNfcError(env, "transceiveBits", data.result < 0 ? data.result : NFC_ERFTRANS,
+                           data.error ? data.error : "unable to transceive data");
+    }
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "data", toJS(env, data.receive));
+    napi_set_named_property(env, result, "bits", toJS(env, data.result));
+    if (data.host_parity || !data.parity.empty()) {
+      napi_set_named_property(env, result, "parity", toJS(env, data.receive_parity));
+    }
+    return result;
+  }
+
+
+  struct Device::GetIsPresentData {
+    nfc_target target;
+    bool is_present;
+
+    GetIsPresentData(napi_env env, napi_value target_)
+      : target(Target::Unwrap(env, target_).target) {}
+  };
+
+
+  napi_value
+  Device::IsPresent(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, GetIsPresentData>::Schedule
+      ("isPresent", Deadline::FromOptions(env, args[1]), RunGetIsPresent, AfterGetIsPresent, env, args.This(),
+       GetIsPresentData(env, args[0]));
   }
 
 
@@ -269,10 +1545,774 @@ namespace nfc {
   }
 
 
-  v8::Handle<v8::Value>
-  Device::AfterGetIsPresent(v8::Handle<v8::Object> instance, GetIsPresentData &data) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(data.is_present));
+  napi_value
+  Device::AfterGetIsPresent(napi_env env, napi_value instance, GetIsPresentData &data) {
+    return toJS(env, data.is_present);
+  }
+
+
+  struct Device::ReselectData {
+    nfc_target target;
+    nfc_target selected;
+    int result;
+
+    ReselectData(napi_env env, napi_value target_)
+      : target(Target::Unwrap(env, target_).target) {}
+  };
+
+
+  napi_value
+  Device::Reselect(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, ReselectData>::Schedule
+      ("reselect", Deadline::FromOptions(env, args[1]), RunReselect, AfterReselect, env, args.This(),
+       ReselectData(env, args[0]));
+  }
+
+
+  void
+  Device::RunReselect(Device &instance, ReselectData &data) {
+    data.result = instance.reselect(data.target, data.selected);
+  }
+
+
+  napi_value
+  Device::AfterReselect(napi_env env, napi_value instance, ReselectData &data) {
+    if (data.result > 0) {
+      return Target::Construct(env, data.selected);
+    }
+    if (data.result == NFC_EOPABORTED) {
+      return ThrowNfcError(env, "reselect", data.result, "operation was aborted");
+    }
+    if (data.result == NFC_EINVARG) {
+      return ThrowTypeError(env, "DEP targets cannot be reselected");
+    }
+    if (DevicePool::is_failure(data.result)) {
+      return ThrowNfcError(env, "reselect", data.result, "device unavailable");
+    }
+    // the card is gone
+    return toJS(env, null);
+  }
+
+
+  napi_value
+  Device::DesfireError(napi_env env, const char operation[], int result) {
+    if (result == NFC_EOPABORTED) {
+      return ThrowNfcError(env, operation, result, "operation was aborted");
+    }
+    if (result == NFC_EINVARG) {
+      return ThrowTypeError(env, "invalid DESFire key");
+    }
+    if (result < 0) {
+      return ThrowNfcError(env, operation, result, "unable to transceive data");
+    }
+    char message[64];
+    snprintf(message, sizeof(message), "DESFire command failed with status 0x%02x", result);
+    return ThrowStatusError(env, operation, result, message);
+  }
+
+
+  struct Device::DesfireAuthenticateData {
+    uint8_t key_no;
+    std::vector<uint8_t> key;
+    Desfire::KeyType type;
+    int result;
+
+    DesfireAuthenticateData(napi_env env, napi_value key_no_, napi_value key_, Desfire::KeyType type_)
+      : key_no(fromJS<uint8_t>(env, key_no_)), key(fromJS<std::vector<uint8_t> >(env, key_)), type(type_) {}
+  };
+
+
+  napi_value
+  Device::DesfireAuthenticate(const Arguments &args) {
+    napi_env env = args.Env();
+    Desfire::KeyType type = Desfire::AES;
+    if (args.Length() > 2 && !Desfire::parse_key_type(fromJS<std::string>(env, args[2]), type)) {
+      return ThrowTypeError(env, "unknown key type");
+    }
+    return AsyncRunner<Device, DesfireAuthenticateData>::Schedule
+      ("desfireAuthenticate", Deadline::FromOptions(env, args[3]), RunDesfireAuthenticate, AfterDesfireAuthenticate,
+       env, args.This(),
+       DesfireAuthenticateData(env, args[0], args[1], type));
+  }
+
+
+  void
+  Device::RunDesfireAuthenticate(Device &instance, DesfireAuthenticateData &data) {
+    Command command(instance);
+    Exchange exchange(command);
+    data.result = instance.desfire.authenticate(exchange, data.key_no, data.type, data.key);
+  }
+
+
+  napi_value
+  Device::AfterDesfireAuthenticate(napi_env env, napi_value instance, DesfireAuthenticateData &data) {
+    if (data.result) {
+      return DesfireError(env, "desfireAuthenticate", data.result);
+    }
+    return toJS(env, true);
+  }
+
+
+  struct Device::DesfireSelectApplicationData {
+    uint32_t aid;
+    int result;
+
+    DesfireSelectApplicationData(napi_env env, napi_value aid_)
+      : aid(fromJS<uint32_t>(env, aid_)) {}
+  };
+
+
+  napi_value
+  Device::DesfireSelectApplication(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, DesfireSelectApplicationData>::Schedule
+      ("desfireSelectApplication", Deadline::FromOptions(env, args[1]), RunDesfireSelectApplication,
+       AfterDesfireSelectApplication, env, args.This(), DesfireSelectApplicationData(env, args[0]));
+  }
+
+
+  void
+  Device::RunDesfireSelectApplication(Device &instance, DesfireSelectApplicationData &data) {
+    Command command(instance);
+    Exchange exchange(command);
+    data.result = instance.desfire.select_application(exchange, data.aid);
+  }
+
+
+  napi_value
+  Device::AfterDesfireSelectApplication(napi_env env, napi_value instance, DesfireSelectApplicationData &data) {
+    if (data.result) {
+      return DesfireError(env, "desfireSelectApplication", data.result);
+    }
+    return toJS(env, true);
+  }
+
+
+  struct Device::DesfireGetFileIdsData {
+    std::vector<uint8_t> ids;
+    int result;
+  };
+
+
+  napi_value
+  Device::DesfireGetFileIds(const Arguments &args) {
+    return AsyncRunner<Device, DesfireGetFileIdsData>::Schedule
+      ("desfireGetFileIds", Deadline::FromOptions(args.Env(), args[0]), RunDesfireGetFileIds, AfterDesfireGetFileIds,
+       args.Env(), args.This());
+  }
+
+
+  void
+  Device::RunDesfireGetFileIds(Device &instance, DesfireGetFileIdsData &data) {
+    Command command(instance);
+    Exchange exchange(command);
+    data.result = instance.desfire.get_file_ids(exchange, data.ids);
+  }
+
+
+  napi_value
+  Device::AfterDesfireGetFileIds(napi_env env, napi_value instance, DesfireGetFileIdsData &data) {
+    if (data.result) {
+      return DesfireError(env, "desfireGetFileIds", data.result);
+    }
+    napi_value result;
+    napi_create_array_with_length(env, data.ids.size(), &result);
+    for (size_t i = 0; i < data.ids.size(); ++i) {
+      napi_set_element(env, result, i, toJS(env, data.ids[i]));
+    }
+    return result;
+  }
+
+
+  struct Device::DesfireReadDataData {
+    uint8_t file_no;
+    uint32_t offset;
+    uint32_t length;
+    Desfire::Mode mode;
+    std::vector<uint8_t> data;
+    int result;
+
+    DesfireReadDataData(napi_env env, napi_value file_no_, napi_value options, Desfire::Mode mode_)
+      : file_no(fromJS<uint8_t>(env, file_no_)), offset(GetOption<uint32_t>(env, options, "offset", 0))
+      , length(GetOption<uint32_t>(env, options, "length", 0)), mode(mode_) {}
+  };
+
+
+  napi_value
+  Device::DesfireReadData(const Arguments &args) {
+    napi_env env = args.Env();
+    Desfire::Mode mode = Desfire::AUTO;
+    if (!Desfire::parse_mode(GetOption<std::string>(env, args[1], "mode", "auto"), mode)) {
+      return ThrowTypeError(env, "unknown communication mode");
+    }
+    return AsyncRunner<Device, DesfireReadDataData>::Schedule
+      ("desfireReadData", Deadline::FromOptions(env, args[1]), RunDesfireReadData, AfterDesfireReadData, env,
+       args.This(), DesfireReadDataData(env, args[0], args[1], mode));
+  }
+
+
+  void
+  Device::RunDesfireReadData(Device &instance, DesfireReadDataData &data) {
+    Command command(instance);
+    Exchange exchange(command);
+    data.result = instance.desfire.read_data(exchange, data.file_no, data.offset, data.length, data.mode, data.data);
+  }
+
+
+  napi_value
+  Device::AfterDesfireReadData(napi_env env, napi_value instance, DesfireReadDataData &data) {
+    if (data.result) {
+      return DesfireError(env, "desfireReadData", data.result);
+    }
+    return toJS(env, data.data);
+  }
+
+
+  static std::vector<Felica::Block>
+  GetFelicaBlocks(napi_env env, napi_value blocks) {
+    std::vector<Felica::Block> result;
+    bool is_array = false;
+    napi_is_array(env, blocks, &is_array);
+    uint32_t length = 0;
+    if (is_array) {
+      napi_get_array_length(env, blocks, &length);
+    }
+    for (uint32_t i = 0; i < length; ++i) {
+      napi_value element;
+      napi_get_element(env, blocks, i, &element);
+      // Plain block numbers refer to the first service.
+      Felica::Block block = {0, 0};
+      if (IsObject(env, element)) {
+        block.service = GetOption<uint8_t>(env, element, "service", 0);
+        block.number = GetOption<uint16_t>(env, element, "block", 0);
+      }
+      else {
+        block.number = fromJS<uint16_t>(env, element);
+      }
+      result.push_back(block);
+    }
+    return result;
+  }
+
+
+  static bool
+  ValidFelicaBlocks(const std::vector<Felica::Block> &blocks, size_t services) {
+    for (std::vector<Felica::Block>::const_iterator it = blocks.begin(); it != blocks.end(); ++it) {
+      if (it->service >= services) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+
+  // Cache address of a block: service code and block number.
+  static uint32_t
+  FelicaAddress(const std::vector<uint16_t> &services, const Felica::Block &block) {
+    return uint32_t(services[block.service]) << 16 | block.number;
+  }
+
+
+  struct Device::FelicaReadData {
+    uint8_t idm[8];
+    size_t max_blocks;
+    std::vector<uint16_t> services;
+    std::vector<Felica::Block> blocks;
+    std::vector<Felica::Block> verify;  // always read, the cache is dropped if they changed
+    bool use_cache;
+    std::vector<uint8_t> data;
+    int result;
+
+    FelicaReadData(napi_env env, const nfc_target &target, napi_value services_, napi_value blocks_,
+                   napi_value options)
+      : max_blocks(Felica::max_blocks(target.nti.nfi.abtPad)), services(fromJS<std::vector<uint16_t> >(env, services_))
+      , blocks(GetFelicaBlocks(env, blocks_)), use_cache(GetOption(env, options, "cache", true))
+    {
+      std::copy(target.nti.nfi.abtId, target.nti.nfi.abtId + 8, idm);
+      napi_value verify_ = GetOption(env, options, "verify");
+      if (verify_) {
+        verify = GetFelicaBlocks(env, verify_);
+      }
+    }
+  };
+
+
+  napi_value
+  Device::FelicaRead(const Arguments &args) {
+    napi_env env = args.Env();
+    const nfc_target &target = Target::Unwrap(env, args[0]).target;
+    if (target.nm.nmt != NMT_FELICA) {
+      return ThrowTypeError(env, "expected FeliCa target");
+    }
+    FelicaReadData data(env, target, args[1], args[2], args[3]);
+    if (data.services.empty() || data.services.size() > Felica::max_services) {
+      return ThrowTypeError(env, "expected 1 to 16 service codes");
+    }
+    const size_t services = data.services.size();
+    if (!ValidFelicaBlocks(data.blocks, services) || !ValidFelicaBlocks(data.verify, services)) {
+      return ThrowTypeError(env, "block refers to an unknown service");
+    }
+    return AsyncRunner<Device, FelicaReadData>::Schedule
+      ("felicaRead", Deadline::FromOptions(env, args[3]), RunFelicaRead, AfterFelicaRead, env, args.This(), data);
+  }
+
+
+  int
+  Device::felica_read(Transport &transport, ContentCache &cache, FelicaReadData &data) {
+    const size_t size = Felica::block_size;
+    const ContentCache::Uid uid(data.idm, data.idm + 8);
+
+    // Cached blocks are only trusted if the verification blocks (e.g. a counter) are cached too.
+    std::vector<std::vector<uint8_t> > expected(data.verify.size());
+    bool trusted = true;
+    for (size_t i = 0; i < data.verify.size(); ++i) {
+      trusted = cache.get(uid, FelicaAddress(data.services, data.verify[i]), expected[i]) && trusted;
+    }
+    std::vector<std::vector<uint8_t> > contents(data.blocks.size());
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < data.blocks.size(); ++i) {
+      if (!trusted || !cache.get(uid, FelicaAddress(data.services, data.blocks[i]), contents[i])) {
+        pending.push_back(i);
+      }
+    }
+
+    // Verification blocks go into the same commands as the blocks missing from the cache.
+    std::vector<uint8_t> received;
+    for (int attempt = 0; ; ++attempt) {
+      std::vector<Felica::Block> request(data.verify);
+      for (size_t i = 0; i < pending.size(); ++i) {
+        request.push_back(data.blocks[pending[i]]);
+      }
+      if (request.empty()) {
+        break;
+      }
+      int result = Felica::read(transport, data.idm, data.services, request, data.max_blocks, received);
+      if (result) {
+        return result;
+      }
+      bool changed = false;
+      for (size_t i = 0; trusted && i < data.verify.size(); ++i) {
+        changed = changed || !std::equal(expected[i].begin(), expected[i].end(), received.begin() + i * size);
+      }
+      if (!changed || attempt) {
+        break;
+      }
+      // The card was written elsewhere, nothing cached for it is current.
+      cache.invalidate(uid);
+      trusted = false;
+      pending.clear();
+      for (size_t i = 0; i < data.blocks.size(); ++i) {
+        pending.push_back(i);
+      }
+    }
+
+    std::vector<uint8_t>::const_iterator block = received.begin();
+    for (size_t i = 0; i < data.verify.size(); ++i, block += size) {
+      cache.put(uid, FelicaAddress(data.services, data.verify[i]), std::vector<uint8_t>(block, block + size));
+    }
+    for (size_t i = 0; i < pending.size(); ++i, block += size) {
+      contents[pending[i]].assign(block, block + size);
+      cache.put(uid, FelicaAddress(data.services, data.blocks[pending[i]]), contents[pending[i]]);
+    }
+    data.data.clear();
+    for (size_t i = 0; i < contents.size(); ++i) {
+      data.data.insert(data.data.end(), contents[i].begin(), contents[i].end());
+    }
+    return 0;
+  }
+
+
+  void
+  Device::RunFelicaRead(Device &instance, FelicaReadData &data) {
+    Command command(instance);
+    Exchange exchange(command);
+    if (data.use_cache && command.cache().enabled()) {
+      data.result = felica_read(exchange, command.cache(), data);
+    }
+    else {
+      data.result = Felica::read(exchange, data.idm, data.services, data.blocks, data.max_blocks, data.data);
+    }
+  }
+
+
+  napi_value
+  Device::AfterFelicaRead(napi_env env, napi_value instance, FelicaReadData &data) {
+    if (data.result == NFC_EOPABORTED) {
+      return ThrowNfcError(env, "felicaRead", data.result, "operation was aborted");
+    }
+    if (data.result < 0) {
+      return ThrowNfcError(env, "felicaRead", data.result, "unable to transceive data");
+    }
+    if (data.result) {
+      char message[64];
+      snprintf(message, sizeof(message), "FeliCa read failed with status 0x%04x", data.result);
+      return ThrowStatusError(env, "felicaRead", data.result, message);
+    }
+    return toJS(env, data.data);
+  }
+
+
+  napi_value
+  Device::ConfigureCache(const Arguments &args) {
+    napi_env env = args.Env();
+    ContentCache &cache = Unwrap(env, args.This()).slot.get()->cache;
+    ContentCache::Options current = cache.settings();
+    ContentCache::Options options;
+    options.max_size = GetOption<uint32_t>(env, args[0], "maxSize", current.max_size);
+    options.ttl = GetOption(env, args[0], "ttl", current.ttl);
+    cache.configure(options);
+    return toJS(env, true);
+  }
+
+
+  napi_value
+  Device::ClearCache(const Arguments &args) {
+    napi_env env = args.Env();
+    Unwrap(env, args.This()).slot.get()->cache.clear();
+    return toJS(env, true);
+  }
+
+
+  napi_value
+  Device::ConfigureRetry(const Arguments &args) {
+    napi_env env = args.Env();
+    RetryPolicy &retry = Unwrap(env, args.This()).retry;
+    RetryPolicy::Options options = retry.settings();
+    napi_value errors = GetOption(env, args[0], "errors");
+    if (errors) {
+      options.errors = 0;
+      const std::vector<std::string> names = fromJS<std::vector<std::string> >(env, errors);
+      for (std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        const unsigned error_class = RetryPolicy::error_class(*it);
+        if (!error_class) {
+          return ThrowTypeError(env, "unknown error class");
+        }
+        options.errors |= error_class;
+      }
+    }
+    napi_value recovery = GetOption(env, args[0], "recovery");
+    if (recovery && !RetryPolicy::recovery(fromJS<std::string>(env, recovery), options.recovery)) {
+      return ThrowTypeError(env, "unknown recovery");
+    }
+    options.max_attempts = GetOption(env, args[0], "maxAttempts", options.max_attempts);
+    options.budget = GetOption(env, args[0], "budget", options.budget);
+    retry.configure(options);
+    return toJS(env, true);
+  }
+
+
+  napi_value
+  Device::GetRetryStats(const Arguments &args) {
+    napi_env env = args.Env();
+    RetryPolicy::Stats stats = Unwrap(env, args.This()).retry.stats();
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "retries", toJS(env, stats.retries));
+    napi_set_named_property(env, result, "recovered", toJS(env, stats.recovered));
+    napi_set_named_property(env, result, "exhausted", toJS(env, stats.exhausted));
+    return result;
+  }
+
+
+  napi_value
+  Device::ConfigureErrorStats(const Arguments &args) {
+    napi_env env = args.Env();
+    RawSlot slot(Unwrap(env, args.This()).slot);
+    ErrorCounters &errors = slot.get()->errors;
+    errors.configure(GetOption(env, args[0], "window", errors.settings()));
+    return toJS(env, true);
+  }
+
+
+  napi_value
+  Device::GetErrorStats(const Arguments &args) {
+    napi_env env = args.Env();
+    RawSlot slot(Unwrap(env, args.This()).slot);
+    ErrorCounters::Counts counts = slot.get()->errors.counts(uv_hrtime() / 1000000);
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "window", toJS(env, counts.window));
+    for (unsigned i = 0; i < ErrorCounters::class_count; ++i) {
+      const char *name = ErrorCounters::name(ErrorCounters::Class(i));
+      napi_set_named_property(env, result, name, toJS(env, counts.classes[i]));
+    }
+    napi_set_named_property(env, result, "total", toJS(env, counts.total()));
+    napi_set_named_property(env, result, "errors", toJS(env, counts.errors()));
+    napi_set_named_property(env, result, "errorRate", toJS(env, counts.error_rate()));
+    return result;
+  }
+
+
+  napi_value
+  Device::GetProvisioningStats(const Arguments &args) {
+    napi_env env = args.Env();
+    Provisioner::Stats stats = Unwrap(env, args.This()).provisioner.stats();
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "provisioned", toJS(env, stats.provisioned));
+    napi_set_named_property(env, result, "skipped", toJS(env, stats.skipped));
+    napi_set_named_property(env, result, "failed", toJS(env, stats.failed));
+    napi_set_named_property(env, result, "pages", toJS(env, stats.pages));
+    napi_set_named_property(env, result, "meanTime", toJS(env, stats.mean_time()));
+    napi_set_named_property(env, result, "tagsPerHour", toJS(env, stats.tags_per_hour()));
+    napi_set_named_property(env, result, "nextSerial", toJS(env, double(stats.next_serial)));
+    return result;
+  }
+
+
+  napi_value
+  Device::GetCacheStats(const Arguments &args) {
+    napi_env env = args.Env();
+    ContentCache::Stats stats = Unwrap(env, args.This()).slot.get()->cache.stats();
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "hits", toJS(env, stats.hits));
+    napi_set_named_property(env, result, "misses", toJS(env, stats.misses));
+    napi_set_named_property(env, result, "invalidations", toJS(env, stats.invalidations));
+    napi_set_named_property(env, result, "evictions", toJS(env, stats.evictions));
+    napi_set_named_property(env, result, "size", toJS(env, uint32_t(stats.size)));
+    return result;
+  }
+
+
+  napi_value
+  Device::DepError(napi_env env, const char operation[], int result) {
+    if (result == NFC_EOPABORTED) {
+      return ThrowNfcError(env, operation, result, "operation was aborted");
+    }
+    if (result == NFC_ETIMEOUT) {
+      return ThrowNfcError(env, operation, result, "no DEP peer responded");
+    }
+    if (result == NFC_EINVARG) {
+      return ThrowTypeError(env, "frame size too small");
+    }
+    if (result == NFC_EDEVNOTSUPP) {
+      return ThrowNfcError(env, operation, result, "reader does not support DEP at this baud rate");
+    }
+    return ThrowNfcError(env, operation, result, "unable to transfer data");
+  }
+
+
+  struct Device::DepConnectData {
+    nfc_dep_mode mode;
+    nfc_baud_rate baud_rate;
+    int timeout;
+    nfc_target target;
+    int result;
+
+    DepConnectData(napi_env env, napi_value options)
+      : mode(GetOption(env, options, "active", false) ? NDM_ACTIVE : NDM_PASSIVE)
+      , timeout(GetOption(env, options, "timeout", 1000))
+    {
+      unsigned baud_rate_ = GetOption(env, options, "baudRate", 424u);
+      baud_rate = baud_rate_ == 106 ? NBR_106 : baud_rate_ == 212 ? NBR_212 : NBR_424;
+    }
+  };
+
+
+  napi_value
+  Device::DepConnect(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, DepConnectData>::Schedule
+      ("depConnect", Deadline::FromOptions(env, args[0]), RunDepConnect, AfterDepConnect, env, args.This(),
+       DepConnectData(env, args[0]));
+  }
+
+
+  void
+  Device::RunDepConnect(Device &instance, DepConnectData &data) {
+    Command command(instance);
+    nfc_device *device = command.device();
+    if (!device) {
+      data.result = NFC_EIO;
+      return;
+    }
+    const nfc_modulation modulation = {.nmt = NMT_DEP, .nbr = data.baud_rate};
+    if (!command.capabilities().supports(modulation)) {
+      data.result = NFC_EDEVNOTSUPP;
+      return;
+    }
+    data.result = command.check(nfc_initiator_select_dep_target(device, data.mode, data.baud_rate, NULL, &data.target,
+                                                                Deadline::current().timeout(data.timeout)));
+    if (data.result > 0) {
+      instance.desfire.reset();
+      instance.dep_frame_size = DepTransfer::frame_size(data.target.nti.ndi.btPP);
+    }
+  }
+
+
+  napi_value
+  Device::AfterDepConnect(napi_env env, napi_value instance, DepConnectData &data) {
+    if (data.result > 0) {
+      return Target::Construct(env, data.target);
+    }
+    return DepError(env, "depConnect", data.result ? data.result : NFC_ETIMEOUT);
+  }
+
+
+  struct Device::DepTransferData {
+    const char *operation;
+    std::vector<uint8_t> outgoing;
+    std::vector<uint8_t> incoming;
+    bool receiving;
+    size_t frame_size;  // 0 for the negotiated one
+    int timeout;
+    DepTransfer::Stats stats;
+    int result;
+
+    DepTransferData(napi_env env, const char operation_[], napi_value options, bool receiving_,
+                    napi_value outgoing_ = NULL)
+      : operation(operation_), receiving(receiving_), frame_size(GetOption<uint32_t>(env, options, "frameSize", 0))
+      , timeout(GetOption(env, options, "timeout", 0)), result(0)
+    {
+      if (outgoing_) {
+        outgoing = fromJS<std::vector<uint8_t> >(env, outgoing_);
+      }
+    }
+  };
+
+
+  napi_value
+  Device::DepSend(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, DepTransferData>::Schedule
+      ("depSend", Deadline::FromOptions(env, args[1]), RunDepSend, AfterDepTransfer, env, args.This(),
+       DepTransferData(env, "depSend", args[1], false, args[0]));
+  }
+
+
+  napi_value
+  Device::DepReceive(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, DepTransferData>::Schedule
+      ("depReceive", Deadline::FromOptions(env, args[0]), RunDepReceive, AfterDepTransfer, env, args.This(),
+       DepTransferData(env, "depReceive", args[0], true));
+  }
+
+
+  napi_value
+  Device::DepClose(const Arguments &args) {
+    napi_env env = args.Env();
+    return AsyncRunner<Device, DepTransferData>::Schedule
+      ("depClose", Deadline::FromOptions(env, args[0]), RunDepClose, AfterDepClose, env, args.This(),
+       DepTransferData(env, "depClose", args[0], false));
+  }
+
+
+  napi_value
+  Device::DepServe(const Arguments &args) {
+    napi_env env = args.Env();
+    napi_value outgoing = GetOption(env, args[0], "data");
+    return AsyncRunner<Device, DepTransferData>::Schedule
+      ("depServe", Deadline::FromOptions(env, args[0]), RunDepServe, AfterDepTransfer, env, args.This(),
+       DepTransferData(env, "depServe", args[0], true, outgoing));
+  }
+
+
+  void
+  Device::RunDepSend(Device &instance, DepTransferData &data) {
+    Command command(instance);
+    Exchange exchange(command);
+    size_t frame_size = data.frame_size ? std::min(data.frame_size, instance.dep_frame_size) : instance.dep_frame_size;
+    data.result = DepTransfer::push(exchange, data.outgoing, frame_size, data.stats);
+  }
+
+
+  void
+  Device::RunDepReceive(Device &instance, DepTransferData &data) {
+    Command command(instance);
+    Exchange exchange(command);
+    size_t frame_size = data.frame_size ? std::min(data.frame_size, instance.dep_frame_size) : instance.dep_frame_size;
+    data.result = DepTransfer::pull(exchange, data.incoming, frame_size, data.stats);
+  }
+
+
+  void
+  Device::RunDepClose(Device &instance, DepTransferData &data) {
+    Command command(instance);
+    Exchange exchange(command);
+    data.result = DepTransfer::close(exchange);
+    nfc_device *device = command.device();
+    if (device) {
+      command.check(nfc_initiator_deselect_target(device));
+    }
+  }
+
+
+  void
+  Device::RunDepServe(Device &instance, DepTransferData &data) {
+    Command command(instance);
+    nfc_device *device = command.device();
+    if (!device) {
+      data.result = NFC_EIO;
+      return;
+    }
+    // Passive target at any baud rate, offering the largest frames.
+    nfc_target target;
+    memset(&target, 0, sizeof(target));
+    target.nm.nmt = NMT_DEP;
+    target.nm.nbr = NBR_UNDEFINED;
+    RAND_bytes(target.nti.ndi.abtNFCID3, sizeof(target.nti.ndi.abtNFCID3));
+    target.nti.ndi.ndm = NDM_UNDEFINED;
+    target.nti.ndi.btPP = 0x30;
+    const uint8_t pp = target.nti.ndi.btPP;
+    std::vector<uint8_t> atr_req(DepTransfer::max_frame_size);
+    const int timeout = Deadline::current().timeout(data.timeout);
+    int result = command.check(nfc_target_init(device, &target, atr_req.data(), atr_req.size(), timeout));
+    if (result >= 0) {
+      // Activation hands on the initiator's ATR_REQ, transfer frames follow.  Frames must fit
+      // both our LR and the initiator's.
+      atr_req.resize(result);
+      uint8_t initiator_pp = 0;
+      size_t frame_size = DepTransfer::frame_size(pp);
+      if (DepTransfer::atr_req_pp(atr_req, initiator_pp)) {
+        frame_size = std::min(frame_size, DepTransfer::frame_size(initiator_pp));
+      }
+      else {
+        // The smallest frames every initiator takes.
+        frame_size = DepTransfer::frame_size(0);
+      }
+      if (data.frame_size) {
+        frame_size = std::min(data.frame_size, frame_size);
+      }
+      TargetLink link(command, timeout);
+      result = DepTransfer::serve(link, data.outgoing, data.incoming, frame_size, data.stats);
+    }
+    data.result = result;
+    // Back to initiator mode with our configuration for the commands that follow.
+    if (!command.check(nfc_initiator_init(device))) {
+      instance.write_properties(device);
+    }
+  }
+
+
+  napi_value
+  Device::AfterDepTransfer(napi_env env, napi_value instance, DepTransferData &data) {
+    if (data.result < 0) {
+      return DepError(env, data.operation, data.result);
+    }
+    const DepTransfer::Stats &stats = data.stats;
+    napi_value result;
+    napi_create_object(env, &result);
+    if (data.receiving) {
+      napi_set_named_property(env, result, "data", toJS(env, data.incoming));
+    }
+    napi_set_named_property(env, result, "bytes", toJS(env, stats.bytes));
+    napi_set_named_property(env, result, "frames", toJS(env, stats.frames));
+    napi_set_named_property(env, result, "retries", toJS(env, stats.retries));
+    napi_set_named_property(env, result, "time", toJS(env, stats.time / 1e6));
+    napi_set_named_property(env, result, "throughput", toJS(env, stats.time ? stats.bytes * 1e9 / stats.time : 0.0));
+    return result;
+  }
+
+
+  napi_value
+  Device::AfterDepClose(napi_env env, napi_value instance, DepTransferData &data) {
+    if (data.result < 0) {
+      return DepError(env, data.operation, data.result);
+    }
+    return toJS(env, true);
   }
 
 }
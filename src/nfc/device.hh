@@ -1,78 +1,268 @@
 #ifndef NFC_DEVICE_HH
 #define NFC_DEVICE_HH
 
+#include "cache.hh"
 #include "context.hh"
+#include "dep.hh"
+#include "desfire.hh"
+#include "felica.hh"
+#include "framing.hh"
+#include "pool.hh"
+#include "property.hh"
+#include "provision.hh"
+#include "queue.hh"
+#include "retry.hh"
+#include "scheduler.hh"
+#include "script.hh"
 #include "util.hh"
 #include <nfc/nfc.h>
 
 
 namespace nfc {
 
-  class RawDevice:
-    public RawObject<RawDevice, nfc_device>
+  class Device:
+    public nfc::ObjectWrap<Device>
   {
   public:
-    RawDevice(nfc_device *device = NULL);
+    // Targets looked for when polling.
+    struct PollOptions {
+      bool iso14443;
+      bool felica;
+      uint16_t system_code;
+      uint8_t request_code;
+      nfc_baud_rate felica_baud_rate;
+      bool identify;  // probe targets the classifier cannot tell apart
+      bool provision;  // write the provisioning template to blank Type 2 tags
+      std::vector<Script> scripts;  // the first one matching a target is run on it
 
-    static void destroy(nfc_device *device);
-  };
+      PollOptions();
+    };
 
-
-  class Device:
-    public nfc::ObjectWrap<Device>
-  {
   protected:
-    RawContext context;
-    RawDevice device;
+    RawPool pool;
+    RawSlot slot;
+    PropertySet properties;
+
+    // Commands run through Command, which locks the slot.
+    class Command;
+    unsigned generation;  // slot generation the properties were written to
+    const unsigned id;    // tells the Devices sharing a slot apart
+    uint32_t command_job;  // job holding the running command, guarded by the slot's state_lock
+
+    // Transport over a running command, so that card protocol operations hold the device.
+    class Exchange;
+    // Target side of a DEP link, for the device in target mode.
+    class TargetLink;
+    // Switches CRC or parity handling of the reader off for one command.
+    class RawFraming;
+    // Makes selections give up after one attempt instead of waiting for a card, for one command.
+    class FiniteSelect;
+
+    // DESFire session with the selected target.
+    Desfire desfire;
+
+    // Frame size negotiated with the last DEP target.
+    size_t dep_frame_size;
+
+    // Transient transceive errors are retried natively, selecting last_target again if asked to.
+    RetryPolicy retry;
+    nfc_target last_target;
+    bool has_target;
+
+    // Template written to blank tags found by the polling loop.
+    Provisioner provisioner;
+
+    // Native polling loop.
+    PollOptions poll_options;
+    PollScheduler scheduler;
+    TagQueue events;
+    Event poll_stop;
+    uv_thread_t poll_thread;
+    bool polling;
 
   public:
-    Device(RawContext context, RawDevice device);
+    Device(RawPool pool, RawSlot slot);
+    ~Device();
 
+    bool is_open() const;
     bool close();
     bool set_idle();
+    bool abort(napi_env env);
+    bool abort(napi_env env, uint32_t job);
+    bool abort_command(uint32_t job = 0);
 
     std::string name();
     std::string connstring();
+    Capabilities capabilities();
 
     bool set_as_initiator();
 
+    int set_property(nfc_property property, int value);
+    bool get_property(nfc_property property, int &value) const;
+    int apply_preset(const PropertySet::Preset &preset);
+    int restore_properties();
+
+    bool start_polling(napi_env env, const PollOptions &targets, const PollScheduler::Options &options,
+                       size_t high_water_mark, napi_value listener, const Provisioner::Template *tpl = NULL);
+    bool stop_polling();
+    void pause_events();
+    void resume_events();
+
     // initiator functions
-    int poll_target(nfc_target &target);
+    int poll_target(nfc_target &target, const PollOptions &options, Script::Results &results,
+                    const char *&card_type, Provisioner::Result *provisioning = NULL);
     int is_present(const nfc_target &target);
-    int transceive(const std::vector<uint8_t> &transmit, std::vector<uint8_t> &receive);
+    int reselect(const nfc_target &target, nfc_target &selected);
+    int transceive(const std::vector<uint8_t> &transmit, std::vector<uint8_t> &receive, unsigned &retries);
 
   public:
-    static v8::Handle<v8::Value> Construct(RawContext context, RawDevice device);
+    static napi_value Construct(napi_env env, RawPool pool, RawSlot slot);
 
   public:
-    static v8::Persistent<v8::Function> constructor;
+    static const napi_type_tag type_tag;
+
+    static Device *Create(const Arguments &args);
+    static void Initialize(napi_env env, napi_value exports);
+    static napi_value CheckNew(napi_env env, napi_value instance);
+
+    static napi_value GetName(const Arguments &args);
+    static napi_value GetConnstring(const Arguments &args);
+    static napi_value GetCapabilities(const Arguments &args);
+    static napi_value GetPreset(const Arguments &args);
+    static napi_value GetProperties(const Arguments &args);
+    static napi_value GetPollingStats(const Arguments &args);
+    static napi_value GetDeadlineMisses(const Arguments &args);
+    static napi_value GetCacheStats(const Arguments &args);
+    static napi_value GetRetryStats(const Arguments &args);
+    static napi_value GetProvisioningStats(const Arguments &args);
+    static napi_value GetErrorStats(const Arguments &args);
+
+    static napi_value Close(const Arguments &args);
+    static napi_value SetIdle(const Arguments &args);
+    static napi_value Abort(const Arguments &args);
+
+    static napi_value GetProperty(const Arguments &args);
+    static napi_value SetProperty(const Arguments &args);
+    static napi_value ApplyPreset(const Arguments &args);
+    static napi_value RestoreProperties(const Arguments &args);
 
-    static Device *Create(const v8::Arguments &args);
-    static void Initialize(v8::Handle<v8::Object> exports);
-    static v8::Handle<v8::Value> CheckNew(v8::Handle<v8::Value> instance);
+    static napi_value PollTarget(const Arguments &args);
+    static napi_value Transceive(const Arguments &args);
+    static napi_value TransceiveBits(const Arguments &args);
+    static napi_value IsPresent(const Arguments &args);
+    static napi_value Reselect(const Arguments &args);
 
-    static v8::Handle<v8::Value> GetName(v8::Local<v8::String> property, const v8::AccessorInfo &info);
-    static v8::Handle<v8::Value> GetConnstring(v8::Local<v8::String> property, const v8::AccessorInfo &info);
+    static napi_value DesfireAuthenticate(const Arguments &args);
+    static napi_value DesfireSelectApplication(const Arguments &args);
+    static napi_value DesfireGetFileIds(const Arguments &args);
+    static napi_value DesfireReadData(const Arguments &args);
 
-    static v8::Handle<v8::Value> Close(const v8::Arguments &args);
-    static v8::Handle<v8::Value> SetIdle(const v8::Arguments &args);
+    static napi_value FelicaRead(const Arguments &args);
 
-    static v8::Handle<v8::Value> PollTarget(const v8::Arguments &args);
-    static v8::Handle<v8::Value> Transceive(const v8::Arguments &args);
-    static v8::Handle<v8::Value> IsPresent(const v8::Arguments &args);
+    static napi_value ConfigureCache(const Arguments &args);
+    static napi_value ClearCache(const Arguments &args);
+
+    static napi_value ConfigureRetry(const Arguments &args);
+    static napi_value ConfigureErrorStats(const Arguments &args);
+
+    static napi_value DepConnect(const Arguments &args);
+    static napi_value DepSend(const Arguments &args);
+    static napi_value DepReceive(const Arguments &args);
+    static napi_value DepClose(const Arguments &args);
+    static napi_value DepServe(const Arguments &args);
+
+    static napi_value StartPolling(const Arguments &args);
+    static napi_value StopPolling(const Arguments &args);
+    static napi_value PauseEvents(const Arguments &args);
+    static napi_value ResumeEvents(const Arguments &args);
+
+    static napi_value Serve(const Arguments &args);
 
   protected:
+    static void RunPolling(void *arg);
+    void run_polling();
+    bool wait_for_consumer();
+    void emit(const char type[], const nfc_target *target = NULL, int error = NFC_SUCCESS,
+              const Script::Results &results = Script::Results(), const char *card_type = NULL,
+              const Provisioner::Result &provisioning = Provisioner::Result());
+    const char *identify(Command &command, const nfc_target &target);
+    static int reselect(Command &command, const nfc_target &target, nfc_target &selected);
+    int recover(Command &command, RetryPolicy::Recovery recovery);
+
+    static PollOptions GetPollOptions(napi_env env, napi_value options);
+    static int transceive(Command &command, const std::vector<uint8_t> &transmit, std::vector<uint8_t> &receive);
+
+    int write_properties(nfc_device *device, bool reset = false);
+    static int write_property(nfc_device *device, nfc_property property, int value);
+    static napi_value PropertyToJS(napi_env env, const PropertySet::Info &info, int value);
+
+    struct SetPropertyData;
+    static void RunSetProperty(Device &instance, SetPropertyData &data);
+    static napi_value AfterSetProperty(napi_env env, napi_value instance, SetPropertyData &data);
+
+    struct ApplyPresetData;
+    static void RunApplyPreset(Device &instance, ApplyPresetData &data);
+    static napi_value AfterApplyPreset(napi_env env, napi_value instance, ApplyPresetData &data);
+
+    struct RestorePropertiesData;
+    static void RunRestoreProperties(Device &instance, RestorePropertiesData &data);
+    static napi_value AfterRestoreProperties(napi_env env, napi_value instance, RestorePropertiesData &data);
+
     struct PollTargetData;
     static void RunPollTarget(Device &instance, PollTargetData &data);
-    static v8::Handle<v8::Value> AfterPollTarget(v8::Handle<v8::Object> instance, PollTargetData &data);
+    static napi_value AfterPollTarget(napi_env env, napi_value instance, PollTargetData &data);
 
     struct TransceiveData;
     static void RunTransceive(Device &instance, TransceiveData &data);
-    static v8::Handle<v8::Value> AfterTransceive(v8::Handle<v8::Object> instance, TransceiveData &data);
+    static napi_value AfterTransceive(napi_env env, napi_value instance, TransceiveData &data);
+
+    struct TransceiveBitsData;
+    static void RunTransceiveBits(Device &instance, TransceiveBitsData &data);
+    static napi_value AfterTransceiveBits(napi_env env, napi_value instance, TransceiveBitsData &data);
 
     struct GetIsPresentData;
     static void RunGetIsPresent(Device &instance, GetIsPresentData &data);
-    static v8::Handle<v8::Value> AfterGetIsPresent(v8::Handle<v8::Object> instance, GetIsPresentData &data);
+    static napi_value AfterGetIsPresent(napi_env env, napi_value instance, GetIsPresentData &data);
+
+    struct ReselectData;
+    static void RunReselect(Device &instance, ReselectData &data);
+    static napi_value AfterReselect(napi_env env, napi_value instance, ReselectData &data);
+
+    static napi_value DesfireError(napi_env env, const char operation[], int result);
+
+    struct DesfireAuthenticateData;
+    static void RunDesfireAuthenticate(Device &instance, DesfireAuthenticateData &data);
+    static napi_value AfterDesfireAuthenticate(napi_env env, napi_value instance, DesfireAuthenticateData &data);
+
+    struct DesfireSelectApplicationData;
+    static void RunDesfireSelectApplication(Device &instance, DesfireSelectApplicationData &data);
+    static napi_value AfterDesfireSelectApplication(napi_env env, napi_value instance,
+                                                    DesfireSelectApplicationData &data);
+
+    struct DesfireGetFileIdsData;
+    static void RunDesfireGetFileIds(Device &instance, DesfireGetFileIdsData &data);
+    static napi_value AfterDesfireGetFileIds(napi_env env, napi_value instance, DesfireGetFileIdsData &data);
+
+    struct DesfireReadDataData;
+    static void RunDesfireReadData(Device &instance, DesfireReadDataData &data);
+    static napi_value AfterDesfireReadData(napi_env env, napi_value instance, DesfireReadDataData &data);
+
+    struct FelicaReadData;
+    static int felica_read(Transport &transport, ContentCache &cache, FelicaReadData &data);
+    static void RunFelicaRead(Device &instance, FelicaReadData &data);
+    static napi_value AfterFelicaRead(napi_env env, napi_value instance, FelicaReadData &data);
+
+    static napi_value DepError(napi_env env, const char operation[], int result);
+    struct DepConnectData;
+    static void RunDepConnect(Device &instance, DepConnectData &data);
+    static napi_value AfterDepConnect(napi_env env, napi_value instance, DepConnectData &data);
+    struct DepTransferData;
+    static void RunDepSend(Device &instance, DepTransferData &data);
+    static void RunDepReceive(Device &instance, DepTransferData &data);
+    static void RunDepClose(Device &instance, DepTransferData &data);
+    static void RunDepServe(Device &instance, DepTransferData &data);
+    static napi_value AfterDepTransfer(napi_env env, napi_value instance, DepTransferData &data);
+    static napi_value AfterDepClose(napi_env env, napi_value instance, DepTransferData &data);
   };
 
 }
@@ -0,0 +1,191 @@
+#include "errors.hh"
+#include <cstring>
+#include <nfc/nfc.h>
+
+
+namespace nfc {
+
+  static const char *const class_names[] = {
+    "success", "timeout", "rf", "chip", "device", "released", "aborted", "other"
+  };
+
+
+  ErrorCounters::Counts::Counts()
+    : window(0)
+  {
+    std::memset(classes, 0, sizeof(classes));
+  }
+
+
+  uint64_t
+  ErrorCounters::Counts::total() const {
+    uint64_t result = 0;
+    for (unsigned i = 0; i < class_count; ++i) {
+      result += classes[i];
+    }
+    return result;
+  }
+
+
+  uint64_t
+  ErrorCounters::Counts::errors() const {
+    return total() - classes[success] - classes[released] - classes[aborted];
+  }
+
+
+  double
+  ErrorCounters::Counts::error_rate() const {
+    uint64_t calls = total();
+    return calls ? double(errors()) / calls : 0;
+  }
+
+
+  ErrorCounters::ErrorCounters() {
+    configure(60000);
+  }
+
+
+  void
+  ErrorCounters::configure(unsigned window_) {
+    WrLock lk(lock);
+    window = window_ < bucket_count ? bucket_count : window_;
+    std::memset(buckets, 0, sizeof(buckets));
+  }
+
+
+  unsigned
+  ErrorCounters::settings() const {
+    RdLock lk(lock);
+    return window;
+  }
+
+
+  void
+  ErrorCounters::record(int result, uint64_t now) {
+    WrLock lk(lock);
+    const uint64_t slot = now / (window / bucket_count);
+    Bucket &bucket = buckets[slot % bucket_count];
+    if (bucket.slot != slot) {
+      // Left over from an earlier round.
+      std::memset(&bucket, 0, sizeof(bucket));
+      bucket.slot = slot;
+    }
+    ++bucket.classes[classify(result)];
+  }
+
+
+  ErrorCounters::Counts
+  ErrorCounters::counts(uint64_t now) const {
+    RdLock lk(lock);
+    Counts result;
+    result.window = window;
+    const uint64_t slot = now / (window / bucket_count);
+    for (unsigned i = 0; i < bucket_count; ++i) {
+      const Bucket &bucket = buckets[i];
+      if (bucket.slot + bucket_count > slot && bucket.slot <= slot) {
+        for (unsigned c = 0; c < class_count; ++c) {
+          result.classes[c] += bucket.classes[c];
+        }
+      }
+    }
+    return result;
+  }
+
+
+  ErrorCounters::Class
+  ErrorCounters::classify(int result) {
+    if (result >= 0) {
+      return success;
+    }
+    switch (result) {
+    case NFC_ETIMEOUT:
+      return timeout;
+    case NFC_ERFTRANS:
+      return rf;
+    case NFC_ECHIP:
+      return chip;
+    case NFC_EIO:
+    case NFC_ENOTSUCHDEV:
+      return device;
+    case NFC_ETGRELEASED:
+      return released;
+    case NFC_EOPABORTED:
+      return aborted;
+    default:
+      return other;
+    }
+  }
+
+
+  const char *
+  ErrorCounters::name(Class error_class) {
+    return class_names[error_class];
+  }
+
+
+  const char *
+  ErrorCounters::strerror(int error) {
+    // As in libnfc, which only looks up the last error of a device.
+    switch (error) {
+    case NFC_SUCCESS:
+      return "Success";
+    case NFC_EIO:
+      return "Input / Output Error";
+    case NFC_EINVARG:
+      return "Invalid argument(s)";
+    case NFC_EDEVNOTSUPP:
+      return "Not Supported by Device";
+    case NFC_ENOTSUCHDEV:
+      return "No Such Device";
+    case NFC_EOVFLOW:
+      return "Buffer Overflow";
+    case NFC_ETIMEOUT:
+      return "Timeout";
+    case NFC_EOPABORTED:
+      return "Operation Aborted";
+    case NFC_ENOTIMPL:
+      return "Not (yet) Implemented";
+    case NFC_ETGRELEASED:
+      return "Target Released";
+    case NFC_EMFCAUTHFAIL:
+      return "Mifare Authentication Failed";
+    case NFC_ERFTRANS:
+      return "RF Transmission Error";
+    case NFC_ECHIP:
+      return "Device's Internal Chip Error";
+    default:
+      return "Unknown error";
+    }
+  }
+
+
+  napi_value
+  MakeNfcError(napi_env env, const char operation[], int error, const std::string &message) {
+    napi_value result = MakeError(env, message);
+    napi_set_named_property(env, result, "code", toJS(env, error));
+    napi_set_named_property(env, result, "text", toJS(env, std::string(ErrorCounters::strerror(error))));
+    napi_set_named_property(env, result, "errorClass",
+                            toJS(env, std::string(ErrorCounters::name(ErrorCounters::classify(error)))));
+    napi_set_named_property(env, result, "operation", toJS(env, std::string(operation)));
+    return result;
+  }
+
+
+  napi_value
+  ThrowNfcError(napi_env env, const char operation[], int error, const std::string &message) {
+    napi_throw(env, MakeNfcError(env, operation, error, message));
+    return NULL;
+  }
+
+
+  napi_value
+  ThrowStatusError(napi_env env, const char operation[], int status, const std::string &message) {
+    napi_value result = MakeError(env, message);
+    napi_set_named_property(env, result, "code", toJS(env, status));
+    napi_set_named_property(env, result, "errorClass", toJS(env, std::string("status")));
+    napi_set_named_property(env, result, "operation", toJS(env, std::string(operation)));
+    napi_throw(env, result);
+    return NULL;
+  }
+
+}
@@ -0,0 +1,77 @@
+#ifndef NFC_ERRORS_HH
+#define NFC_ERRORS_HH
+
+#include "util.hh"
+#include <stdint.h>
+#include <string>
+
+
+namespace nfc {
+
+  // Outcomes of the libnfc calls on a reader by error class, over a rolling window, so that a
+  // reader going bad can be told from a card that is hard to read.
+  class ErrorCounters {
+  public:
+    enum Class {
+      success,
+      timeout,   // NFC_ETIMEOUT
+      rf,        // NFC_ERFTRANS
+      chip,      // NFC_ECHIP
+      device,    // NFC_EIO, NFC_ENOTSUCHDEV: the reader itself failed
+      released,  // NFC_ETGRELEASED: the card has left, not counted as an error
+      aborted,   // NFC_EOPABORTED, not counted as an error
+      other,
+      class_count
+    };
+
+    struct Counts {
+      unsigned window;  // ms
+      uint64_t classes[class_count];
+
+      Counts();
+
+      uint64_t total() const;
+      uint64_t errors() const;
+      double error_rate() const;
+    };
+
+  protected:
+    static const unsigned bucket_count = 60;
+
+    struct Bucket {
+      uint64_t slot;  // time / bucket width
+      uint32_t classes[class_count];
+    };
+
+    Lock lock;
+    unsigned window;
+    Bucket buckets[bucket_count];
+
+  public:
+    ErrorCounters();
+
+    // Clears the counters.
+    void configure(unsigned window);
+    unsigned settings() const;
+    void record(int result, uint64_t now);
+    Counts counts(uint64_t now) const;
+
+    static Class classify(int result);
+    static const char *name(Class error_class);
+    // The text nfc_strerror gives for error.
+    static const char *strerror(int error);
+  };
+
+
+  // An Error with message, carrying the libnfc error as code, its text and class, and the
+  // operation which failed.
+  napi_value MakeNfcError(napi_env env, const char operation[], int error, const std::string &message);
+  napi_value ThrowNfcError(napi_env env, const char operation[], int error, const std::string &message);
+
+  // An Error for a command the card answered with a failure status, carrying the status as code,
+  // 'status' as errorClass and the operation.  Status codes are positive, libnfc errors negative.
+  napi_value ThrowStatusError(napi_env env, const char operation[], int status, const std::string &message);
+
+}
+
+#endif
@@ -0,0 +1,107 @@
+#include "felica.hh"
+#include <algorithm>
+#include <nfc/nfc.h>
+
+
+namespace nfc {
+
+  static const uint8_t read_without_encryption = 0x06;
+  static const uint8_t write_without_encryption = 0x08;
+
+
+  size_t
+  Felica::max_blocks(const uint8_t pmm[8]) {
+    // FeliCa Lite and Lite-S read up to four blocks.
+    if (pmm[1] == 0xf0 || pmm[1] == 0xf1) {
+      return 4;
+    }
+    // Most other cards take up to 15, which also fits the maximum frame size.
+    return 15;
+  }
+
+
+  int
+  Felica::read(Transport &transport, const uint8_t idm[8], const std::vector<uint16_t> &services,
+               const std::vector<Block> &blocks, size_t &max_blocks, std::vector<uint8_t> &data) {
+    data.clear();
+    if (services.empty() || services.size() > max_services) {
+      return NFC_EINVARG;
+    }
+    std::vector<Block>::const_iterator it = blocks.begin();
+    while (it != blocks.end()) {
+      std::vector<Block>::const_iterator end = it + std::min(max_blocks, size_t(blocks.end() - it));
+      int result = read_blocks(transport, idm, services, it, end, data);
+      if (result > 0 && (result & 0xff) == BLOCK_COUNT_ERROR && max_blocks > 1) {
+        // Retry the same blocks in smaller commands.
+        max_blocks = max_blocks > 4 ? 4 : 1;
+        continue;
+      }
+      if (result) {
+        return result;
+      }
+      it = end;
+    }
+    return 0;
+  }
+
+
+  bool
+  Felica::is_write(const std::vector<uint8_t> &frame, uint8_t idm[8]) {
+    if (frame.size() < 10 || frame[1] != write_without_encryption) {
+      return false;
+    }
+    std::copy(frame.begin() + 2, frame.begin() + 10, idm);
+    return true;
+  }
+
+
+  int
+  Felica::read_blocks(Transport &transport, const uint8_t idm[8], const std::vector<uint16_t> &services,
+                      std::vector<Block>::const_iterator begin, std::vector<Block>::const_iterator end,
+                      std::vector<uint8_t> &data) {
+    // LEN, code, IDm, service count, service codes (little endian), block count, block list
+    std::vector<uint8_t> frame(1, 0);
+    frame.push_back(read_without_encryption);
+    frame.insert(frame.end(), idm, idm + 8);
+    frame.push_back(uint8_t(services.size()));
+    for (size_t i = 0; i < services.size(); ++i) {
+      frame.push_back(uint8_t(services[i]));
+      frame.push_back(uint8_t(services[i] >> 8));
+    }
+    frame.push_back(uint8_t(end - begin));
+    for (std::vector<Block>::const_iterator it = begin; it != end; ++it) {
+      if (it->number < 0x100) {
+        // two byte block list element
+        frame.push_back(0x80 | (it->service & 0x0f));
+        frame.push_back(uint8_t(it->number));
+      }
+      else {
+        frame.push_back(it->service & 0x0f);
+        frame.push_back(uint8_t(it->number));
+        frame.push_back(uint8_t(it->number >> 8));
+      }
+    }
+    frame[0] = uint8_t(frame.size());
+
+    std::vector<uint8_t> receive(256);
+    int result = transport.transceive(frame, receive);
+    if (result < 0) {
+      return result;
+    }
+    // LEN, response code, IDm, status flag 1 and 2, block count, block data
+    const size_t header_size = 13;
+    if (receive.size() < header_size - 1 || receive[1] != read_without_encryption + 1) {
+      return NFC_ERFTRANS;
+    }
+    if (receive[10] || receive[11]) {
+      return receive[10] << 8 | receive[11];
+    }
+    size_t size = (end - begin) * block_size;
+    if (receive.size() < header_size + size || receive[12] != end - begin) {
+      return NFC_ERFTRANS;
+    }
+    data.insert(data.end(), receive.begin() + header_size, receive.begin() + header_size + size);
+    return 0;
+  }
+
+}
@@ -0,0 +1,48 @@
+#ifndef NFC_FELICA_HH
+#define NFC_FELICA_HH
+
+#include "transport.hh"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // FeliCa commands on a selected target.
+  //
+  // Operations return a negative libnfc error (NFC_ERFTRANS for malformed responses), the
+  // status flags of the card (flag 1 in the high byte) or 0.
+  class Felica {
+  public:
+    struct Block {
+      uint8_t service;  // index into the service code list
+      uint16_t number;
+    };
+
+    static const size_t block_size = 16;
+    static const size_t max_services = 16;
+
+    // Card status: the number of blocks in a command is not supported.
+    static const int BLOCK_COUNT_ERROR = 0xa2;
+
+    // Returns how many blocks a card reads at most with one command, given its PMm.
+    static size_t max_blocks(const uint8_t pmm[8]);
+
+    // Reads blocks with Read Without Encryption, as many per command as the card allows.
+    // max_blocks is lowered if the card rejects the number of blocks.
+    static int read(Transport &transport, const uint8_t idm[8], const std::vector<uint16_t> &services,
+                    const std::vector<Block> &blocks, size_t &max_blocks, std::vector<uint8_t> &data);
+
+    // Returns whether a raw frame writes to a card, and the IDm of that card.
+    static bool is_write(const std::vector<uint8_t> &frame, uint8_t idm[8]);
+
+  protected:
+    static int read_blocks(Transport &transport, const uint8_t idm[8], const std::vector<uint16_t> &services,
+                           std::vector<Block>::const_iterator begin, std::vector<Block>::const_iterator end,
+                           std::vector<uint8_t> &data);
+  };
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+#include "framing.hh"
+
+
+namespace nfc {
+
+  // CRC-16 with the reflected polynomial x^16 + x^12 + x^5 + 1, shared by both types.
+  static struct CrcTable {
+    uint16_t entries[256];
+
+    CrcTable() {
+      for (unsigned i = 0; i < 256; ++i) {
+        uint16_t crc = uint16_t(i);
+        for (int bit = 0; bit < 8; ++bit) {
+          crc = crc & 1 ? uint16_t((crc >> 1) ^ 0x8408) : uint16_t(crc >> 1);
+        }
+        entries[i] = crc;
+      }
+    }
+  } crc_table;
+
+
+  uint16_t
+  Framing::crc(Crc kind, const uint8_t *data, size_t size) {
+    uint16_t crc = kind == crc_a ? 0x6363 : 0xffff;
+    for (size_t i = 0; i < size; ++i) {
+      crc = uint16_t((crc >> 8) ^ crc_table.entries[(crc ^ data[i]) & 0xff]);
+    }
+    return kind == crc_b ? uint16_t(~crc) : crc;
+  }
+
+
+  void
+  Framing::append_crc(Crc kind, std::vector<uint8_t> &frame) {
+    if (kind == no_crc) {
+      return;
+    }
+    uint16_t value = crc(kind, frame.data(), frame.size());
+    frame.push_back(uint8_t(value));
+    frame.push_back(uint8_t(value >> 8));
+  }
+
+
+  bool
+  Framing::check_crc(Crc kind, std::vector<uint8_t> &frame) {
+    if (kind == no_crc) {
+      return true;
+    }
+    if (frame.size() < 2) {
+      return false;
+    }
+    const size_t size = frame.size() - 2;
+    uint16_t value = crc(kind, frame.data(), size);
+    if (frame[size] != uint8_t(value) || frame[size + 1] != uint8_t(value >> 8)) {
+      return false;
+    }
+    frame.resize(size);
+    return true;
+  }
+
+
+  uint8_t
+  Framing::parity(uint8_t byte) {
+    byte ^= byte >> 4;
+    byte ^= byte >> 2;
+    byte ^= byte >> 1;
+    return uint8_t(~byte & 1);
+  }
+
+
+  std::vector<uint8_t>
+  Framing::parity(const std::vector<uint8_t> &frame) {
+    std::vector<uint8_t> result(frame.size());
+    for (size_t i = 0; i < frame.size(); ++i) {
+      result[i] = parity(frame[i]);
+    }
+    return result;
+  }
+
+
+  bool
+  Framing::check_parity(const std::vector<uint8_t> &frame, const std::vector<uint8_t> &parity, size_t count) {
+    for (size_t i = 0; i < count && i < frame.size() && i < parity.size(); ++i) {
+      if ((parity[i] & 1) != Framing::parity(frame[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+}
@@ -0,0 +1,34 @@
+#ifndef NFC_FRAMING_HH
+#define NFC_FRAMING_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // ISO 14443-3 framing done by the host for raw exchanges: CRC_A and CRC_B (appended low
+  // byte first) and odd parity, one parity bit per byte.
+  class Framing {
+  public:
+    enum Crc {
+      no_crc,
+      crc_a,  // initial value 0x6363
+      crc_b   // initial value 0xffff, complemented
+    };
+
+    static uint16_t crc(Crc kind, const uint8_t *data, size_t size);
+    static void append_crc(Crc kind, std::vector<uint8_t> &frame);
+    // Removes the CRC if it matches.
+    static bool check_crc(Crc kind, std::vector<uint8_t> &frame);
+
+    static uint8_t parity(uint8_t byte);
+    static std::vector<uint8_t> parity(const std::vector<uint8_t> &frame);
+    // Checks the parity bits of the first count bytes.
+    static bool check_parity(const std::vector<uint8_t> &frame, const std::vector<uint8_t> &parity, size_t count);
+  };
+
+}
+
+#endif
@@ -0,0 +1,337 @@
+#include "pool.hh"
+#include <algorithm>
+
+
+namespace nfc {
+
+  static uint64_t
+  now_ms() {
+    return uv_hrtime() / 1000000;
+  }
+
+
+  RawDevice::RawDevice(nfc_device *device)
+    : RawObject(device)
+  {
+  }
+
+
+  void
+  RawDevice::destroy(nfc_device *device) {
+    nfc_close(device);
+  }
+
+
+  Slot::Slot(const std::string &connstring_, nfc_device *device_)
+    : connstring(connstring_), device(device_), name(device_ ? nfc_device_get_name(device_) : "")
+    , capabilities(device_ ? Capabilities(device_) : Capabilities())
+    , busy(false), owner(0), configured(0), failed(false), users(0), generation(0), failures(0), reconnects(0), last_error(NFC_SUCCESS)
+    , backoff(0), retry_at(0), idle_since(0)
+  {
+  }
+
+
+  RawSlot::RawSlot(Slot *slot)
+    : RawObject(slot)
+  {
+  }
+
+
+  void
+  RawSlot::destroy(Slot *slot) {
+    delete slot;
+  }
+
+
+  RawPool::RawPool(DevicePool *pool)
+    : RawObject(pool)
+  {
+  }
+
+
+  void
+  RawPool::destroy(DevicePool *pool) {
+    delete pool;
+  }
+
+
+  DevicePool::Options::Options()
+    : min_backoff(100), max_backoff(10000), keep_alive(0)
+  {
+  }
+
+
+  DevicePool::DevicePool(RawContext context_)
+    : context(context_), running(false)
+  {
+  }
+
+
+  DevicePool::~DevicePool() {
+    if (running) {
+      stop.set();
+      wake.set();
+      uv_thread_join(&thread);
+    }
+  }
+
+
+  void
+  DevicePool::configure(const Options &options_) {
+    {
+      WrLock lk(lock);
+      options = options_;
+      options.min_backoff = std::max(options.min_backoff, 1u);
+      options.max_backoff = std::max(options.max_backoff, options.min_backoff);
+    }
+    wake.set();
+  }
+
+
+  DevicePool::Options
+  DevicePool::settings() const {
+    RdLock lk(lock);
+    return options;
+  }
+
+
+  std::vector<DevicePool::Status>
+  DevicePool::status() const {
+    RdLock lk(lock);
+    std::vector<Status> result;
+    for (std::vector<RawSlot>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+      const Slot &slot = *it->get();
+      RdLock lk_slot(slot.state_lock);
+      Status status;
+      status.connstring = slot.connstring;
+      status.state = slot.failed ? "failed" : (slot.users ? "ready" : "idle");
+      status.users = slot.users;
+      status.failures = slot.failures;
+      status.reconnects = slot.reconnects;
+      status.last_error = slot.last_error;
+      result.push_back(status);
+    }
+    return result;
+  }
+
+
+  RawSlot
+  DevicePool::acquire(const std::string &connstring) {
+    {
+      WrLock lk(lock);
+      for (std::vector<RawSlot>::iterator it = slots.begin(); it != slots.end(); ++it) {
+        Slot &slot = *it->get();
+        // Without connstring libnfc would open the first device, any open one will do.
+        if (connstring.empty() || slot.connstring == connstring) {
+          WrLock lk_slot(slot.state_lock);
+          ++slot.users;
+          slot.idle_since = 0;
+          return *it;
+        }
+      }
+    }
+
+    nfc_context *context = this->context.get();
+    if (!context) {
+      return RawSlot();
+    }
+    nfc_device *device = nfc_open(context, connstring.length() ? connstring.c_str() : NULL);
+    if (!device) {
+      return RawSlot();
+    }
+    // Consider all devices initiator.
+    if (nfc_initiator_init(device) < 0) {
+      nfc_close(device);
+      return RawSlot();
+    }
+    RawSlot slot(new Slot(nfc_device_get_connstring(device), device));
+    slot.get()->users = 1;
+    WrLock lk(lock);
+    slots.push_back(slot);
+    return slot;
+  }
+
+
+  void
+  DevicePool::release(RawSlot slot_) {
+    Slot *slot = slot_.get();
+    if (!slot) {
+      return;
+    }
+    unsigned keep_alive = settings().keep_alive;
+    {
+      WrLock lk_slot(slot->state_lock);
+      if (!slot->users || --slot->users) {
+        return;
+      }
+      slot->idle_since = now_ms();
+    }
+    if (keep_alive) {
+      // The background thread closes the handle unless it is reused in time.
+      start();
+      wake.set();
+      return;
+    }
+    if (remove(slot_, now_ms())) {
+      WrLock lk_io(slot->io_lock);
+      slot->device.dismiss();
+    }
+  }
+
+
+  void
+  DevicePool::fail(RawSlot slot_, int error) {
+    Slot *slot = slot_.get();
+    if (!slot) {
+      return;
+    }
+    {
+      WrLock lk_slot(slot->state_lock);
+      ++slot->failures;
+      slot->last_error = error;
+      if (slot->failed) {
+        return;
+      }
+      slot->failed = true;
+      slot->backoff = 0;
+      slot->retry_at = now_ms();
+    }
+    start();
+    wake.set();
+  }
+
+
+  bool
+  DevicePool::is_failure(int error) {
+    switch (error) {
+    case NFC_EIO:
+    case NFC_ENOTSUCHDEV:
+      return true;
+    }
+    return false;
+  }
+
+
+  void
+  DevicePool::start() {
+    WrLock lk(lock);
+    if (!running && !uv_thread_create(&thread, Run, this)) {
+      running = true;
+    }
+  }
+
+
+  void
+  DevicePool::Run(void *arg) {
+    static_cast<DevicePool *>(arg)->run();
+  }
+
+
+  void
+  DevicePool::run() {
+    const uint64_t max_wait = 1000;
+    while (!stop.is_set()) {
+      uint64_t now = now_ms();
+      uint64_t next = now + max_wait;
+      std::vector<RawSlot> due, expired;
+      uint64_t keep_alive;
+      {
+        RdLock lk(lock);
+        keep_alive = options.keep_alive;
+        for (std::vector<RawSlot>::iterator it = slots.begin(); it != slots.end(); ++it) {
+          Slot &slot = *it->get();
+          RdLock lk_slot(slot.state_lock);
+          if (slot.failed) {
+            if (slot.retry_at <= now) {
+              due.push_back(*it);
+            }
+            else {
+              next = std::min(next, slot.retry_at);
+            }
+          }
+          else if (!slot.users && slot.idle_since) {
+            uint64_t expiry = slot.idle_since + keep_alive;
+            if (expiry <= now) {
+              expired.push_back(*it);
+            }
+            else {
+              next = std::min(next, expiry);
+            }
+          }
+        }
+      }
+
+      for (std::vector<RawSlot>::iterator it = due.begin(); it != due.end(); ++it) {
+        reconnect(*it->get());
+      }
+      for (std::vector<RawSlot>::iterator it = expired.begin(); it != expired.end(); ++it) {
+        // Unless reused in the meantime.
+        if (remove(*it, now - keep_alive)) {
+          Slot &slot = *it->get();
+          WrLock lk_io(slot.io_lock);
+          slot.device.dismiss();
+        }
+      }
+
+      if (!due.empty()) {
+        // Reconnect attempts have set new retry times.
+        continue;
+      }
+      now = now_ms();
+      wake.wait(next > now ? next - now : 0);
+      wake.reset();
+    }
+  }
+
+
+  void
+  DevicePool::reconnect(Slot &slot) {
+    Options options = settings();
+    // Wait for commands still using the old handle.
+    WrLock lk_io(slot.io_lock);
+    slot.device.dismiss();
+
+    nfc_context *context = this->context.get();
+    nfc_device *device = context ? nfc_open(context, slot.connstring.c_str()) : NULL;
+    if (device && nfc_initiator_init(device) < 0) {
+      nfc_close(device);
+      device = NULL;
+    }
+    const Capabilities capabilities = device ? Capabilities(device) : Capabilities();
+
+    WrLock lk_slot(slot.state_lock);
+    if (!device) {
+      slot.backoff = slot.backoff ? std::min(slot.backoff * 2, options.max_backoff) : options.min_backoff;
+      slot.retry_at = now_ms() + slot.backoff;
+      return;
+    }
+    slot.device.reset(device);
+    slot.name = nfc_device_get_name(device);
+    slot.capabilities = capabilities;
+    slot.failed = false;
+    slot.backoff = 0;
+    slot.configured = 0;
+    ++slot.generation;
+    ++slot.reconnects;
+  }
+
+
+  bool
+  DevicePool::remove(const RawSlot &slot, uint64_t idle_since) {
+    WrLock lk(lock);
+    for (std::vector<RawSlot>::iterator it = slots.begin(); it != slots.end(); ++it) {
+      if (it->get() == slot.get()) {
+        {
+          RdLock lk_slot(slot.get()->state_lock);
+          if (slot.get()->users || !slot.get()->idle_since || slot.get()->idle_since > idle_since) {
+            return false;
+          }
+        }
+        slots.erase(it);
+        return true;
+      }
+    }
+    return false;
+  }
+
+}
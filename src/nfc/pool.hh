@@ -0,0 +1,126 @@
+#ifndef NFC_POOL_HH
+#define NFC_POOL_HH
+
+#include "cache.hh"
+#include "capabilities.hh"
+#include "context.hh"
+#include "errors.hh"
+#include "util.hh"
+#include <nfc/nfc.h>
+#include <string>
+#include <vector>
+
+
+namespace nfc {
+
+  class RawDevice:
+    public RawObject<RawDevice, nfc_device>
+  {
+  public:
+    RawDevice(nfc_device *device = NULL);
+
+    static void destroy(nfc_device *device);
+  };
+
+
+  // An open device handle, shared by all Device objects on the same connstring.
+  struct Slot {
+    const std::string connstring;
+    RawDevice device;
+    ErrorCounters errors;  // outcomes of the libnfc calls, kept across reconnects
+    ContentCache cache;    // card contents read through the handle, whichever Device read or wrote them
+
+    // Commands are serialized on io_lock, state_lock guards the fields below it.
+    Lock io_lock;
+    Lock state_lock;
+    std::string name;
+    Capabilities capabilities;
+    bool busy;
+    unsigned owner;       // Device::id of the running command
+    unsigned configured;  // Device::id whose properties are on the handle, 0 while it has the defaults
+    bool failed;
+    unsigned users;
+    unsigned generation;  // bumped whenever the handle is replaced
+    unsigned failures;
+    unsigned reconnects;
+    int last_error;
+    unsigned backoff;
+    uint64_t retry_at;
+    uint64_t idle_since;
+
+    Slot(const std::string &connstring = "", nfc_device *device = NULL);
+  };
+
+
+  class RawSlot:
+    public RawObject<RawSlot, Slot>
+  {
+  public:
+    RawSlot(Slot *slot = NULL);
+
+    static void destroy(Slot *slot);
+  };
+
+
+  // Keeps device handles by connstring, so a device opened again gets the handle which
+  // is already initialized, and reopens failed devices in the background.  All times
+  // are in ms.
+  class DevicePool {
+  public:
+    struct Options {
+      unsigned min_backoff;
+      unsigned max_backoff;
+      unsigned keep_alive;  // keep unused handles open for this long
+
+      Options();
+    };
+
+    struct Status {
+      std::string connstring;
+      std::string state;
+      unsigned users;
+      unsigned failures;
+      unsigned reconnects;
+      int last_error;
+    };
+
+  protected:
+    RawContext context;
+
+    Lock lock;
+    Options options;
+    std::vector<RawSlot> slots;
+
+    Event wake;
+    Event stop;
+    uv_thread_t thread;
+    bool running;
+
+  public:
+    DevicePool(RawContext context);
+    ~DevicePool();
+
+    void configure(const Options &options);
+    Options settings() const;
+    std::vector<Status> status() const;
+
+    RawSlot acquire(const std::string &connstring);
+    void release(RawSlot slot);
+    // Called with the slot's io_lock held, after a command on it failed.
+    void fail(RawSlot slot, int error);
+
+    static bool is_failure(int error);
+
+  protected:
+    void start();
+    static void Run(void *arg);
+    void run();
+    void reconnect(Slot &slot);
+    // Removes the slot if it has been unused since before idle_since, deciding under lock so
+    // that acquire can't take it up in the meantime.  Returns whether it was removed.
+    bool remove(const RawSlot &slot, uint64_t idle_since);
+  };
+
+}
+
+#endif
@@ -0,0 +1,160 @@
+#include "property.hh"
+
+
+namespace nfc {
+
+  static const PropertySet::Info properties[] = {
+    {"timeoutCommand", NP_TIMEOUT_COMMAND, false},
+    {"timeoutAtr", NP_TIMEOUT_ATR, false},
+    {"timeoutCom", NP_TIMEOUT_COM, false},
+    {"handleCrc", NP_HANDLE_CRC, true},
+    {"handleParity", NP_HANDLE_PARITY, true},
+    {"activateField", NP_ACTIVATE_FIELD, true},
+    {"activateCrypto1", NP_ACTIVATE_CRYPTO1, true},
+    {"infiniteSelect", NP_INFINITE_SELECT, true},
+    {"acceptInvalidFrames", NP_ACCEPT_INVALID_FRAMES, true},
+    {"acceptMultipleFrames", NP_ACCEPT_MULTIPLE_FRAMES, true},
+    {"autoIso14443_4", NP_AUTO_ISO14443_4, true},
+    {"easyFraming", NP_EASY_FRAMING, true},
+    {"forceIso14443a", NP_FORCE_ISO14443_A, true},
+    {"forceIso14443b", NP_FORCE_ISO14443_B, true},
+    {"forceSpeed106", NP_FORCE_SPEED_106, true}
+  };
+
+
+  // Same settings as nfc_initiator_init applies.
+  static const PropertySet::Setting default_settings[] = {
+    {NP_ACTIVATE_FIELD, true},
+    {NP_ACTIVATE_CRYPTO1, false},
+    {NP_INFINITE_SELECT, true},
+    {NP_ACCEPT_INVALID_FRAMES, false},
+    {NP_ACCEPT_MULTIPLE_FRAMES, false},
+    {NP_AUTO_ISO14443_4, true},
+    {NP_EASY_FRAMING, true},
+    {NP_HANDLE_CRC, true},
+    {NP_HANDLE_PARITY, true},
+    {NP_FORCE_ISO14443_A, true},
+    {NP_FORCE_SPEED_106, true}
+  };
+
+
+  // Return from selection right away when the field is empty and give up early on
+  // unresponsive cards, so a poll cycle stays short.
+  static const PropertySet::Setting fast_poll_settings[] = {
+    {NP_ACTIVATE_FIELD, true},
+    {NP_INFINITE_SELECT, false},
+    {NP_AUTO_ISO14443_4, true},
+    {NP_EASY_FRAMING, true},
+    {NP_TIMEOUT_ATR, 50},
+    {NP_TIMEOUT_COMMAND, 150}
+  };
+
+
+  // Let the chip handle framing and allow for long responses of large reads and writes.
+  static const PropertySet::Setting bulk_transfer_settings[] = {
+    {NP_ACTIVATE_FIELD, true},
+    {NP_AUTO_ISO14443_4, true},
+    {NP_EASY_FRAMING, true},
+    {NP_HANDLE_CRC, true},
+    {NP_HANDLE_PARITY, true},
+    {NP_TIMEOUT_COMMAND, 1000}
+  };
+
+
+#define NFC_PRESET(name, settings) {name, settings, sizeof(settings) / sizeof(settings[0])}
+
+  static const PropertySet::Preset presets[] = {
+    NFC_PRESET("default", default_settings),
+    NFC_PRESET("fast-poll", fast_poll_settings),
+    NFC_PRESET("bulk-transfer", bulk_transfer_settings)
+  };
+
+#undef NFC_PRESET
+
+
+  const PropertySet::Info *
+  PropertySet::find(const std::string &name) {
+    for (size_t i = 0; i < sizeof(properties) / sizeof(properties[0]); ++i) {
+      if (name == properties[i].name) {
+        return &properties[i];
+      }
+    }
+    return NULL;
+  }
+
+
+  const PropertySet::Info *
+  PropertySet::find(nfc_property property) {
+    for (size_t i = 0; i < sizeof(properties) / sizeof(properties[0]); ++i) {
+      if (property == properties[i].property) {
+        return &properties[i];
+      }
+    }
+    return NULL;
+  }
+
+
+  const PropertySet::Preset *
+  PropertySet::find_preset(const std::string &name) {
+    for (size_t i = 0; i < sizeof(presets) / sizeof(presets[0]); ++i) {
+      if (name == presets[i].name) {
+        return &presets[i];
+      }
+    }
+    return NULL;
+  }
+
+
+  PropertySet::values_t
+  PropertySet::defaults() {
+    values_t result;
+    for (size_t i = 0; i < sizeof(default_settings) / sizeof(default_settings[0]); ++i) {
+      result[default_settings[i].property] = default_settings[i].value;
+    }
+    return result;
+  }
+
+
+  void
+  PropertySet::set(nfc_property property, int value) {
+    WrLock lk(lock);
+    tracked[property] = value;
+    // Single changes no longer match a preset.
+    preset_name.clear();
+  }
+
+
+  bool
+  PropertySet::get(nfc_property property, int &value) const {
+    RdLock lk(lock);
+    values_t::const_iterator it = tracked.find(property);
+    if (it == tracked.end()) {
+      return false;
+    }
+    value = it->second;
+    return true;
+  }
+
+
+  PropertySet::values_t
+  PropertySet::values() const {
+    RdLock lk(lock);
+    return tracked;
+  }
+
+
+  std::string
+  PropertySet::preset() const {
+    RdLock lk(lock);
+    return preset_name;
+  }
+
+
+  void
+  PropertySet::assign(const values_t &values, const std::string &preset) {
+    WrLock lk(lock);
+    tracked = values;
+    preset_name = preset;
+  }
+
+}
@@ -0,0 +1,58 @@
+#ifndef NFC_PROPERTY_HH
+#define NFC_PROPERTY_HH
+
+#include "util.hh"
+#include <map>
+#include <nfc/nfc.h>
+#include <string>
+
+
+namespace nfc {
+
+  // Keeps track of the libnfc properties applied to a device, so they can be reported
+  // (libnfc has no getters) and applied again after errors.
+  class PropertySet {
+  public:
+    typedef std::map<nfc_property, int> values_t;
+
+    struct Info {
+      const char *name;
+      nfc_property property;
+      bool is_bool;
+    };
+
+    struct Setting {
+      nfc_property property;
+      int value;
+    };
+
+    struct Preset {
+      const char *name;
+      const Setting *settings;
+      size_t count;
+    };
+
+  protected:
+    Lock lock;
+    values_t tracked;
+    std::string preset_name;
+
+  public:
+    static const Info *find(const std::string &name);
+    static const Info *find(nfc_property property);
+    static const Preset *find_preset(const std::string &name);
+    // Values nfc_initiator_init gives the properties, it leaves the timeouts to the driver.
+    static values_t defaults();
+
+    void set(nfc_property property, int value);
+    bool get(nfc_property property, int &value) const;
+
+    values_t values() const;
+    std::string preset() const;
+
+    void assign(const values_t &values, const std::string &preset);
+  };
+
+}
+
+#endif
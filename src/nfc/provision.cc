@@ -0,0 +1,343 @@
+#include "provision.hh"
+#include <algorithm>
+#include <cstdio>
+#include <uv.h>
+
+
+namespace nfc {
+
+  static const uint8_t read_command = 0x30;   // four pages
+  static const uint8_t write_command = 0xa2;  // one page
+  static const size_t read_size = 16;
+  static const size_t max_pages = 256;
+
+  static const struct {
+    const char *name;
+    Provisioner::Field::Kind kind;
+  } field_kinds[] = {
+    {"serial", Provisioner::Field::serial},
+    {"serialDecimal", Provisioner::Field::serial_decimal},
+    {"uid", Provisioner::Field::uid},
+    {"uidHex", Provisioner::Field::uid_hex},
+  };
+
+
+  static uint64_t
+  Now() {
+    return uv_hrtime() / 1000000;
+  }
+
+
+  Provisioner::Template::Template()
+    : start_page(4), first_serial(1)
+  {
+  }
+
+
+  bool
+  Provisioner::Template::valid() const {
+    if (image.empty() || image.size() % page_size || start_page + image.size() / page_size > max_pages ||
+        blank.size() > read_size) {
+      return false;
+    }
+    for (std::vector<Field>::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+      if (it->offset > image.size() || it->length > image.size() - it->offset) {
+        return false;
+      }
+    }
+    for (std::vector<Page>::const_iterator it = config.begin(); it != config.end(); ++it) {
+      if (it->data.size() != page_size) {
+        return false;
+      }
+    }
+    for (std::vector<Page>::const_iterator it = lock.begin(); it != lock.end(); ++it) {
+      if (it->data.size() != page_size) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+
+  Provisioner::Result::Result()
+    : status(none), serial(0), step(NULL), error(0), time(0)
+  {
+  }
+
+
+  Provisioner::Stats::Stats()
+    : provisioned(0), skipped(0), failed(0), pages(0), busy_time(0), first(0), last(0), next_serial(1)
+  {
+  }
+
+
+  double
+  Provisioner::Stats::mean_time() const {
+    uint64_t tags = provisioned + failed;
+    return tags ? double(busy_time) / tags : 0;
+  }
+
+
+  double
+  Provisioner::Stats::tags_per_hour() const {
+    return last > first ? provisioned * 3600000.0 / (last - first) : 0;
+  }
+
+
+  void
+  Provisioner::configure(const Template &tpl) {
+    WrLock lk(lock);
+    current_template = tpl;
+    current = Stats();
+    current.next_serial = tpl.first_serial;
+  }
+
+
+  Provisioner::Stats
+  Provisioner::stats() const {
+    RdLock lk(lock);
+    return current;
+  }
+
+
+  bool
+  Provisioner::is_type2(const nfc_target &target) {
+    return target.nm.nmt == NMT_ISO14443A && target.nti.nai.btSak == 0x00;
+  }
+
+
+  void
+  Provisioner::run(Transport &transport, const nfc_target &target, Result &result) {
+    const uint64_t start = Now();
+    Template tpl;
+    {
+      WrLock lk(lock);
+      tpl = current_template;
+      result.serial = current.next_serial;
+      if (!current.first) {
+        current.first = start;
+      }
+    }
+
+    // Tags which are locked, or do not carry the blank pattern, have been written before.
+    std::vector<uint8_t> data;
+    result.step = "read";
+    result.error = read(transport, 0, data);
+    bool blank = !result.error && !data[10] && !data[11];
+    if (blank && !tpl.blank.empty()) {
+      result.error = read(transport, tpl.start_page, data);
+      blank = !result.error && std::equal(tpl.blank.begin(), tpl.blank.end(), data.begin());
+    }
+
+    unsigned pages = 0;
+    if (blank) {
+      const std::vector<uint8_t> image = Provisioner::image(tpl, target, result.serial);
+      result.step = "write";
+      for (size_t offset = 0; !result.error && offset < image.size(); offset += page_size) {
+        result.error = write(transport, uint8_t(tpl.start_page + offset / page_size), &image[offset]);
+        pages += !result.error;
+      }
+      result.step = "verify";
+      bool verified = !result.error;
+      for (size_t offset = 0; verified && offset < image.size(); offset += read_size) {
+        result.error = read(transport, uint8_t(tpl.start_page + offset / page_size), data);
+        const size_t length = std::min(read_size, image.size() - offset);
+        verified = !result.error && std::equal(data.begin(), data.begin() + length, image.begin() + offset);
+      }
+      if (verified) {
+        result.step = "config";
+        result.error = write(transport, tpl.config, pages);
+      }
+      if (verified && !result.error) {
+        result.step = "lock";
+        result.error = write(transport, tpl.lock, pages);
+      }
+      result.status = verified && !result.error ? provisioned : failed;
+    }
+    else {
+      result.status = result.error ? failed : skipped;
+    }
+    if (result.status != failed) {
+      result.step = NULL;
+    }
+    const uint64_t end = Now();
+    result.time = unsigned(end - start);
+
+    WrLock lk(lock);
+    current.pages += pages;
+    switch (result.status) {
+    case provisioned:
+      // Serials of failed tags are used again.
+      ++current.provisioned;
+      ++current.next_serial;
+      current.busy_time += result.time;
+      current.last = end;
+      break;
+    case failed:
+      ++current.failed;
+      current.busy_time += result.time;
+      break;
+    default:
+      ++current.skipped;
+      break;
+    }
+  }
+
+
+  int
+  Provisioner::read(Transport &transport, uint8_t page, std::vector<uint8_t> &data) {
+    const uint8_t command[] = {read_command, page};
+    const std::vector<uint8_t> transmit(command, command + sizeof(command));
+    data.resize(read_size);
+    int result = transport.transceive(transmit, data);
+    if (result >= 0 && data.size() < read_size) {
+      return NFC_ERFTRANS;
+    }
+    return std::min(result, 0);
+  }
+
+
+  int
+  Provisioner::write(Transport &transport, uint8_t page, const uint8_t data[page_size]) {
+    const uint8_t command[] = {write_command, page};
+    std::vector<uint8_t> transmit(command, command + sizeof(command));
+    transmit.insert(transmit.end(), data, data + page_size);
+    // The tag acknowledges with 4 bits, which libnfc does not hand on.
+    std::vector<uint8_t> receive(read_size);
+    return std::min(transport.transceive(transmit, receive), 0);
+  }
+
+
+  int
+  Provisioner::write(Transport &transport, const std::vector<Page> &pages, unsigned &written) {
+    for (std::vector<Page>::const_iterator it = pages.begin(); it != pages.end(); ++it) {
+      int result = write(transport, it->page, it->data.data());
+      if (result < 0) {
+        return result;
+      }
+      ++written;
+    }
+    return 0;
+  }
+
+
+  std::vector<uint8_t>
+  Provisioner::image(const Template &tpl, const nfc_target &target, uint64_t serial) {
+    std::vector<uint8_t> result(tpl.image);
+    const nfc_iso14443a_info &info = target.nti.nai;
+    for (std::vector<Field>::const_iterator it = tpl.fields.begin(); it != tpl.fields.end(); ++it) {
+      uint8_t *field = &result[it->offset];
+      std::vector<uint8_t> value;
+      switch (it->kind) {
+      case Field::serial:
+        for (size_t i = 0; i < it->length; ++i) {
+          value.insert(value.begin(), i < 8 ? uint8_t(serial >> (8 * i)) : 0);
+        }
+        break;
+      case Field::serial_decimal: {
+        // The lowest digits if the field is too short.
+        char digits[21];
+        std::snprintf(digits, sizeof(digits), "%020llu", (unsigned long long)serial);
+        const size_t length = std::min(it->length, sizeof(digits) - 1);
+        value.assign(it->length - length, '0');
+        value.insert(value.end(), digits + sizeof(digits) - 1 - length, digits + sizeof(digits) - 1);
+        break;
+      }
+      case Field::uid:
+        value.assign(info.abtUid, info.abtUid + info.szUidLen);
+        break;
+      case Field::uid_hex:
+        for (size_t i = 0; i < info.szUidLen; ++i) {
+          static const char hex[] = "0123456789ABCDEF";
+          value.push_back(hex[info.abtUid[i] >> 4]);
+          value.push_back(hex[info.abtUid[i] & 0x0f]);
+        }
+        break;
+      }
+      value.resize(it->length);
+      std::copy(value.begin(), value.end(), field);
+    }
+    return result;
+  }
+
+
+  static std::vector<Provisioner::Page>
+  PagesFromJS(napi_env env, napi_value value) {
+    std::vector<Provisioner::Page> result;
+    uint32_t length = 0;
+    if (value) {
+      napi_get_array_length(env, value, &length);
+    }
+    for (uint32_t i = 0; i < length; ++i) {
+      napi_value element;
+      napi_get_element(env, value, i, &element);
+      Provisioner::Page page;
+      page.page = GetOption<uint8_t>(env, element, "page", 0);
+      page.data = GetOption(env, element, "data", std::vector<uint8_t>());
+      result.push_back(page);
+    }
+    return result;
+  }
+
+
+  Provisioner::Template
+  Convert<Provisioner::Template>::fromJS(napi_env env, napi_value value) {
+    Provisioner::Template tpl;
+    tpl.start_page = GetOption(env, value, "startPage", tpl.start_page);
+    tpl.image = GetOption(env, value, "image", tpl.image);
+    // Pad with zeros to whole pages.
+    tpl.image.resize((tpl.image.size() + Provisioner::page_size - 1) / Provisioner::page_size * Provisioner::page_size);
+    tpl.blank = GetOption(env, value, "blank", tpl.blank);
+    tpl.first_serial = uint64_t(GetOption(env, value, "firstSerial", double(tpl.first_serial)));
+
+    napi_value fields = GetOption(env, value, "fields");
+    uint32_t length = 0;
+    if (fields) {
+      napi_get_array_length(env, fields, &length);
+    }
+    for (uint32_t i = 0; i < length; ++i) {
+      napi_value element;
+      napi_get_element(env, fields, i, &element);
+      Provisioner::Field field;
+      field.kind = Provisioner::Field::serial;
+      const std::string type = GetOption<std::string>(env, element, "type", "serial");
+      bool known = false;
+      for (size_t k = 0; k < sizeof(field_kinds) / sizeof(field_kinds[0]); ++k) {
+        if (type == field_kinds[k].name) {
+          field.kind = field_kinds[k].kind;
+          known = true;
+        }
+      }
+      field.offset = GetOption<uint32_t>(env, element, "offset", 0);
+      field.length = GetOption<uint32_t>(env, element, "length", 0);
+      if (!known) {
+        // Fails validation.
+        field.offset = tpl.image.size() + 1;
+      }
+      tpl.fields.push_back(field);
+    }
+
+    tpl.config = PagesFromJS(env, GetOption(env, value, "config"));
+    tpl.lock = PagesFromJS(env, GetOption(env, value, "lock"));
+    return tpl;
+  }
+
+
+  napi_value
+  Convert<Provisioner::Result>::toJS(napi_env env, const Provisioner::Result &value) {
+    static const char *const statuses[] = {"none", "provisioned", "skipped", "failed"};
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "status", nfc::toJS(env, std::string(statuses[value.status])));
+    if (value.status != Provisioner::skipped) {
+      napi_set_named_property(env, result, "serial", nfc::toJS(env, double(value.serial)));
+    }
+    if (value.step) {
+      napi_set_named_property(env, result, "step", nfc::toJS(env, std::string(value.step)));
+      napi_set_named_property(env, result, "error", nfc::toJS(env, value.error));
+    }
+    napi_set_named_property(env, result, "time", nfc::toJS(env, value.time));
+    return result;
+  }
+
+}
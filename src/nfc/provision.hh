@@ -0,0 +1,122 @@
+#ifndef NFC_PROVISION_HH
+#define NFC_PROVISION_HH
+
+#include "transport.hh"
+#include "util.hh"
+#include <nfc/nfc.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // Writes a template image to blank NFC Forum Type 2 tags (NTAG, Ultralight) as the poller
+  // selects them, all within the job that found the tag: per-tag fields are filled in, the
+  // pages are written and read back, then configuration and lock pages are written.
+  class Provisioner {
+  public:
+    static const size_t page_size = 4;
+
+    // Filled in per tag.
+    struct Field {
+      enum Kind {
+        serial,          // big endian
+        serial_decimal,  // ASCII digits, zero padded
+        uid,
+        uid_hex          // ASCII, upper case
+      };
+
+      Kind kind;
+      size_t offset;  // in the image
+      size_t length;
+    };
+
+    struct Page {
+      uint8_t page;
+      std::vector<uint8_t> data;  // one page
+    };
+
+    struct Template {
+      uint8_t start_page;
+      std::vector<uint8_t> image;  // padded to whole pages
+      std::vector<Field> fields;
+      std::vector<uint8_t> blank;  // found at start_page on blank tags, empty for any
+      std::vector<Page> config;    // written after the image, not read back (e.g. passwords)
+      std::vector<Page> lock;      // written last, once the image is verified
+      uint64_t first_serial;
+
+      Template();
+
+      bool valid() const;
+    };
+
+    enum Status {
+      none,         // not a Type 2 tag, or provisioning is off
+      provisioned,
+      skipped,      // not blank
+      failed
+    };
+
+    struct Result {
+      Status status;
+      uint64_t serial;
+      const char *step;  // where it failed
+      int error;         // libnfc error, 0 if the read back data differs
+      unsigned time;     // ms
+
+      Result();
+    };
+
+    struct Stats {
+      uint64_t provisioned;
+      uint64_t skipped;
+      uint64_t failed;
+      uint64_t pages;      // written
+      uint64_t busy_time;  // ms spent on tags
+      uint64_t first;      // ms when the first tag was started, 0 before
+      uint64_t last;       // ms when the last tag was done
+      uint64_t next_serial;
+
+      Stats();
+
+      double mean_time() const;
+      double tags_per_hour() const;
+    };
+
+  protected:
+    Lock lock;
+    Template current_template;
+    Stats current;
+
+  public:
+    void configure(const Template &tpl);
+    Stats stats() const;
+
+    static bool is_type2(const nfc_target &target);
+
+    // Provisions the selected target, which must be a Type 2 tag.
+    void run(Transport &transport, const nfc_target &target, Result &result);
+
+  protected:
+    static int read(Transport &transport, uint8_t page, std::vector<uint8_t> &data);
+    static int write(Transport &transport, uint8_t page, const uint8_t data[page_size]);
+    static int write(Transport &transport, const std::vector<Page> &pages, unsigned &written);
+    static std::vector<uint8_t> image(const Template &tpl, const nfc_target &target, uint64_t serial);
+  };
+
+
+  template<>
+  struct Convert<Provisioner::Template> {
+    static Provisioner::Template fromJS(napi_env env, napi_value value);
+  };
+
+
+  template<>
+  struct Convert<Provisioner::Result> {
+    static napi_value toJS(napi_env env, const Provisioner::Result &value);
+  };
+
+}
+
+#endif
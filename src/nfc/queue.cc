@@ -0,0 +1,199 @@
+#include "queue.hh"
+#include "errors.hh"
+#include "target.hh"
+#include <algorithm>
+
+
+namespace nfc {
+
+  TagQueue::Stats::Stats()
+    : queued(0), events(0), batches(0), max_batch(0)
+  {
+  }
+
+
+  TagQueue::TagQueue()
+    : high_water_mark(0), flowing(false), signalled(false), wakeup(NULL), channel(NULL)
+  {
+  }
+
+
+  bool
+  TagQueue::open(napi_env env, napi_value callback, size_t high_water_mark_) {
+    napi_value resource_name;
+    napi_create_string_utf8(env, "nfc:tags", NAPI_AUTO_LENGTH, &resource_name);
+    Channel *channel = new Channel();
+    channel->queue = this;
+    napi_threadsafe_function tsfn;
+    if (napi_create_threadsafe_function(env, callback, NULL, resource_name, 0, 1, channel, Finalize,
+                                        channel, Deliver, &tsfn) != napi_ok) {
+      delete channel;
+      return false;
+    }
+    WrLock lk(lock);
+    this->channel = channel;
+    events.clear();
+    high_water_mark = std::max(high_water_mark_, size_t(1));
+    flowing = true;
+    signalled = false;
+    current = Stats();
+    space.set();
+    wakeup = tsfn;
+    return true;
+  }
+
+
+  void
+  TagQueue::close() {
+    napi_threadsafe_function tsfn;
+    {
+      WrLock lk(lock);
+      tsfn = wakeup;
+      wakeup = NULL;
+      if (channel) {
+        // Pending wakeups still deliver the remaining events, without touching the queue.
+        channel->queue = NULL;
+        channel->remaining.insert(channel->remaining.end(), events.begin(), events.end());
+        events.clear();
+        channel = NULL;
+      }
+      // Let a producer waiting for space go on.
+      space.set();
+    }
+    if (tsfn) {
+      napi_release_threadsafe_function(tsfn, napi_tsfn_release);
+    }
+  }
+
+
+  void
+  TagQueue::push(const TagEvent &event) {
+    WrLock lk(lock);
+    events.push_back(event);
+    if (events.size() >= high_water_mark) {
+      space.reset();
+    }
+    signal();
+  }
+
+
+  bool
+  TagQueue::full() const {
+    RdLock lk(lock);
+    return wakeup && events.size() >= high_water_mark;
+  }
+
+
+  bool
+  TagQueue::wait_for_space(uint64_t timeout) {
+    return space.wait(timeout);
+  }
+
+
+  std::vector<TagEvent>
+  TagQueue::drain() {
+    WrLock lk(lock);
+    std::vector<TagEvent> batch(events.begin(), events.end());
+    events.clear();
+    signalled = false;
+    space.set();
+    if (!batch.empty()) {
+      current.events += batch.size();
+      ++current.batches;
+      current.max_batch = std::max(current.max_batch, batch.size());
+    }
+    return batch;
+  }
+
+
+  void
+  TagQueue::pause() {
+    WrLock lk(lock);
+    flowing = false;
+  }
+
+
+  void
+  TagQueue::resume() {
+    WrLock lk(lock);
+    flowing = true;
+    signal();
+  }
+
+
+  void
+  TagQueue::interrupt() {
+    space.set();
+  }
+
+
+  TagQueue::Stats
+  TagQueue::stats() const {
+    RdLock lk(lock);
+    Stats result = current;
+    result.queued = events.size();
+    return result;
+  }
+
+
+  void
+  TagQueue::signal() {
+    // Called with lock held: one wakeup covers everything queued until it runs.
+    if (!flowing || signalled || !wakeup || events.empty()) {
+      return;
+    }
+    if (napi_call_threadsafe_function(wakeup, NULL, napi_tsfn_nonblocking) == napi_ok) {
+      signalled = true;
+    }
+  }
+
+
+  void
+  TagQueue::Deliver(napi_env env, napi_value callback, void *context, void *data) {
+    if (!env) {
+      return;
+    }
+    Channel *channel = static_cast<Channel *>(context);
+    std::vector<TagEvent> batch;
+    if (channel->queue) {
+      batch = channel->queue->drain();
+    }
+    else {
+      batch.swap(channel->remaining);
+    }
+    if (batch.empty()) {
+      return;
+    }
+    napi_value events;
+    napi_create_array_with_length(env, batch.size(), &events);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      const TagEvent &event = batch[i];
+      napi_value entry;
+      napi_create_object(env, &entry);
+      napi_set_named_property(env, entry, "type", toJS(env, std::string(event.type)));
+      if (std::string(event.type) == "error") {
+        napi_set_named_property(env, entry, "error", MakeNfcError(env, "startPolling", event.error, "unable to poll"));
+      }
+      else {
+        napi_set_named_property(env, entry, "target", Target::Construct(env, event.target, event.card_type));
+      }
+      if (!event.results.empty()) {
+        napi_set_named_property(env, entry, "results", toJS(env, event.results));
+      }
+      if (event.provisioning.status != Provisioner::none) {
+        napi_set_named_property(env, entry, "provisioning", toJS(env, event.provisioning));
+      }
+      napi_set_element(env, events, i, entry);
+    }
+    napi_value global;
+    napi_get_global(env, &global);
+    napi_call_function(env, global, callback, 1, &events, NULL);
+  }
+
+
+  void
+  TagQueue::Finalize(napi_env env, void *data, void *hint) {
+    delete static_cast<Channel *>(data);
+  }
+
+}
@@ -0,0 +1,83 @@
+#ifndef NFC_QUEUE_HH
+#define NFC_QUEUE_HH
+
+#include "provision.hh"
+#include "script.hh"
+#include "util.hh"
+#include <deque>
+#include <nfc/nfc.h>
+#include <vector>
+
+
+namespace nfc {
+
+  struct TagEvent {
+    const char *type;
+    nfc_target target;
+    int error;
+    Script::Results results;
+    const char *card_type;  // if found by probing
+    Provisioner::Result provisioning;
+  };
+
+
+  // Bounded queue of tag events from the polling thread.  The loop thread is woken up
+  // once for all events pending at that time, which are then delivered as one batch.
+  class TagQueue {
+  public:
+    struct Stats {
+      size_t queued;
+      uint64_t events;
+      uint64_t batches;
+      size_t max_batch;
+
+      Stats();
+    };
+
+  protected:
+    // Context of the wakeup function, which may still run after the queue is closed or gone.
+    // Only used on the loop thread.
+    struct Channel {
+      TagQueue *queue;                  // NULL once closed
+      std::vector<TagEvent> remaining;  // drained on close, for the wakeups still pending
+    };
+
+    Lock lock;
+    std::deque<TagEvent> events;
+    size_t high_water_mark;
+    bool flowing;
+    bool signalled;  // a wakeup is pending on the loop thread
+    Stats current;
+    Event space;
+    napi_threadsafe_function wakeup;
+    Channel *channel;
+
+  public:
+    TagQueue();
+
+    bool open(napi_env env, napi_value callback, size_t high_water_mark);
+    void close();
+
+    // polling thread
+    void push(const TagEvent &event);
+    bool full() const;
+    bool wait_for_space(uint64_t timeout);
+
+    // loop thread
+    std::vector<TagEvent> drain();
+    void pause();
+    void resume();
+    // Lets the polling thread waiting for space go on, e.g. to stop.
+    void interrupt();
+
+    Stats stats() const;
+
+  protected:
+    void signal();
+    static void Deliver(napi_env env, napi_value callback, void *context, void *data);
+    static void Finalize(napi_env env, void *data, void *hint);
+  };
+
+}
+
+#endif
@@ -0,0 +1,100 @@
+#include "retry.hh"
+#include <algorithm>
+
+
+namespace nfc {
+
+  RetryPolicy::Options::Options()
+    : errors(retryable), max_attempts(1), recovery(no_recovery), budget(0)
+  {
+  }
+
+
+  RetryPolicy::Stats::Stats()
+    : retries(0), recovered(0), exhausted(0)
+  {
+  }
+
+
+  void
+  RetryPolicy::configure(const Options &options_) {
+    WrLock lk(lock);
+    options = options_;
+    options.max_attempts = std::max(options.max_attempts, 1u);
+    current = Stats();
+  }
+
+
+  RetryPolicy::Options
+  RetryPolicy::settings() const {
+    RdLock lk(lock);
+    return options;
+  }
+
+
+  RetryPolicy::Stats
+  RetryPolicy::stats() const {
+    RdLock lk(lock);
+    return current;
+  }
+
+
+  void
+  RetryPolicy::record(unsigned retries, int result) {
+    if (!retries) {
+      return;
+    }
+    WrLock lk(lock);
+    current.retries += retries;
+    if (result < 0) {
+      ++current.exhausted;
+    }
+    else {
+      ++current.recovered;
+    }
+  }
+
+
+  bool
+  RetryPolicy::should_retry(const Options &options, int error, unsigned attempts, unsigned elapsed) {
+    return (options.errors & error_class(error)) && attempts < options.max_attempts &&
+           (!options.budget || elapsed < options.budget);
+  }
+
+
+  unsigned
+  RetryPolicy::error_class(int error) {
+    // Aborts, failures of the device and errors of the caller are not transient.
+    return retryable & 1u << ErrorCounters::classify(error);
+  }
+
+
+  unsigned
+  RetryPolicy::error_class(const std::string &name) {
+    for (unsigned c = 0; c < ErrorCounters::class_count; ++c) {
+      if (name == ErrorCounters::name(ErrorCounters::Class(c))) {
+        return retryable & 1u << c;
+      }
+    }
+    return 0;
+  }
+
+
+  bool
+  RetryPolicy::recovery(const std::string &name, Recovery &recovery) {
+    if (name == "none") {
+      recovery = no_recovery;
+    }
+    else if (name == "reselect") {
+      recovery = reselect_target;
+    }
+    else if (name == "fieldReset") {
+      recovery = reset_field;
+    }
+    else {
+      return false;
+    }
+    return true;
+  }
+
+}
@@ -0,0 +1,73 @@
+#ifndef NFC_RETRY_HH
+#define NFC_RETRY_HH
+
+#include "errors.hh"
+#include "util.hh"
+#include <stdint.h>
+#include <string>
+
+
+namespace nfc {
+
+  // Decides whether a failed transceive is tried again inside the same native job, rather than
+  // failing back to JS which would retry after a round trip and often a new poll.  Only errors
+  // of the configured classes are retried, up to max_attempts in all and within budget ms.
+  class RetryPolicy {
+  public:
+    // Error classes are those of ErrorCounters, as bits 1 << ErrorCounters::Class.  Only lost or
+    // garbled frames, cards not answering in time and errors of the reader chip are transient.
+    static const unsigned retryable = 1u << ErrorCounters::rf | 1u << ErrorCounters::timeout |
+                                      1u << ErrorCounters::chip;
+
+    // What is done between attempts.  The card loses any protocol state (e.g. the selected
+    // application) when it is selected again.
+    enum Recovery {
+      no_recovery,
+      reselect_target,  // deselect the target and select it again
+      reset_field       // switch the RF field off and on, then select the target again
+    };
+
+    struct Options {
+      unsigned errors;        // error classes retried
+      unsigned max_attempts;  // the first one included, 1 disables retries
+      Recovery recovery;
+      unsigned budget;        // ms for all attempts, 0 for no limit
+
+      Options();
+    };
+
+    struct Stats {
+      uint64_t retries;
+      uint64_t recovered;  // commands which succeeded after a retry
+      uint64_t exhausted;  // commands which failed after a retry
+
+      Stats();
+    };
+
+  protected:
+    Lock lock;
+    Options options;
+    Stats current;
+
+  public:
+    void configure(const Options &options);
+    Options settings() const;
+    Stats stats() const;
+
+    // Records the outcome of a command retried retries times.
+    void record(unsigned retries, int result);
+
+    // Whether attempt number attempts, which failed with error elapsed ms after the first one
+    // started, is followed by another.
+    static bool should_retry(const Options &options, int error, unsigned attempts, unsigned elapsed);
+    // The bit of the class of error if it is retryable, else 0.
+    static unsigned error_class(int error);
+
+    // Names used by JS, those of ErrorCounters, 0 or false if unknown or not retryable.
+    static unsigned error_class(const std::string &name);
+    static bool recovery(const std::string &name, Recovery &recovery);
+  };
+
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include "scheduler.hh"
+#include <algorithm>
+
+
+namespace nfc {
+
+  PollScheduler::Options::Options()
+    : min_interval(20), max_interval(1000), backoff(2.0), burst(2000), idle_after(250)
+  {
+  }
+
+
+  PollScheduler::Stats::Stats()
+    : polls(0), detections(0), busy_time(0), sleep_time(0), latency_sum(0), max_latency(0), interval(0)
+  {
+  }
+
+
+  double
+  PollScheduler::Stats::duty_cycle() const {
+    uint64_t total = busy_time + sleep_time;
+    return total ? double(busy_time) / total : 0;
+  }
+
+
+  double
+  PollScheduler::Stats::mean_latency() const {
+    return detections ? latency_sum / detections : 0;
+  }
+
+
+  PollScheduler::PollScheduler()
+    : last_activity(0)
+  {
+  }
+
+
+  void
+  PollScheduler::configure(const Options &options_) {
+    WrLock lk(lock);
+    options = options_;
+    options.min_interval = std::max(options.min_interval, 1u);
+    options.max_interval = std::max(options.max_interval, options.min_interval);
+    options.backoff = std::max(options.backoff, 1.0);
+    current = Stats();
+    current.interval = options.min_interval;
+    last_activity = 0;
+  }
+
+
+  PollScheduler::Options
+  PollScheduler::settings() const {
+    RdLock lk(lock);
+    return options;
+  }
+
+
+  PollScheduler::Stats
+  PollScheduler::stats() const {
+    RdLock lk(lock);
+    return current;
+  }
+
+
+  unsigned
+  PollScheduler::record_poll(uint64_t now, unsigned gap, unsigned duration, bool detected) {
+    WrLock lk(lock);
+    ++current.polls;
+    current.busy_time += duration;
+    if (detected) {
+      // A target arriving at a random time during the gap waits half of it on average,
+      // plus the poll which found it.
+      ++current.detections;
+      current.latency_sum += gap / 2.0 + duration;
+      current.max_latency = std::max(current.max_latency, gap + duration);
+      last_activity = now;
+      current.interval = options.min_interval;
+    }
+    else if (last_activity && now - last_activity < options.burst) {
+      // Another tap is likely right after the last one.
+      current.interval = options.min_interval;
+    }
+    else {
+      double interval = std::max(current.interval, options.min_interval) * options.backoff;
+      current.interval = unsigned(std::min(interval, double(options.max_interval)));
+    }
+    return current.interval;
+  }
+
+
+  unsigned
+  PollScheduler::record_removal(uint64_t now) {
+    WrLock lk(lock);
+    last_activity = now;
+    current.interval = options.min_interval;
+    return current.interval;
+  }
+
+
+  void
+  PollScheduler::record_busy(unsigned duration) {
+    WrLock lk(lock);
+    current.busy_time += duration;
+  }
+
+
+  void
+  PollScheduler::record_sleep(unsigned duration) {
+    WrLock lk(lock);
+    current.sleep_time += duration;
+  }
+
+
+  bool
+  PollScheduler::should_idle(unsigned interval) const {
+    RdLock lk(lock);
+    return options.idle_after && interval >= options.idle_after;
+  }
+
+}
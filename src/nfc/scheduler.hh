@@ -0,0 +1,64 @@
+#ifndef NFC_SCHEDULER_HH
+#define NFC_SCHEDULER_HH
+
+#include "util.hh"
+#include <stdint.h>
+
+
+namespace nfc {
+
+  // Decides how long the polling loop sleeps between polls: fast right after activity,
+  // backing off exponentially while the field stays empty.  All times are in ms.
+  class PollScheduler {
+  public:
+    struct Options {
+      unsigned min_interval;  // interval right after activity
+      unsigned max_interval;  // upper bound of the back-off
+      double backoff;         // growth factor per empty poll
+      unsigned burst;         // keep polling at min_interval for this long after activity
+      unsigned idle_after;    // put the device to idle once the interval reaches this
+
+      Options();
+    };
+
+    struct Stats {
+      uint64_t polls;
+      uint64_t detections;
+      uint64_t busy_time;     // time spent in RF operations
+      uint64_t sleep_time;    // time spent waiting between them
+      double latency_sum;     // sum of expected detection latencies
+      unsigned max_latency;   // worst-case detection latency seen
+      unsigned interval;      // current interval
+
+      Stats();
+
+      double duty_cycle() const;
+      double mean_latency() const;
+    };
+
+  protected:
+    Lock lock;
+    Options options;
+    Stats current;
+    uint64_t last_activity;
+
+  public:
+    PollScheduler();
+
+    void configure(const Options &options);
+    Options settings() const;
+    Stats stats() const;
+
+    // Records a poll that took duration ms after sleeping gap ms, returns the next interval.
+    unsigned record_poll(uint64_t now, unsigned gap, unsigned duration, bool detected);
+    // Records a target leaving the field, returns the next interval.
+    unsigned record_removal(uint64_t now);
+    void record_busy(unsigned duration);
+    void record_sleep(unsigned duration);
+
+    bool should_idle(unsigned interval) const;
+  };
+
+}
+
+#endif
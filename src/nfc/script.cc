@@ -0,0 +1,143 @@
+#include "script.hh"
+#include <algorithm>
+
+
+namespace nfc {
+
+  static const size_t max_response_size = 264;  // short APDU response with status word
+
+
+  static const struct {
+    const char *name;
+    nfc_modulation_type type;
+  } modulation_types[] = {
+    {"iso14443a", NMT_ISO14443A},
+    {"jewel", NMT_JEWEL},
+    {"iso14443b", NMT_ISO14443B},
+    {"iso14443bi", NMT_ISO14443BI},
+    {"iso14443b2sr", NMT_ISO14443B2SR},
+    {"iso14443b2ct", NMT_ISO14443B2CT},
+    {"felica", NMT_FELICA},
+    {"dep", NMT_DEP},
+  };
+
+
+  Script::Step::Step()
+    : sw(0x9000), next(end), otherwise(end), save(true)
+  {
+  }
+
+
+  Script::Script()
+    : modulation(nfc_modulation_type(0)), atqa(-1), sak(-1), sak_mask(0xff)
+  {
+  }
+
+
+  bool
+  Script::matches(const nfc_target &target) const {
+    if (modulation && target.nm.nmt != modulation) {
+      return false;
+    }
+    if (atqa < 0 && sak < 0 && ats.empty()) {
+      return true;
+    }
+    if (target.nm.nmt != NMT_ISO14443A) {
+      return false;
+    }
+    const nfc_iso14443a_info &info = target.nti.nai;
+    if (atqa >= 0 && (info.abtAtqa[0] << 8 | info.abtAtqa[1]) != atqa) {
+      return false;
+    }
+    if (sak >= 0 && (info.btSak & sak_mask) != (sak & sak_mask)) {
+      return false;
+    }
+    // libnfc leaves out the length byte (TL) of the ATS.
+    return ats.size() <= info.szAtsLen && std::equal(ats.begin(), ats.end(), info.abtAts);
+  }
+
+
+  void
+  Script::run(Transport &transport, Results &results) const {
+    size_t index = 0;
+    for (size_t executed = 0; index < steps.size() && executed < max_executed; ++executed) {
+      const Step &step = steps[index];
+      Result result;
+      result.step = index;
+      result.response.resize(max_response_size);
+      result.error = std::min(transport.transceive(step.transmit, result.response), 0);
+      size_t size = result.response.size();
+      result.sw = !result.error && size >= 2 ? result.response[size - 2] << 8 | result.response[size - 1] : -1;
+      if (step.save || result.error) {
+        results.push_back(result);
+      }
+      if (result.error) {
+        break;
+      }
+      index = step.sw < 0 || result.sw == step.sw ? step.next : step.otherwise;
+    }
+  }
+
+
+  Script
+  Convert<Script>::fromJS(napi_env env, napi_value value) {
+    Script script;
+    napi_value match = GetOption(env, value, "match");
+    if (match) {
+      std::string modulation = GetOption<std::string>(env, match, "modulation", "");
+      for (size_t i = 0; i < sizeof(modulation_types) / sizeof(modulation_types[0]); ++i) {
+        if (modulation == modulation_types[i].name) {
+          script.modulation = modulation_types[i].type;
+        }
+      }
+      script.atqa = GetOption(env, match, "atqa", script.atqa);
+      script.sak = GetOption(env, match, "sak", script.sak);
+      script.sak_mask = GetOption(env, match, "sakMask", script.sak_mask);
+      napi_value ats = GetOption(env, match, "ats");
+      if (ats) {
+        script.ats = nfc::fromJS<std::vector<uint8_t> >(env, ats);
+      }
+    }
+
+    napi_value steps = GetOption(env, value, "steps");
+    uint32_t length = 0;
+    if (steps) {
+      napi_get_array_length(env, steps, &length);
+    }
+    for (uint32_t i = 0; i < length; ++i) {
+      napi_value element;
+      napi_get_element(env, steps, i, &element);
+      Script::Step step;
+      step.transmit = nfc::fromJS<std::vector<uint8_t> >(env, GetOption(env, element, "transmit"));
+      napi_value sw = GetOption(env, element, "sw");
+      napi_valuetype type = napi_undefined;
+      if (sw) {
+        napi_typeof(env, sw, &type);
+      }
+      // null accepts any response
+      step.sw = !sw ? step.sw : type == napi_null ? -1 : nfc::fromJS<int>(env, sw);
+      step.next = GetOption<uint32_t>(env, element, "next", i + 1);
+      step.otherwise = GetOption<uint32_t>(env, element, "otherwise", length);
+      step.save = GetOption(env, element, "save", step.save);
+      script.steps.push_back(step);
+    }
+    return script;
+  }
+
+
+  napi_value
+  Convert<Script::Result>::toJS(napi_env env, const Script::Result &value) {
+    napi_value result;
+    napi_create_object(env, &result);
+    napi_set_named_property(env, result, "step", nfc::toJS(env, uint32_t(value.step)));
+    if (value.error) {
+      napi_set_named_property(env, result, "error", nfc::toJS(env, value.error));
+    }
+    else {
+      napi_set_named_property(env, result, "sw", value.sw < 0 ? nfc::toJS(env, null) : nfc::toJS(env, value.sw));
+      napi_set_named_property(env, result, "response", nfc::toJS(env, value.response));
+    }
+    return result;
+  }
+
+}
@@ -0,0 +1,69 @@
+#ifndef NFC_SCRIPT_HH
+#define NFC_SCRIPT_HH
+
+#include "transport.hh"
+#include "util.hh"
+#include <nfc/nfc.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // Commands the poller sends right after selecting a matching target, within the same job.
+  class Script {
+  public:
+    static const size_t end = size_t(-1);
+    static const size_t max_executed = 64;  // bounds loops built from branches
+
+    struct Step {
+      std::vector<uint8_t> transmit;
+      int sw;  // expected status word, or -1 to accept any response
+      size_t next;  // step after a match
+      size_t otherwise;  // step after a mismatch
+      bool save;
+
+      Step();
+    };
+
+    struct Result {
+      size_t step;
+      int sw;  // status word, or -1 if the response is too short
+      int error;  // libnfc error, ends the script
+      std::vector<uint8_t> response;
+    };
+
+    typedef std::vector<Result> Results;
+
+    // Match criteria, unset ones match any target.
+    nfc_modulation_type modulation;
+    int atqa;
+    int sak;
+    uint8_t sak_mask;
+    std::vector<uint8_t> ats;  // prefix of the ATS, without its length byte
+
+    std::vector<Step> steps;
+
+  public:
+    Script();
+
+    bool matches(const nfc_target &target) const;
+    void run(Transport &transport, Results &results) const;
+  };
+
+
+  template<>
+  struct Convert<Script> {
+    static Script fromJS(napi_env env, napi_value value);
+  };
+
+
+  template<>
+  struct Convert<Script::Result> {
+    static napi_value toJS(napi_env env, const Script::Result &value);
+  };
+
+}
+
+#endif
@@ -1,17 +1,110 @@
 #include "target.hh"
+#include "classifier.hh"
+#include <cstddef>
+#include <cstring>
 
 
 namespace nfc {
 
+  static size_t
+  ReadSize(const uint8_t *value) {
+    size_t result;
+    memcpy(&result, value, sizeof(result));
+    return result;
+  }
+
+
+  static void
+  WriteSize(uint8_t *value, size_t size) {
+    memcpy(value, &size, sizeof(size));
+  }
+
+
+  // Layout of nfc_target_info per modulation, for info and the binary format.
+  struct Target::Field {
+    enum Kind {
+      bytes,     // fixed size array
+      variable,  // array with its length in a size_t
+      byte,
+      number,    // size_t
+      dep_mode
+    };
+
+    nfc_modulation_type modulation;
+    const char *name;
+    Kind kind;
+    size_t offset;         // in nfc_target_info
+    size_t size;           // capacity for arrays
+    size_t length_offset;  // of the length of variable arrays
+
+    size_t length(const uint8_t *info) const {
+      return std::min(ReadSize(info + length_offset), size);
+    }
+  };
+
+
+#define NFC_FIELD(modulation, name, kind, member) \
+  {modulation, name, Target::Field::kind, offsetof(nfc_target_info, member), \
+   sizeof(static_cast<nfc_target_info *>(NULL)->member), 0}
+#define NFC_VARIABLE(modulation, name, member, length) \
+  {modulation, name, Target::Field::variable, offsetof(nfc_target_info, member), \
+   sizeof(static_cast<nfc_target_info *>(NULL)->member), offsetof(nfc_target_info, length)}
+
+  const Target::Field Target::fields[] = {
+    NFC_FIELD(NMT_ISO14443A, "atqa", bytes, nai.abtAtqa),
+    NFC_FIELD(NMT_ISO14443A, "sak", byte, nai.btSak),
+    NFC_VARIABLE(NMT_ISO14443A, "uid", nai.abtUid, nai.szUidLen),
+    NFC_VARIABLE(NMT_ISO14443A, "ats", nai.abtAts, nai.szAtsLen),
+    NFC_FIELD(NMT_JEWEL, "sensRes", bytes, nji.btSensRes),
+    NFC_FIELD(NMT_JEWEL, "id", bytes, nji.btId),
+    NFC_FIELD(NMT_ISO14443B, "pupi", bytes, nbi.abtPupi),
+    NFC_FIELD(NMT_ISO14443B, "applicationData", bytes, nbi.abtApplicationData),
+    NFC_FIELD(NMT_ISO14443B, "protocolInfo", bytes, nbi.abtProtocolInfo),
+    NFC_FIELD(NMT_ISO14443B, "cardIdentifier", byte, nbi.ui8CardIdentifier),
+    NFC_FIELD(NMT_ISO14443BI, "div", bytes, nii.abtDIV),
+    NFC_FIELD(NMT_ISO14443BI, "verLog", byte, nii.btVerLog),
+    NFC_FIELD(NMT_ISO14443BI, "config", byte, nii.btConfig),
+    NFC_VARIABLE(NMT_ISO14443BI, "atr", nii.abtAtr, nii.szAtrLen),
+    NFC_FIELD(NMT_ISO14443B2SR, "uid", bytes, nsi.abtUID),
+    NFC_FIELD(NMT_ISO14443B2CT, "uid", bytes, nci.abtUID),
+    NFC_FIELD(NMT_ISO14443B2CT, "prodCode", byte, nci.btProdCode),
+    NFC_FIELD(NMT_ISO14443B2CT, "fabCode", byte, nci.btFabCode),
+    NFC_FIELD(NMT_FELICA, "len", number, nfi.szLen),
+    NFC_FIELD(NMT_FELICA, "resCode", byte, nfi.btResCode),
+    NFC_FIELD(NMT_FELICA, "id", bytes, nfi.abtId),
+    NFC_FIELD(NMT_FELICA, "pad", bytes, nfi.abtPad),
+    NFC_FIELD(NMT_FELICA, "sysCode", bytes, nfi.abtSysCode),
+    NFC_FIELD(NMT_DEP, "nfcid3", bytes, ndi.abtNFCID3),
+    NFC_FIELD(NMT_DEP, "did", byte, ndi.btDID),
+    NFC_FIELD(NMT_DEP, "bs", byte, ndi.btBS),
+    NFC_FIELD(NMT_DEP, "br", byte, ndi.btBR),
+    NFC_FIELD(NMT_DEP, "to", byte, ndi.btTO),
+    NFC_FIELD(NMT_DEP, "pp", byte, ndi.btPP),
+    NFC_VARIABLE(NMT_DEP, "gb", ndi.abtGB, ndi.szGB),
+    NFC_FIELD(NMT_DEP, "mode", dep_mode, ndi.ndm)
+  };
+
+#undef NFC_VARIABLE
+#undef NFC_FIELD
+
+  const size_t Target::fields_count = sizeof(fields) / sizeof(fields[0]);
+
+
   Target::Target(const nfc_target &target_)
-    : target(target_)
+    : target(target_), identified_type(NULL)
   {
   }
 
 
   std::string
   Target::modulation_type() const {
-    switch (target.nm.nmt) {
+    return modulation_type(target.nm.nmt);
+  }
+
+
+  std::string
+  Target::modulation_type(nfc_modulation_type type) {
+    switch (type) {
     case NMT_ISO14443A:
       return "iso14443a";
     case NMT_JEWEL:
@@ -34,8 +127,8 @@ namespace nfc {
 
 
   unsigned
-  Target::baud_rate() const {
-    switch (target.nm.nbr) {
+  Target::baud_rate(nfc_baud_rate rate) {
+    switch (rate) {
     case NBR_UNDEFINED:
       return 0;
     case NBR_106:
@@ -51,6 +144,23 @@ namespace nfc {
   }
 
 
+  unsigned
+  Target::baud_rate() const {
+    return baud_rate(target.nm.nbr);
+  }
+
+
+  std::vector<uint32_t>
+  Target::supported_baud_rates() const {
+    const std::vector<nfc_baud_rate> rates = CardClassifier::baud_rates(target);
+    std::vector<uint32_t> result;
+    for (std::vector<nfc_baud_rate>::const_iterator it = rates.begin(); it != rates.end(); ++it) {
+      result.push_back(baud_rate(*it));
+    }
+    return result;
+  }
+
+
   std::string
   Target::modulation_type_string() const {
     return str_nfc_modulation_type(target.nm.nmt);
@@ -76,162 +186,261 @@ namespace nfc {
   }
 
 
-  v8::Handle<v8::Value>
-  Target::Construct(const nfc_target &target) {
-    return ObjectWrap::Construct(target);
+  std::string
+  Target::card_type() const {
+    return identified_type ? identified_type : CardClassifier::classify(target).type;
+  }
+
+
+  std::vector<uint8_t>
+  Target::serialize() const {
+    // version, modulation type, baud rate, then the fields of the modulation in table order:
+    // arrays as they are (variable ones after a length byte), single bytes for the rest.
+    const uint8_t *info = reinterpret_cast<const uint8_t *>(&target.nti);
+    // Fields take no more than their structure, plus a length byte for each variable one.
+    uint8_t buffer[3 + sizeof(nfc_target_info) + 2];
+    size_t size = 0;
+    buffer[size++] = format_version;
+    buffer[size++] = uint8_t(target.nm.nmt);
+    buffer[size++] = uint8_t(target.nm.nbr);
+    for (size_t i = 0; i < fields_count; ++i) {
+      const Field &field = fields[i];
+      if (field.modulation != target.nm.nmt) {
+        continue;
+      }
+      const uint8_t *value = info + field.offset;
+      switch (field.kind) {
+      case Field::bytes:
+        memcpy(buffer + size, value, field.size);
+        size += field.size;
+        break;
+      case Field::variable: {
+        const size_t length = field.length(info);
+        buffer[size++] = uint8_t(length);
+        memcpy(buffer + size, value, length);
+        size += length;
+        break;
+      }
+      case Field::byte:
+        buffer[size++] = *value;
+        break;
+      case Field::number:
+        buffer[size++] = uint8_t(std::min(ReadSize(value), size_t(0xff)));
+        break;
+      case Field::dep_mode: {
+        nfc_dep_mode mode;
+        memcpy(&mode, value, sizeof(mode));
+        buffer[size++] = uint8_t(mode);
+        break;
+      }
+      }
+    }
+    return std::vector<uint8_t>(buffer, buffer + size);
+  }
+
+
+  bool
+  Target::deserialize(const uint8_t *data, size_t size, nfc_target &target) {
+    if (size < 3 || data[0] != format_version || data[2] > NBR_847) {
+      return false;
+    }
+    memset(&target, 0, sizeof(target));
+    target.nm.nmt = nfc_modulation_type(data[1]);
+    target.nm.nbr = nfc_baud_rate(data[2]);
+    uint8_t *info = reinterpret_cast<uint8_t *>(&target.nti);
+    size_t offset = 3;
+    bool known = false;
+    for (size_t i = 0; i < fields_count; ++i) {
+      const Field &field = fields[i];
+      if (field.modulation != target.nm.nmt) {
+        continue;
+      }
+      known = true;
+      uint8_t *value = info + field.offset;
+      size_t length = field.kind == Field::bytes ? field.size : 1;
+      if (field.kind == Field::variable) {
+        if (offset >= size || data[offset] > field.size) {
+          return false;
+        }
+        length = data[offset++];
+        WriteSize(info + field.length_offset, length);
+      }
+      if (size - offset < length) {
+        return false;
+      }
+      if (field.kind == Field::number) {
+        WriteSize(value, data[offset]);
+      }
+      else if (field.kind == Field::dep_mode) {
+        const nfc_dep_mode mode = nfc_dep_mode(data[offset]);
+        memcpy(value, &mode, sizeof(mode));
+      }
+      else {
+        memcpy(value, data + offset, length);
+      }
+      offset += length;
+    }
+    return known && offset == size;
+  }
+
+
+  napi_value
+  Target::Construct(napi_env env, const nfc_target &target, const char *card_type) {
+    napi_value instance = ObjectWrap::Construct(env, target);
+    if (card_type && IsObject(env, instance)) {
+      Unwrap(env, instance).identified_type = card_type;
+    }
+    return instance;
   }
 
 
   Target *
-  Target::Create(const v8::Arguments &args) {
+  Target::Create(const Arguments &args) {
     return ObjectWrap::Create<nfc_target>(args);
   }
 
 
-  v8::Persistent<v8::Function> Target::constructor;
+  const napi_type_tag Target::type_tag = {0x81d4a6f2c03e9b57ULL, 0x4a7fe2906cd135b8ULL};
 
 
   void
-  Target::Initialize(v8::Handle<v8::Object> exports) {
-    v8::HandleScope scope;
-    v8::Local<v8::ObjectTemplate> proto;
-    v8::Local<v8::FunctionTemplate> tpl;
-    Prepare(tpl, proto);
+  Target::Initialize(napi_env env, napi_value exports) {
+    Properties properties;
 
-    proto->SetAccessor(v8::String::NewSymbol("modulationType"), GetModulationType);
-    proto->SetAccessor(v8::String::NewSymbol("baudRate"), GetBaudRate);
-    proto->SetAccessor(v8::String::NewSymbol("info"), GetInfo);
+    properties.accessor<GetModulationType>("modulationType");
+    properties.accessor<GetBaudRate>("baudRate");
+    properties.accessor<GetSupportedBaudRates>("supportedBaudRates");
+    properties.accessor<GetInfo>("info");
+    properties.accessor<GetCardType>("cardType");
 
-    proto->SetAccessor(v8::String::NewSymbol("modulationTypeString"), GetModulationTypeString);
-    proto->SetAccessor(v8::String::NewSymbol("baudRateString"), GetBaudRateString);
-    proto->SetAccessor(v8::String::NewSymbol("infoString"), GetInfoString);
+    properties.accessor<GetModulationTypeString>("modulationTypeString");
+    properties.accessor<GetBaudRateString>("baudRateString");
+    properties.accessor<GetInfoString>("infoString");
 
-    Install("Target", exports, tpl);
+    properties.method<Serialize>("serialize");
+    properties.static_method<Deserialize>("deserialize");
+
+    Install(env, "Target", exports, properties);
   }
 
 
-  v8::Handle<v8::Value>
-  Target::GetModulationType(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(info.This()).modulation_type()));
+  napi_value
+  Target::GetModulationType(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).modulation_type());
   }
 
 
-  v8::Handle<v8::Value>
-  Target::GetBaudRate(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(info.This()).baud_rate()));
+  napi_value
+  Target::GetBaudRate(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).baud_rate());
   }
 
 
-  v8::Handle<v8::Value>
-  Target::GetInfo(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    const nfc_target &target = Unwrap(info.This()).target;
-    v8::Handle<v8::Object> result = v8::Object::New();
-    switch (target.nm.nmt) {
-    case NMT_ISO14443A:
-      result->Set(v8::String::NewSymbol("atqa"),
-                  toV8(std::vector<uint8_t>(target.nti.nai.abtAtqa, target.nti.nai.abtAtqa + 2)));
-      result->Set(v8::String::NewSymbol("sak"), toV8(target.nti.nai.btSak));
-      result->Set(v8::String::NewSymbol("uid"),
-                  toV8(std::vector<uint8_t>(target.nti.nai.abtUid, target.nti.nai.abtUid + target.nti.nai.szUidLen)));
-      result->Set(v8::String::NewSymbol("ats"),
-                  toV8(std::vector<uint8_t>(target.nti.nai.abtAts, target.nti.nai.abtAts + target.nti.nai.szAtsLen)));
-      break;
-    case NMT_JEWEL:
-      result->Set(v8::String::NewSymbol("sensRes"),
-                  toV8(std::vector<uint8_t>(target.nti.nji.btSensRes, target.nti.nji.btSensRes + 2)));
-      result->Set(v8::String::NewSymbol("id"),
-                  toV8(std::vector<uint8_t>(target.nti.nji.btId, target.nti.nji.btId + 4)));
-      break;
-    case NMT_ISO14443B:
-      result->Set(v8::String::NewSymbol("pupi"),
-                  toV8(std::vector<uint8_t>(target.nti.nbi.abtPupi, target.nti.nbi.abtPupi + 4)));
-      result->Set(v8::String::NewSymbol("applicationData"),
-                  toV8(std::vector<uint8_t>(target.nti.nbi.abtApplicationData, target.nti.nbi.abtApplicationData + 4)));
-      result->Set(v8::String::NewSymbol("protocolInfo"),
-                  toV8(std::vector<uint8_t>(target.nti.nbi.abtProtocolInfo, target.nti.nbi.abtProtocolInfo + 3)));
-      result->Set(v8::String::NewSymbol("cardIdentifier"), toV8(target.nti.nbi.ui8CardIdentifier));
-      break;
-    case NMT_ISO14443BI:
-      result->Set(v8::String::NewSymbol("div"),
-                  toV8(std::vector<uint8_t>(target.nti.nii.abtDIV, target.nti.nii.abtDIV + 4)));
-      result->Set(v8::String::NewSymbol("verLog"), toV8(target.nti.nii.btVerLog));
-      result->Set(v8::String::NewSymbol("config"), toV8(target.nti.nii.btConfig));
-      result->Set(v8::String::NewSymbol("atr"),
-                  toV8(std::vector<uint8_t>(target.nti.nii.abtAtr, target.nti.nii.abtAtr + target.nti.nii.szAtrLen)));
-      break;
-    case NMT_ISO14443B2SR:
-      result->Set(v8::String::NewSymbol("uid"),
-                  toV8(std::vector<uint8_t>(target.nti.nsi.abtUID, target.nti.nsi.abtUID + 8)));
-      break;
-    case NMT_ISO14443B2CT:
-      result->Set(v8::String::NewSymbol("uid"),
-                  toV8(std::vector<uint8_t>(target.nti.nci.abtUID, target.nti.nci.abtUID + 4)));
-      result->Set(v8::String::NewSymbol("prodCode"), toV8(target.nti.nci.btProdCode));
-      result->Set(v8::String::NewSymbol("fabCode"), toV8(target.nti.nci.btFabCode));
-      break;
-    case NMT_FELICA:
-      result->Set(v8::String::NewSymbol("len"), toV8(target.nti.nfi.szLen));
-      result->Set(v8::String::NewSymbol("resCode"), toV8(target.nti.nfi.btResCode));
-      result->Set(v8::String::NewSymbol("id"),
-                  toV8(std::vector<uint8_t>(target.nti.nfi.abtId, target.nti.nfi.abtId + 8)));
-      result->Set(v8::String::NewSymbol("pad"),
-                  toV8(std::vector<uint8_t>(target.nti.nfi.abtPad, target.nti.nfi.abtPad + 8)));
-      result->Set(v8::String::NewSymbol("sysCode"),
-                  toV8(std::vector<uint8_t>(target.nti.nfi.abtSysCode, target.nti.nfi.abtSysCode + 2)));
-      break;
-    case NMT_DEP:
-      result->Set(v8::String::NewSymbol("nfcid3"),
-                  toV8(std::vector<uint8_t>(target.nti.ndi.abtNFCID3, target.nti.ndi.abtNFCID3 + 10)));
-      result->Set(v8::String::NewSymbol("did"), toV8(target.nti.ndi.btDID));
-      result->Set(v8::String::NewSymbol("bs"), toV8(target.nti.ndi.btBS));
-      result->Set(v8::String::NewSymbol("br"), toV8(target.nti.ndi.btBR));
-      result->Set(v8::String::NewSymbol("to"), toV8(target.nti.ndi.btTO));
-      result->Set(v8::String::NewSymbol("pp"), toV8(target.nti.ndi.btPP));
-      result->Set(v8::String::NewSymbol("gb"),
-                  toV8(std::vector<uint8_t>(target.nti.ndi.abtGB, target.nti.ndi.abtGB + target.nti.ndi.szGB)));
-      {
-        v8::Handle<v8::Value> mode;
-        switch (target.nti.ndi.ndm) {
-        case NDM_UNDEFINED: mode = v8::String::NewSymbol("undefined"); break;
-        case NDM_PASSIVE: mode = v8::String::NewSymbol("passive"); break;
-        case NDM_ACTIVE: mode = v8::String::NewSymbol("active"); break;
-        default: mode = v8::Undefined(); break;
+  napi_value
+  Target::GetSupportedBaudRates(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).supported_baud_rates());
+  }
+
+
+  napi_value
+  Target::GetInfo(const Arguments &args) {
+    napi_env env = args.Env();
+    const nfc_target &target = Unwrap(env, args.This()).target;
+    const uint8_t *info = reinterpret_cast<const uint8_t *>(&target.nti);
+    napi_value result = NULL;
+    for (size_t i = 0; i < fields_count; ++i) {
+      const Field &field = fields[i];
+      if (field.modulation != target.nm.nmt) {
+        continue;
+      }
+      if (!result) {
+        napi_create_object(env, &result);
+      }
+      const uint8_t *value = info + field.offset;
+      napi_value property;
+      switch (field.kind) {
+      case Field::bytes:
+        property = toJS(env, std::vector<uint8_t>(value, value + field.size));
+        break;
+      case Field::variable:
+        property = toJS(env, std::vector<uint8_t>(value, value + field.length(info)));
+        break;
+      case Field::byte:
+        property = toJS(env, *value);
+        break;
+      case Field::number:
+        property = toJS(env, ReadSize(value));
+        break;
+      case Field::dep_mode: {
+        nfc_dep_mode mode;
+        memcpy(&mode, value, sizeof(mode));
+        switch (mode) {
+        case NDM_UNDEFINED: property = toJS(env, std::string("undefined")); break;
+        case NDM_PASSIVE: property = toJS(env, std::string("passive")); break;
+        case NDM_ACTIVE: property = toJS(env, std::string("active")); break;
+        default: napi_get_undefined(env, &property); break;
         }
-        result->Set(v8::String::NewSymbol("mode"), mode);
+        break;
       }
-      break;
-    default:
-      return scope.Close(v8::Undefined());
+      }
+      napi_set_named_property(env, result, field.name, property);
+    }
+    if (!result) {
+      napi_get_undefined(env, &result);
+    }
+    return result;
+  }
+
+
+  napi_value
+  Target::Serialize(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).serialize());
+  }
+
+
+  napi_value
+  Target::Deserialize(const Arguments &args) {
+    napi_env env = args.Env();
+    void *data = NULL;
+    size_t length = 0;
+    bool is_buffer = false;
+    napi_is_buffer(env, args[0], &is_buffer);
+    if (!is_buffer || napi_get_buffer_info(env, args[0], &data, &length) != napi_ok) {
+      return ThrowTypeError(env, "expected buffer");
     }
-    return scope.Close(result);
+    nfc_target target;
+    if (!deserialize(static_cast<const uint8_t *>(data), length, target)) {
+      return ThrowTypeError(env, "invalid serialized target");
+    }
+    return Construct(env, target);
+  }
+
+
+  napi_value
+  Target::GetCardType(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).card_type());
   }
 
 
-  v8::Handle<v8::Value>
-  Target::GetModulationTypeString(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(info.This()).modulation_type_string()));
+  napi_value
+  Target::GetModulationTypeString(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).modulation_type_string());
   }
 
 
-  v8::Handle<v8::Value>
-  Target::GetBaudRateString(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    return scope.Close(toV8(Unwrap(info.This()).baud_rate_string()));
+  napi_value
+  Target::GetBaudRateString(const Arguments &args) {
+    return toJS(args.Env(), Unwrap(args.Env(), args.This()).baud_rate_string());
   }
 
 
-  v8::Handle<v8::Value>
-  Target::GetInfoString(v8::Local<v8::String> property, const v8::AccessorInfo &info) {
-    v8::HandleScope scope;
-    std::string details = Unwrap(info.This()).info_string(true);
+  napi_value
+  Target::GetInfoString(const Arguments &args) {
+    std::string details = Unwrap(args.Env(), args.This()).info_string(true);
     if (details.empty()) {
-      return v8::ThrowException(v8::Exception::Error(v8::String::New("unable to get info")));
+      return ThrowError(args.Env(), "unable to get info");
     }
-    return scope.Close(toV8(details));
+    return toJS(args.Env(), details);
   }
 
 }
@@ -13,35 +13,58 @@ namespace nfc {
     friend class Device;
 
   public:
+    // Version of the serialized format.
+    static const uint8_t format_version = 1;
+
     nfc_target target;
+    const char *identified_type;  // found by probing, NULL to classify the activation data
 
   public:
     Target(const nfc_target &target);
 
     std::string modulation_type() const;
     unsigned baud_rate() const;
+    static std::string modulation_type(nfc_modulation_type type);
+    static unsigned baud_rate(nfc_baud_rate rate);
+    std::vector<uint32_t> supported_baud_rates() const;
 
     std::string modulation_type_string() const;
     std::string baud_rate_string() const;
 
     std::string info_string(bool verbose) const;
+    std::string card_type() const;
+
+    std::vector<uint8_t> serialize() const;
+    static bool deserialize(const uint8_t *data, size_t size, nfc_target &target);
 
   public:
-    static v8::Handle<v8::Value> Construct(const nfc_target &target);
+    static napi_value Construct(napi_env env, const nfc_target &target, const char *card_type = NULL);
 
   public:
-    static v8::Persistent<v8::Function> constructor;
+    static const napi_type_tag type_tag;
+
+    static Target *Create(const Arguments &args);
+    static void Initialize(napi_env env, napi_value exports);
 
-    static Target *Create(const v8::Arguments &args);
-    static void Initialize(v8::Handle<v8::Object> exports);
+    static napi_value GetModulationType(const Arguments &args);
+    static napi_value GetBaudRate(const Arguments &args);
+    static napi_value GetSupportedBaudRates(const Arguments &args);
+    static napi_value GetInfo(const Arguments &args);
+    static napi_value GetCardType(const Arguments &args);
 
-    static v8::Handle<v8::Value> GetModulationType(v8::Local<v8::String> property, const v8::AccessorInfo &info);
-    static v8::Handle<v8::Value> GetBaudRate(v8::Local<v8::String> property, const v8::AccessorInfo &info);
-    static v8::Handle<v8::Value> GetInfo(v8::Local<v8::String> property, const v8::AccessorInfo &info);
+    static napi_value GetModulationTypeString(const Arguments &args);
+    static napi_value GetBaudRateString(const Arguments &args);
+    static napi_value GetInfoString(const Arguments &args);
+
+    static napi_value Serialize(const Arguments &args);
+    static napi_value Deserialize(const Arguments &args);
+
+  public:
+    struct Field;
 
-    static v8::Handle<v8::Value> GetModulationTypeString(v8::Local<v8::String> property, const v8::AccessorInfo &info);
-    static v8::Handle<v8::Value> GetBaudRateString(v8::Local<v8::String> property, const v8::AccessorInfo &info);
-    static v8::Handle<v8::Value> GetInfoString(v8::Local<v8::String> property, const v8::AccessorInfo &info);
+  protected:
+    static const Field fields[];
+    static const size_t fields_count;
   };
 
 }
@@ -0,0 +1,19 @@
+#ifndef NFC_TRANSPORT_HH
+#define NFC_TRANSPORT_HH
+
+#include <stdint.h>
+#include <vector>
+
+
+namespace nfc {
+
+  // Exchanges frames with the selected target, used by the card protocol layers.
+  class Transport {
+  public:
+    virtual ~Transport() {}
+    virtual int transceive(const std::vector<uint8_t> &transmit, std::vector<uint8_t> &receive) = 0;
+  };
+
+}
+
+#endif
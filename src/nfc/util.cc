@@ -37,6 +37,439 @@ namespace nfc {
   }
 
 
+  Event::Event()
+    : signalled(false)
+  {
+    uv_mutex_init(&mutex);
+    uv_cond_init(&cond);
+  }
+
+
+  Event::~Event() {
+    uv_cond_destroy(&cond);
+    uv_mutex_destroy(&mutex);
+  }
+
+
+  void
+  Event::set() {
+    uv_mutex_lock(&mutex);
+    signalled = true;
+    uv_cond_broadcast(&cond);
+    uv_mutex_unlock(&mutex);
+  }
+
+
+  void
+  Event::reset() {
+    uv_mutex_lock(&mutex);
+    signalled = false;
+    uv_mutex_unlock(&mutex);
+  }
+
+
+  bool
+  Event::is_set() const {
+    uv_mutex_lock(&mutex);
+    bool result = signalled;
+    uv_mutex_unlock(&mutex);
+    return result;
+  }
+
+
+  bool
+  Event::wait(uint64_t timeout) {
+    const uint64_t ms = 1000000;
+    uint64_t deadline = uv_hrtime() + timeout * ms;
+    uv_mutex_lock(&mutex);
+    while (!signalled) {
+      uint64_t now = uv_hrtime();
+      if (now >= deadline || uv_cond_timedwait(&cond, &mutex, deadline - now) == UV_ETIMEDOUT) {
+        break;
+      }
+    }
+    bool result = signalled;
+    uv_mutex_unlock(&mutex);
+    return result;
+  }
+
+
+  static uv_once_t deadline_once = UV_ONCE_INIT;
+  static uv_key_t deadline_key;
+
+
+  static uv_once_t job_once = UV_ONCE_INIT;
+  static uv_key_t job_key;
+
+
+  static void
+  CreateDeadlineKey() {
+    uv_key_create(&deadline_key);
+  }
+
+
+  static void
+  CreateJobKey() {
+    uv_key_create(&job_key);
+  }
+
+
+  static double
+  Now() {
+    uv_timeval64_t now;
+    uv_gettimeofday(&now);
+    return now.tv_sec * 1e3 + now.tv_usec / 1e3;
+  }
+
+
+  Deadline::Deadline(double at_)
+    : at(at_)
+  {
+  }
+
+
+  Deadline
+  Deadline::FromOptions(napi_env env, napi_value options) {
+    napi_value value = GetOption(env, options, "deadline");
+    if (!value) {
+      return Deadline();
+    }
+    // Accept Date objects as well as numbers.
+    return Deadline(fromJS<double>(env, value));
+  }
+
+
+  bool
+  Deadline::is_set() const {
+    return at > 0;
+  }
+
+
+  bool
+  Deadline::expired() const {
+    return is_set() && Now() >= at;
+  }
+
+
+  int
+  Deadline::timeout(int fallback) const {
+    if (!is_set()) {
+      return fallback;
+    }
+    double remaining = at - Now();
+    return remaining < 1 ? 1 : remaining > 0x7fffffff ? 0x7fffffff : int(remaining + 0.5);
+  }
+
+
+  Deadline
+  Deadline::current() {
+    uv_once(&deadline_once, CreateDeadlineKey);
+    const Deadline *deadline = static_cast<const Deadline *>(uv_key_get(&deadline_key));
+    return deadline ? *deadline : Deadline();
+  }
+
+
+  void
+  Deadline::enter(const Deadline *deadline) {
+    uv_once(&deadline_once, CreateDeadlineKey);
+    uv_key_set(&deadline_key, const_cast<Deadline *>(deadline));
+  }
+
+
+  Jobs::Jobs()
+    : last_id(0), running_count(0)
+  {
+  }
+
+
+  uint32_t
+  Jobs::add(napi_async_work work) {
+    WrLock lk(lock);
+    if (++last_id == polling_loop) {
+      last_id = 1;
+    }
+    queued[work] = last_id;
+    return last_id;
+  }
+
+
+  void
+  Jobs::remove(napi_async_work work) {
+    WrLock lk(lock);
+    queued.erase(work);
+  }
+
+
+  void
+  Jobs::start(napi_async_work work) {
+    uint32_t id = 0;
+    {
+      WrLock lk(lock);
+      std::map<napi_async_work, uint32_t>::iterator it = queued.find(work);
+      if (it != queued.end()) {
+        id = it->second;
+        queued.erase(it);
+      }
+      ++running_count;
+    }
+    uv_once(&job_once, CreateJobKey);
+    uv_key_set(&job_key, reinterpret_cast<void *>(uintptr_t(id)));
+  }
+
+
+  void
+  Jobs::finish(napi_async_work work) {
+    uv_key_set(&job_key, NULL);
+    WrLock lk(lock);
+    --running_count;
+  }
+
+
+  size_t
+  Jobs::cancel(napi_env env) {
+    std::map<napi_async_work, uint32_t> pending;
+    {
+      RdLock lk(lock);
+      pending = queued;
+    }
+    // Work items are only released on the loop thread, so they stay valid here.  Jobs
+    // which have been picked up by a worker in the meantime will refuse to cancel.
+    size_t count = 0;
+    for (std::map<napi_async_work, uint32_t>::iterator it = pending.begin(); it != pending.end(); ++it) {
+      if (napi_cancel_async_work(env, it->first) == napi_ok) {
+        ++count;
+      }
+    }
+    return count;
+  }
+
+
+  bool
+  Jobs::cancel(napi_env env, uint32_t id) {
+    napi_async_work work = NULL;
+    {
+      RdLock lk(lock);
+      for (std::map<napi_async_work, uint32_t>::iterator it = queued.begin(); it != queued.end(); ++it) {
+        if (it->second == id) {
+          work = it->first;
+        }
+      }
+    }
+    return work && napi_cancel_async_work(env, work) == napi_ok;
+  }
+
+
+  size_t
+  Jobs::running() const {
+    RdLock lk(lock);
+    return running_count;
+  }
+
+
+  void
+  Jobs::dropped(const char operation[]) {
+    WrLock lk(lock);
+    ++deadline_misses[operation].dropped;
+  }
+
+
+  void
+  Jobs::late(const char operation[]) {
+    WrLock lk(lock);
+    ++deadline_misses[operation].late;
+  }
+
+
+  std::map<std::string, Jobs::Misses>
+  Jobs::misses() const {
+    RdLock lk(lock);
+    return deadline_misses;
+  }
+
+
+  uint32_t
+  Jobs::current() {
+    uv_once(&job_once, CreateJobKey);
+    return uint32_t(reinterpret_cast<uintptr_t>(uv_key_get(&job_key)));
+  }
+
+
+  void
+  Jobs::enter(uint32_t id) {
+    uv_once(&job_once, CreateJobKey);
+    uv_key_set(&job_key, reinterpret_cast<void *>(uintptr_t(id)));
+  }
+
+
+  Arguments::Arguments(napi_env env_, napi_callback_info info)
+    : env(env_), count(max_count), self(NULL), new_target(NULL)
+  {
+    napi_get_cb_info(env, info, &count, values, &self, NULL);
+    napi_get_new_target(env, info, &new_target);
+  }
+
+
+  napi_env
+  Arguments::Env() const {
+    return env;
+  }
+
+
+  size_t
+  Arguments::Length() const {
+    return count;
+  }
+
+
+  napi_value
+  Arguments::operator[](size_t index) const {
+    if (index >= count || index >= max_count) {
+      napi_value undefined;
+      napi_get_undefined(env, &undefined);
+      return undefined;
+    }
+    return values[index];
+  }
+
+
+  napi_value
+  Arguments::This() const {
+    return self;
+  }
+
+
+  bool
+  Arguments::IsConstructCall() const {
+    return new_target != NULL;
+  }
+
+
+  size_t
+  Properties::size() const {
+    return descriptors.size();
+  }
+
+
+  const napi_property_descriptor *
+  Properties::data() const {
+    return descriptors.data();
+  }
+
+
+  void
+  Environment::Initialize(napi_env env) {
+    napi_set_instance_data(env, new Environment(env), Finalize, NULL);
+  }
+
+
+  Environment &
+  Environment::Get(napi_env env) {
+    void *data = NULL;
+    napi_get_instance_data(env, &data);
+    assert(data);
+    return *static_cast<Environment *>(data);
+  }
+
+
+  napi_value
+  Environment::constructor(const napi_type_tag *tag) const {
+    std::map<const napi_type_tag *, napi_ref>::const_iterator it = constructors.find(tag);
+    napi_value result = NULL;
+    if (it != constructors.end()) {
+      napi_get_reference_value(env, it->second, &result);
+    }
+    return result;
+  }
+
+
+  void
+  Environment::set_constructor(const napi_type_tag *tag, napi_value constructor) {
+    napi_ref &ref = constructors[tag];
+    if (ref) {
+      napi_delete_reference(env, ref);
+    }
+    napi_create_reference(env, constructor, 1, &ref);
+  }
+
+
+  Environment::Environment(napi_env env_)
+    : env(env_)
+  {
+  }
+
+
+  Environment::~Environment() {
+    for (std::map<const napi_type_tag *, napi_ref>::iterator it = constructors.begin(); it != constructors.end(); ++it) {
+      napi_delete_reference(env, it->second);
+    }
+  }
+
+
+  void
+  Environment::Finalize(napi_env env, void *data, void *hint) {
+    delete static_cast<Environment *>(data);
+  }
+
+
+  napi_value
+  MakeError(napi_env env, const std::string &message) {
+    napi_value text, error;
+    napi_create_string_utf8(env, message.c_str(), message.length(), &text);
+    napi_create_error(env, NULL, text, &error);
+    return error;
+  }
+
+
+  napi_value
+  ThrowError(napi_env env, const std::string &message) {
+    napi_throw_error(env, NULL, message.c_str());
+    return NULL;
+  }
+
+
+  napi_value
+  ThrowTypeError(napi_env env, const std::string &message) {
+    napi_throw_type_error(env, NULL, message.c_str());
+    return NULL;
+  }
+
+
+  bool
+  IsObject(napi_env env, napi_value value) {
+    napi_valuetype type;
+    return napi_typeof(env, value, &type) == napi_ok && type == napi_object;
+  }
+
+
+  bool
+  IsFunction(napi_env env, napi_value value) {
+    napi_valuetype type;
+    return napi_typeof(env, value, &type) == napi_ok && type == napi_function;
+  }
+
+
+  bool
+  IsNumber(napi_env env, napi_value value) {
+    napi_valuetype type;
+    return napi_typeof(env, value, &type) == napi_ok && type == napi_number;
+  }
+
+
+  napi_value
+  GetOption(napi_env env, napi_value options, const char name[]) {
+    if (!IsObject(env, options)) {
+      return NULL;
+    }
+    napi_value value;
+    napi_valuetype type;
+    if (napi_get_named_property(env, options, name, &value) != napi_ok ||
+        napi_typeof(env, value, &type) != napi_ok || type == napi_undefined) {
+      return NULL;
+    }
+    return value;
+  }
+
+
   Null null;
 
 }
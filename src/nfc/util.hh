@@ -2,7 +2,11 @@
 #define NFC_UTIL_HH
 
 #include "type_traits.hh"
-#include <node.h>
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <node_api.h>
+#include <set>
 #include <string>
 #include <uv.h>
 #include <vector>
@@ -59,6 +63,103 @@ namespace nfc {
   };
 
 
+  class Event {
+    mutable uv_mutex_t mutex;
+    uv_cond_t cond;
+    bool signalled;
+
+  public:
+    Event();
+    ~Event();
+
+    void set();
+    void reset();
+    bool is_set() const;
+
+    // Waits at most timeout milliseconds, returns whether the event was set.
+    bool wait(uint64_t timeout);
+
+  private:
+    // non-copyable
+    Event(const Event &);
+    Event &operator=(const Event &);
+  };
+
+
+  // Absolute deadline in milliseconds since the epoch, as counted by Date.now().
+  class Deadline {
+    double at;  // 0 if there is none
+
+  public:
+    Deadline(double at = 0);
+
+    // Reads the "deadline" property of an options object.
+    static Deadline FromOptions(napi_env env, napi_value options);
+
+    bool is_set() const;
+    bool expired() const;
+    // Remaining time as a libnfc timeout (at least 1ms), or the fallback without deadline.
+    int timeout(int fallback) const;
+
+    // Deadline of the job running on the calling thread.
+    static Deadline current();
+    static void enter(const Deadline *deadline);
+  };
+
+
+  class Jobs {
+  public:
+    struct Misses {
+      uint32_t dropped;  // expired before they were started
+      uint32_t late;     // completed after the deadline
+
+      Misses() : dropped(0), late(0) {}
+    };
+
+  private:
+    Lock lock;
+    std::map<napi_async_work, uint32_t> queued;
+    uint32_t last_id;
+    size_t running_count;
+    std::map<std::string, Misses> deadline_misses;
+
+  public:
+    Jobs();
+
+    // Called on the loop thread when a job is scheduled or completed.  Jobs are numbered from 1.
+    uint32_t add(napi_async_work work);
+    void remove(napi_async_work work);
+
+    // Called on the worker thread around the actual work.
+    void start(napi_async_work work);
+    void finish(napi_async_work work);
+
+    // Cancels all jobs that have not been started yet (loop thread only).
+    size_t cancel(napi_env env);
+    // Cancels one job if it has not been started yet (loop thread only).
+    bool cancel(napi_env env, uint32_t id);
+    size_t running() const;
+
+    // Number of the job running on the calling thread, 0 outside of jobs.
+    static uint32_t current();
+    // Gives the calling thread, which runs no jobs, a number such as polling_loop.
+    static void enter(uint32_t id);
+
+    // Number of the native polling loop, never given to jobs.
+    static const uint32_t polling_loop = 0xffffffff;
+
+    // Deadline misses, counted per operation.
+    void dropped(const char operation[]);
+    void late(const char operation[]);
+    std::map<std::string, Misses> misses() const;
+
+  private:
+    // non-copyable
+    Jobs(const Jobs &);
+    Jobs &operator=(const Jobs &);
+  };
+
+
   template<class S, typename T>
   class RawObject {
     Lock local_lock;
@@ -76,6 +177,8 @@ namespace nfc {
     RawObject &operator=(const RawObject &other);
 
     bool dismiss();
+    // Replaces the value for all copies, destroying the previous one.
+    void reset(T *value);
 
     T *get();
     const T *get() const;
@@ -87,32 +190,119 @@ namespace nfc {
   };
 
 
+  class Arguments {
+  public:
+    static const size_t max_count = 8;
+
+  private:
+    napi_env env;
+    size_t count;
+    napi_value values[max_count];
+    napi_value self;
+    napi_value new_target;
+
+  public:
+    Arguments(napi_env env, napi_callback_info info);
+
+    napi_env Env() const;
+    size_t Length() const;
+    napi_value operator[](size_t index) const;
+    napi_value This() const;
+    bool IsConstructCall() const;
+  };
+
+
+  typedef napi_value (*handler_t)(const Arguments &args);
+
+  template<handler_t H>
+  napi_value Callback(napi_env env, napi_callback_info info);
+
+
+  class Properties {
+    std::vector<napi_property_descriptor> descriptors;
+
+  public:
+    template<handler_t H>
+    void method(const char name[]);
+    template<handler_t H>
+    void accessor(const char name[]);
+    // on the constructor
+    template<handler_t H>
+    void static_method(const char name[]);
+
+    size_t size() const;
+    const napi_property_descriptor *data() const;
+  };
+
+
+  napi_value MakeError(napi_env env, const std::string &message);
+  napi_value ThrowError(napi_env env, const std::string &message);
+  napi_value ThrowTypeError(napi_env env, const std::string &message);
+
+  bool IsObject(napi_env env, napi_value value);
+  bool IsFunction(napi_env env, napi_value value);
+  bool IsNumber(napi_env env, napi_value value);
+
+  // Returns the named property of an options object, or NULL if not given.
+  napi_value GetOption(napi_env env, napi_value options, const char name[]);
+  template<typename T>
+  T GetOption(napi_env env, napi_value options, const char name[], const T &fallback);
+
+
+  // Per-environment state, so that every worker thread gets its own set of classes.
+  class Environment {
+    napi_env env;
+    std::map<const napi_type_tag *, napi_ref> constructors;
+
+  public:
+    static void Initialize(napi_env env);
+    static Environment &Get(napi_env env);
+
+    napi_value constructor(const napi_type_tag *tag) const;
+    void set_constructor(const napi_type_tag *tag, napi_value constructor);
+
+  private:
+    Environment(napi_env env);
+    ~Environment();
+
+    static void Finalize(napi_env env, void *data, void *hint);
+
+    // non-copyable
+    Environment(const Environment &);
+    Environment &operator=(const Environment &);
+  };
+
+
   template<class T>
-  class ObjectWrap:
-    public node::ObjectWrap
-  {
+  class ObjectWrap {
   protected:
-    static void Prepare(v8::Handle<v8::FunctionTemplate> &tpl, v8::Local<v8::ObjectTemplate> &proto);
-    static void Install(const char name[], v8::Handle<v8::Object> &exports, v8::Local<v8::FunctionTemplate> &tpl);
+    static void Install(napi_env env, const char name[], napi_value exports, const Properties &properties);
 
-    static T *Create(const v8::Arguments &args);
+    static T *Create(const Arguments &args);
     template<typename A0>
-    static T *Create(const v8::Arguments &args);
+    static T *Create(const Arguments &args);
     template<typename A0, typename A1>
-    static T *Create(const v8::Arguments &args);
+    static T *Create(const Arguments &args);
+
+    static napi_value CheckNew(napi_env env, napi_value instance);
 
-    static v8::Handle<v8::Value> CheckNew(v8::Handle<v8::Value> instance);
+    static napi_value New(const Arguments &args);
+    static void Finalize(napi_env env, void *data, void *hint);
 
-    static v8::Handle<v8::Value> New(const v8::Arguments &args);
+    static napi_value Constructor(napi_env env);
 
-    static v8::Handle<v8::Value> Construct();
+    static napi_value Construct(napi_env env);
     template<typename A0>
-    static v8::Handle<v8::Value> Construct(const A0 &a0);
+    static napi_value Construct(napi_env env, const A0 &a0);
     template<typename A0, typename A1>
-    static v8::Handle<v8::Value> Construct(const A0 &a0, const A1 &a1);
+    static napi_value Construct(napi_env env, const A0 &a0, const A1 &a1);
+
+  public:
+    static T &Unwrap(napi_env env, napi_value value);
 
   public:
-    static T &Unwrap(v8::Handle<v8::Value> value);
+    // Asynchronous jobs scheduled on this instance.
+    Jobs jobs;
   };
 
 
@@ -120,26 +310,37 @@ namespace nfc {
   class AsyncRunner {
   protected:
     typedef void (*run_handler_t)(T &instance, D &data);
-    typedef v8::Handle<v8::Value> (*after_handler_t)(v8::Handle<v8::Object> instance, D &data);
+    typedef napi_value (*after_handler_t)(napi_env env, napi_value instance, D &data);
 
     struct Descriptor {
-      Descriptor(run_handler_t run_handler, after_handler_t after_handler,
-                 v8::Handle<v8::Object> instance, v8::Handle<v8::Function> callback, const D &data);
-      uv_work_t req;
+      Descriptor(napi_env env, const char operation[], const Deadline &deadline, run_handler_t run_handler,
+                 after_handler_t after_handler, napi_value instance, const D &data);
+      ~Descriptor();
+      napi_env env;
+      napi_async_work work;
+      napi_deferred deferred;
       run_handler_t run_handler;
       after_handler_t after_handler;
-      v8::Persistent<v8::Object> instance;
-      v8::Persistent<v8::Function> callback;
+      napi_ref instance;
       T &raw_instance;
+      const char *operation;
+      Deadline deadline;
+      bool dropped;
       D data;
     };
 
-    static void run_async(uv_work_t *req);
-    static void after_async(uv_work_t *req, int status);
+    static void run_async(napi_env env, void *data);
+    static void after_async(napi_env env, napi_status status, void *data);
 
   public:
-    static v8::Handle<v8::Value> Schedule(run_handler_t run_handler, after_handler_t after_handler,
-                                          v8::Handle<v8::Value> instance, v8::Handle<v8::Value> callback, const D &data = D());
+    // Returns a promise which settles with the result of the "after" handler, with the job number in
+    // its "job" property.
+    static napi_value Schedule(run_handler_t run_handler, after_handler_t after_handler,
+                               napi_env env, napi_value instance, const D &data = D());
+    // Same, but drops the job if its deadline passes before it is started.
+    static napi_value Schedule(const char operation[], const Deadline &deadline,
+                               run_handler_t run_handler, after_handler_t after_handler,
+                               napi_env env, napi_value instance, const D &data = D());
   };
 
 
@@ -148,23 +349,23 @@ namespace nfc {
 
   template<typename T, class Enable = void>
   struct Convert {
-    // static T fromV8(v8::Handle<v8::Value> value);
-    // static v8::Handle<v8::Value> toV8(const T &value);
+    // static T fromJS(napi_env env, napi_value value);
+    // static napi_value toJS(napi_env env, const T &value);
   };
 
   template<typename T>
-  T fromV8(v8::Handle<v8::Value> value);
+  T fromJS(napi_env env, napi_value value);
 
   template<typename T>
-  v8::Handle<v8::Value> toV8(const T &value);
+  napi_value toJS(napi_env env, const T &value);
 
 
   template<typename T>
-  v8::Handle<v8::Value> toExternal(const T &value);
+  napi_value toExternal(napi_env env, const T &value);
 
 
   template<typename T>
-  T fromExternal(v8::Handle<v8::Value> value);
+  T fromExternal(napi_env env, napi_value value);
 
 }
 
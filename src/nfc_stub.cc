@@ -0,0 +1,345 @@
+// Simulated libnfc for the tests, which run without a reader: one device, with an ISO 14443-A
+// tag in the field while NFC_STUB_CARD is set in the environment.  Commands echo what they are
+// sent, taking NFC_STUB_DELAY ms (default 0); polls take poll_time ms.  All waits can be aborted.
+#include <nfc/nfc.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <uv.h>
+
+
+struct nfc_context {
+  int devices;
+};
+
+
+struct nfc_device {
+  std::string connstring;
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  bool aborted;
+  int last_error;
+};
+
+
+namespace {
+
+  const char connstring[] = "stub:0";
+  const unsigned poll_time = 20;
+  const uint8_t uid[] = {0x04, 0x51, 0x7a, 0x12, 0x9c, 0x3f, 0x80};
+
+  const nfc_modulation_type modulation_types[] = {NMT_ISO14443A, nfc_modulation_type(0)};
+  const nfc_baud_rate baud_rates[] = {NBR_106, NBR_UNDEFINED};
+
+
+  bool
+  HasCard() {
+    const char *card = std::getenv("NFC_STUB_CARD");
+    return card && *card && std::strcmp(card, "0");
+  }
+
+
+  unsigned
+  Delay() {
+    const char *delay = std::getenv("NFC_STUB_DELAY");
+    return delay ? unsigned(std::atoi(delay)) : 0;
+  }
+
+
+  // Waits ms, or until the command is aborted.
+  int
+  Wait(nfc_device *device, unsigned ms) {
+    const uint64_t end = uv_hrtime() + uint64_t(ms) * 1000000;
+    uv_mutex_lock(&device->mutex);
+    for (uint64_t now = uv_hrtime(); !device->aborted && now < end; now = uv_hrtime()) {
+      uv_cond_timedwait(&device->cond, &device->mutex, end - now);
+    }
+    const bool aborted = device->aborted;
+    device->aborted = false;
+    uv_mutex_unlock(&device->mutex);
+    return aborted ? NFC_EOPABORTED : NFC_SUCCESS;
+  }
+
+
+  int
+  Result(nfc_device *device, int result) {
+    device->last_error = result < 0 ? result : NFC_SUCCESS;
+    return result;
+  }
+
+
+  void
+  FillTarget(nfc_target *target) {
+    std::memset(target, 0, sizeof(*target));
+    target->nm.nmt = NMT_ISO14443A;
+    target->nm.nbr = NBR_106;
+    nfc_iso14443a_info &info = target->nti.nai;
+    info.abtAtqa[1] = 0x44;
+    info.btSak = 0x00;
+    info.szUidLen = sizeof(uid);
+    std::memcpy(info.abtUid, uid, sizeof(uid));
+  }
+
+}
+
+
+extern "C" {
+
+  void
+  nfc_init(nfc_context **context) {
+    *context = new nfc_context();
+    (*context)->devices = 0;
+  }
+
+
+  void
+  nfc_exit(nfc_context *context) {
+    delete context;
+  }
+
+
+  const char *
+  nfc_version(void) {
+    return "stub";
+  }
+
+
+  size_t
+  nfc_list_devices(nfc_context *context, nfc_connstring connstrings[], size_t connstrings_len) {
+    if (!connstrings_len) {
+      return 0;
+    }
+    std::strncpy(connstrings[0], connstring, sizeof(nfc_connstring) - 1);
+    connstrings[0][sizeof(nfc_connstring) - 1] = 0;
+    return 1;
+  }
+
+
+  nfc_device *
+  nfc_open(nfc_context *context, const nfc_connstring connstring_) {
+    if (connstring_ && std::strcmp(connstring_, connstring)) {
+      return NULL;
+    }
+    nfc_device *device = new nfc_device();
+    device->connstring = connstring;
+    uv_mutex_init(&device->mutex);
+    uv_cond_init(&device->cond);
+    device->aborted = false;
+    device->last_error = NFC_SUCCESS;
+    ++context->devices;
+    return device;
+  }
+
+
+  void
+  nfc_close(nfc_device *device) {
+    uv_cond_destroy(&device->cond);
+    uv_mutex_destroy(&device->mutex);
+    delete device;
+  }
+
+
+  int
+  nfc_abort_command(nfc_device *device) {
+    uv_mutex_lock(&device->mutex);
+    device->aborted = true;
+    uv_cond_signal(&device->cond);
+    uv_mutex_unlock(&device->mutex);
+    return NFC_SUCCESS;
+  }
+
+
+  int
+  nfc_idle(nfc_device *device) {
+    return Result(device, NFC_SUCCESS);
+  }
+
+
+  int
+  nfc_initiator_init(nfc_device *device) {
+    return Result(device, NFC_SUCCESS);
+  }
+
+
+  int
+  nfc_initiator_select_passive_target(nfc_device *device, const nfc_modulation nm, const uint8_t *pbtInitData,
+                                      const size_t szInitData, nfc_target *pnt) {
+    if (nm.nmt != NMT_ISO14443A || !HasCard()) {
+      return Result(device, 0);
+    }
+    if (szInitData && (szInitData != sizeof(uid) || std::memcmp(pbtInitData, uid, sizeof(uid)))) {
+      return Result(device, 0);
+    }
+    if (pnt) {
+      FillTarget(pnt);
+    }
+    return Result(device, 1);
+  }
+
+
+  int
+  nfc_initiator_poll_target(nfc_device *device, const nfc_modulation *pnmTargetTypes, const size_t szTargetTypes,
+                            const uint8_t uiPollNr, const uint8_t uiPeriod, nfc_target *pnt) {
+    int result = Wait(device, poll_time);
+    if (result < 0) {
+      return Result(device, result);
+    }
+    for (size_t i = 0; i < szTargetTypes; ++i) {
+      if (pnmTargetTypes[i].nmt == NMT_ISO14443A && HasCard()) {
+        FillTarget(pnt);
+        return Result(device, 1);
+      }
+    }
+    return Result(device, 0);
+  }
+
+
+  int
+  nfc_initiator_select_dep_target(nfc_device *device, const nfc_dep_mode ndm, const nfc_baud_rate nbr,
+                                  const nfc_dep_info *pndiInitiator, nfc_target *pnt, const int timeout) {
+    return Result(device, 0);
+  }
+
+
+  int
+  nfc_initiator_deselect_target(nfc_device *device) {
+    return Result(device, NFC_SUCCESS);
+  }
+
+
+  int
+  nfc_initiator_transceive_bytes(nfc_device *device, const uint8_t *pbtTx, const size_t szTx, uint8_t *pbtRx,
+                                 const size_t szRx, int timeout) {
+    int result = Wait(device, Delay());
+    if (result < 0) {
+      return Result(device, result);
+    }
+    if (!HasCard()) {
+      return Result(device, NFC_ERFTRANS);
+    }
+    if (szTx > szRx) {
+      return Result(device, NFC_EOVFLOW);
+    }
+    std::memcpy(pbtRx, pbtTx, szTx);
+    return Result(device, int(szTx));
+  }
+
+
+  int
+  nfc_initiator_transceive_bits(nfc_device *device, const uint8_t *pbtTx, const size_t szTxBits,
+                                const uint8_t *pbtTxPar, uint8_t *pbtRx, const size_t szRx, uint8_t *pbtRxPar) {
+    if (!HasCard()) {
+      return Result(device, NFC_ERFTRANS);
+    }
+    const size_t size = (szTxBits + 7) / 8;
+    if (size > szRx) {
+      return Result(device, NFC_EOVFLOW);
+    }
+    std::memcpy(pbtRx, pbtTx, size);
+    if (pbtTxPar && pbtRxPar) {
+      std::memcpy(pbtRxPar, pbtTxPar, size);
+    }
+    return Result(device, int(szTxBits));
+  }
+
+
+  int
+  nfc_initiator_target_is_present(nfc_device *device, const nfc_target *pnt) {
+    return Result(device, HasCard() ? NFC_SUCCESS : NFC_ETGRELEASED);
+  }
+
+
+  int
+  nfc_target_init(nfc_device *device, nfc_target *pnt, uint8_t *pbtRx, const size_t szRx, int timeout) {
+    return Result(device, NFC_ETIMEOUT);
+  }
+
+
+  int
+  nfc_target_send_bytes(nfc_device *device, const uint8_t *pbtTx, const size_t szTx, int timeout) {
+    return Result(device, NFC_ETIMEOUT);
+  }
+
+
+  int
+  nfc_target_receive_bytes(nfc_device *device, uint8_t *pbtRx, const size_t szRx, int timeout) {
+    return Result(device, NFC_ETIMEOUT);
+  }
+
+
+  int
+  nfc_device_get_last_error(const nfc_device *device) {
+    return device->last_error;
+  }
+
+
+  const char *
+  nfc_device_get_name(nfc_device *device) {
+    return "Simulated Reader";
+  }
+
+
+  const char *
+  nfc_device_get_connstring(nfc_device *device) {
+    return device->connstring.c_str();
+  }
+
+
+  int
+  nfc_device_get_supported_modulation(nfc_device *device, const nfc_mode mode,
+                                      const nfc_modulation_type **const supported_mt) {
+    *supported_mt = modulation_types;
+    return NFC_SUCCESS;
+  }
+
+
+  int
+  nfc_device_get_supported_baud_rate(nfc_device *device, const nfc_modulation_type nmt,
+                                     const nfc_baud_rate **const supported_br) {
+    *supported_br = baud_rates;
+    return NFC_SUCCESS;
+  }
+
+
+  int
+  nfc_device_set_property_int(nfc_device *device, const nfc_property property, const int value) {
+    return Result(device, NFC_SUCCESS);
+  }
+
+
+  int
+  nfc_device_set_property_bool(nfc_device *device, const nfc_property property, const bool bEnable) {
+    return Result(device, NFC_SUCCESS);
+  }
+
+
+  void
+  nfc_free(void *p) {
+    std::free(p);
+  }
+
+
+  const char *
+  str_nfc_modulation_type(const nfc_modulation_type nmt) {
+    return nmt == NMT_ISO14443A ? "ISO/IEC 14443A" : "???";
+  }
+
+
+  const char *
+  str_nfc_baud_rate(const nfc_baud_rate nbr) {
+    return nbr == NBR_106 ? "106 kbps" : "???";
+  }
+
+
+  int
+  str_nfc_target(char **buf, const nfc_target *pnt, bool verbose) {
+    const char description[] = "ISO/IEC 14443A (106 kbps) target";
+    *buf = static_cast<char *>(std::malloc(sizeof(description)));
+    if (!*buf) {
+      return NFC_ESOFT;
+    }
+    std::memcpy(*buf, description, sizeof(description));
+    return int(sizeof(description) - 1);
+  }
+
+}
@@ -0,0 +1,54 @@
+// Runs the glue layer microbenchmarks and prints the results as JSON.
+// Build them with: cd src && node-gyp rebuild -- -Dbuild_bench=true
+var bench = require(process.argv[2] || '../src/build/Release/bench.node');
+
+var results = [];
+
+function record(name, params, result) {
+    results.push(Object.assign({name: name}, params, result));
+}
+
+function dispatch(count, parallel) {
+    var payload = bench.makePayload();
+    var queue = 0, complete = 0, start = process.hrtime();
+    var run = done => {
+        if (done === count) {
+            return Promise.resolve();
+        }
+        var batch = [];
+        for (var i = 0; i < parallel && done + i < count; ++i) {
+            batch.push(bench.dispatch(payload).then(times => {
+                queue += times.queue;
+                complete += times.complete;
+            }));
+        }
+        return Promise.all(batch).then(() => run(done + batch.length));
+    };
+    return run(0).then(() => {
+        var elapsed = process.hrtime(start);
+        var ns = elapsed[0] * 1e9 + elapsed[1];
+        record('asyncRunnerDispatch', {parallel: parallel}, {
+            iterations: count, ns: ns, nsPerOp: ns / count, queueNs: queue / count, completeNs: complete / count
+        });
+    });
+}
+
+record('rawObjectCopy', {}, bench.rawObjectCopy(1000000));
+[2, 4, 8].forEach(threads => {
+    record('rawObjectContention', {threads: threads}, bench.rawObjectContention(threads, 200000));
+});
+[16, 256, 4096].forEach(size => {
+    record('bufferToJS', {size: size}, bench.bufferToJS(size, 100000));
+    record('bufferFromJS', {size: size}, bench.bufferFromJS(Buffer.alloc(size), 100000));
+});
+record('bufferFromJS', {size: 256, input: 'array'}, bench.bufferFromJS(Array(256).fill(0), 20000));
+record('construct', {}, bench.construct(100000));
+
+dispatch(2000, 1).then(() => dispatch(20000, 64)).then(() => {
+    console.log(JSON.stringify({
+        node: process.version,
+        napi: process.versions.napi,
+        platform: process.platform + '-' + process.arch,
+        results: results
+    }, null, 2));
+});
@@ -0,0 +1,250 @@
+// Runs the reader daemon protocol (see src/nfc/daemon.hh) end to end on the simulated libnfc: framing,
+// the per-client request cap, claims and contention, and the fan-out of tag events.
+// Build it with: cd src && node-gyp rebuild -- -Dbuild_tests=true
+var assert = require('assert')
+  , net = require('net')
+  , os = require('os')
+  , path = require('path')
+  , fs = require('fs');
+
+var nfc = require(process.argv[2] || '../src/build/Release/nfc_stub.node');
+
+var frames = {
+    subscribe: 0x01, unsubscribe: 0x02, claim: 0x03, release: 0x04, transceive: 0x05,
+    ok: 0x80, error: 0x81, target: 0x90, removed: 0x91
+};
+var NFC_EINVARG = -2, NFC_EOVFLOW = -5, NFC_ETIMEOUT = -6;
+var uid = [0x04, 0x51, 0x7a, 0x12, 0x9c, 0x3f, 0x80];  // of the simulated card
+
+
+// Speaks the protocol byte by byte, and keeps everything the daemon sends.
+class Client {
+    constructor(socketPath) {
+        this.socket = net.connect(socketPath);
+        this.input = Buffer.alloc(0);
+        this.received = [];
+        this.waiting = [];
+        this.closed = new Promise(resolve => this.socket.on('close', resolve));
+        this.socket.on('error', () => {});
+        this.socket.on('data', data => this.receive(data));
+    }
+
+    static frame(type, id, payload=[]) {
+        var header = Buffer.alloc(9);
+        header.writeUInt32BE(5 + payload.length, 0);
+        header.writeUInt8(type, 4);
+        header.writeUInt32BE(id, 5);
+        return Buffer.concat([header, Buffer.from(payload)]);
+    }
+
+    static transceive(id, data, capacity=256) {
+        return Client.frame(frames.transceive, id, [capacity >> 8, capacity & 0xff].concat(data));
+    }
+
+    static claim(id, timeout) {
+        var payload = Buffer.alloc(4);
+        payload.writeUInt32BE(timeout, 0);
+        return Client.frame(frames.claim, id, payload);
+    }
+
+    send(data) {
+        this.socket.write(data);
+    }
+
+    // One byte per write, to see the daemon put frames together again.
+    trickle(data) {
+        var write = offset => {
+            if (offset < data.length) {
+                this.socket.write(data.slice(offset, offset + 1), () => setTimeout(() => write(offset + 1), 1));
+            }
+        };
+        write(0);
+    }
+
+    receive(data) {
+        this.input = Buffer.concat([this.input, data]);
+        while (this.input.length >= 4 && this.input.length >= 4 + this.input.readUInt32BE(0)) {
+            var length = this.input.readUInt32BE(0);
+            this.received.push({
+                type: this.input[4], id: this.input.readUInt32BE(5), payload: this.input.slice(9, 4 + length)
+            });
+            this.input = this.input.slice(4 + length);
+        }
+        this.waiting = this.waiting.filter(waiter => !this.match(waiter));
+    }
+
+    match(waiter) {
+        var index = this.received.findIndex(waiter.predicate);
+        if (index < 0) {
+            return false;
+        }
+        waiter.resolve(this.received.splice(index, 1)[0]);
+        return true;
+    }
+
+    // The first frame received which matches, taken from the received ones.
+    next(predicate, timeout=2000) {
+        return new Promise((resolve, reject) => {
+            var timer = setTimeout(() => reject(new Error('no answer within ' + timeout + ' ms')), timeout);
+            var waiter = {predicate: predicate, resolve: frame => {
+                clearTimeout(timer);
+                resolve(frame);
+            }};
+            if (!this.match(waiter)) {
+                this.waiting.push(waiter);
+            }
+        });
+    }
+
+    answer(id, timeout) {
+        return this.next(frame => frame.id === id && (frame.type === frames.ok || frame.type === frames.error),
+                         timeout);
+    }
+
+    event(type) {
+        return this.next(frame => frame.id === 0 && frame.type === type);
+    }
+
+    close() {
+        this.socket.end();
+        return this.closed;
+    }
+}
+
+
+function error(frame) {
+    assert.strictEqual(frame.type, frames.error);
+    return {code: frame.payload.readInt32BE(0), message: frame.payload.slice(4).toString()};
+}
+
+
+async function framing(socketPath) {
+    var client = new Client(socketPath);
+    client.trickle(Client.transceive(1, [1, 2, 3]));
+    var answer = await client.answer(1);
+    assert.strictEqual(answer.type, frames.ok);
+    assert.deepStrictEqual([...answer.payload], [1, 2, 3]);
+
+    // Several frames in one write, answered in order.
+    client.send(Buffer.concat([Client.transceive(2, [4]), Client.transceive(3, [5, 6])]));
+    assert.deepStrictEqual([...(await client.answer(2)).payload], [4]);
+    assert.deepStrictEqual([...(await client.answer(3)).payload], [5, 6]);
+
+    client.send(Client.frame(0x7f, 4));
+    assert.strictEqual(error(await client.answer(4)).code, NFC_EINVARG);
+    client.send(Client.frame(frames.transceive, 5, [0]));
+    assert.strictEqual(error(await client.answer(5)).code, NFC_EINVARG);
+
+    // A length beyond the largest frame ends the connection.
+    var header = Buffer.alloc(9);
+    header.writeUInt32BE(0x20000, 0);
+    client.send(header);
+    await client.closed;
+}
+
+
+async function overflow(socketPath) {
+    var client = new Client(socketPath);
+    process.env.NFC_STUB_DELAY = '50';
+    var requests = [];
+    for (var id = 1; id <= 8; ++id) {
+        requests.push(Client.transceive(id, [id]));
+    }
+    client.send(Buffer.concat(requests));
+    var answers = [];
+    for (id = 1; id <= 8; ++id) {
+        answers.push(await client.answer(id));
+    }
+    delete process.env.NFC_STUB_DELAY;
+
+    // maxRequests is 4: the rest are refused rather than queued.
+    var refused = answers.filter(answer => answer.type === frames.error).map(error);
+    assert.ok(answers.length - refused.length >= 4, 'maxRequests accepted');
+    assert.ok(refused.length >= 3, 'requests beyond maxRequests refused');
+    refused.forEach(answer => {
+        assert.deepStrictEqual(answer, {code: NFC_EOVFLOW, message: 'too many queued requests'});
+    });
+    await client.close();
+}
+
+
+async function claims(socketPath, daemon) {
+    var owner = new Client(socketPath), other = new Client(socketPath);
+    owner.send(Client.claim(1, 1000));
+    assert.strictEqual((await owner.answer(1)).type, frames.ok);
+
+    // The other client waits for the claim to end, or gives up when its own claim times out.
+    other.send(Client.transceive(1, [7]));
+    other.send(Client.claim(2, 100));
+    assert.deepStrictEqual(error(await other.answer(2)),
+                           {code: NFC_ETIMEOUT, message: 'reader claimed by another client'});
+    assert.ok(!other.received.some(frame => frame.id === 1), 'no command while the reader is claimed');
+    owner.send(Client.transceive(2, [8]));
+    assert.deepStrictEqual([...(await owner.answer(2)).payload], [8]);
+
+    owner.send(Client.frame(frames.release, 3));
+    assert.strictEqual((await owner.answer(3)).type, frames.ok);
+    assert.deepStrictEqual([...(await other.answer(1)).payload], [7]);
+
+    var stats = daemon.stats;
+    assert.strictEqual(stats.claims, 1);
+    assert.strictEqual(stats.contended, 2);
+    await Promise.all([owner.close(), other.close()]);
+}
+
+
+async function events(socketPath, daemon) {
+    var first = new Client(socketPath), second = new Client(socketPath), bystander = new Client(socketPath);
+    first.send(Client.frame(frames.subscribe, 1));
+    second.send(Client.frame(frames.subscribe, 1));
+    await Promise.all([first.answer(1), second.answer(1)]);
+    assert.strictEqual(daemon.stats.subscribers, 2);
+
+    // Every subscriber gets each event, with the card type and the serialized target.
+    var targets = await Promise.all([first.event(frames.target), second.event(frames.target)]);
+    targets.forEach(event => {
+        var length = event.payload[0];
+        assert.ok(event.payload.toString('utf8', 1, 1 + length).length > 0, 'card type');
+        var target = nfc.Target.deserialize(event.payload.slice(1 + length));
+        assert.deepStrictEqual([...target.info.uid], uid);
+    });
+    process.env.NFC_STUB_CARD = '0';
+    await Promise.all([first.event(frames.removed), second.event(frames.removed)]);
+    assert.ok(!bystander.received.length, 'no events without subscribing');
+    assert.ok(daemon.stats.events >= 2);
+
+    // Only those still subscribed get the next one.
+    first.send(Client.frame(frames.unsubscribe, 2));
+    await first.answer(2);
+    process.env.NFC_STUB_CARD = '1';
+    await second.event(frames.target);
+    assert.ok(!first.received.some(frame => frame.type === frames.target), 'no events after unsubscribing');
+    await Promise.all([first.close(), second.close(), bystander.close()]);
+}
+
+
+async function main() {
+    var socketPath = path.join(os.tmpdir(), 'nfc-daemon-test-' + process.pid + '.sock');
+    var context = new nfc.Context();
+    var device = await context.open();
+    var daemon = device.serve(socketPath, {pollInterval: 20, claimTimeout: 1000, maxRequests: 4});
+    device.close();
+    process.env.NFC_STUB_CARD = '1';
+    try {
+        var tests = [framing, overflow, claims, events];
+        for (var i = 0; i < tests.length; ++i) {
+            await tests[i](socketPath, daemon);
+            console.log('ok ' + (i + 1) + ' ' + tests[i].name);
+        }
+    }
+    finally {
+        daemon.close();
+    }
+    assert.ok(!fs.existsSync(socketPath), 'socket removed on close');
+}
+
+
+main().catch(reason => {
+    console.error(reason);
+    process.exitCode = 1;
+});
@@ -0,0 +1,65 @@
+// Times pollTarget and transceive round trips through the public API and prints the results as JSON.
+// Needs a reader with a card on it.  Written for every release of the binding, the V8 one included,
+// so that both builds can be compared on the same reader and card (see README.md, Benchmarks).
+// Usage: node test/latency_bench.js [module (../dist/nfc)] [command (hex, 30 00)] [iterations]
+var nfc = require(process.argv[2] || '../dist/nfc');
+
+var hex = process.argv[3] || '3000'
+  , command = Buffer.from ? Buffer.from(hex, 'hex') : new Buffer(hex, 'hex')
+  , iterations = parseInt(process.argv[4] || '500', 10);
+
+function now() {
+    var time = process.hrtime();
+    return time[0] * 1e3 + time[1] / 1e6;
+}
+
+function summary(name, times) {
+    times.sort(function (a, b) { return a - b; });
+    var total = times.reduce(function (sum, time) { return sum + time; }, 0);
+    return {
+        name: name, iterations: times.length, meanMs: total / times.length,
+        p50Ms: times[Math.floor(times.length * 0.5)], p99Ms: times[Math.floor(times.length * 0.99)]
+    };
+}
+
+function repeat(count, run) {
+    var times = [];
+    var next = function () {
+        if (times.length === count) {
+            return times;
+        }
+        var start = now();
+        return run().then(function () {
+            times.push(now() - start);
+            return next();
+        });
+    };
+    return next();
+}
+
+nfc.open().then(function (device) {
+    var results = [];
+    return device.pollTarget(5000).then(function (target) {
+        if (!target) {
+            throw new Error('no card');
+        }
+        return repeat(iterations, function () { return device.transceive(command); });
+    }).then(function (times) {
+        results.push(summary('transceive', times));
+        // Polls which find the card straight away.
+        return repeat(Math.ceil(iterations / 10), function () { return device.pollTarget(); });
+    }).then(function (times) {
+        results.push(summary('pollTarget', times));
+        console.log(JSON.stringify({
+            node: process.version,
+            platform: process.platform + '-' + process.arch,
+            command: command.toString('hex'),
+            results: results
+        }, null, 2));
+    }).finally(function () {
+        device.close();
+    });
+}).catch(function (reason) {
+    console.error('latency bench: ' + reason);
+    process.exitCode = 1;
+});